@@ -50,6 +50,8 @@
 #include <sys/time.h>
 
 #include "spa.h"
+#include "spa_modes.h"
+#include "spa_modes_gen.h"
 
 
 
@@ -6716,6 +6718,321 @@ static int is_protected_function(char *line){
 }
 
 
+static const struct spa_mode        *spa_mode;      /* Instrumentation mode (__SPA_MODE) */
+static const struct spa_mode_layout *spa_layout;    /* Its prologue length and magic     */
+static u8   spa_instrument_calls;                   /* Instrument direct/indirect calls  */
+static u8   spa_ranges_enabled;                     /* Emit SPA_RANGES_SECTION           */
+static u32  spa_range_cnt;
+
+// the address range of an instrumentation sequence, see spa-prof.c
+static void spa_range_begin(FILE *outf){
+    if(spa_ranges_enabled){
+        fprintf(outf, ".Lspa_range_%u:\n", spa_range_cnt);
+    }
+}
+
+static void spa_range_end(FILE *outf){
+    if(!spa_ranges_enabled){
+        return;
+    }
+    fprintf(outf, ".Lspa_range_end_%u:\n", spa_range_cnt);
+    fprintf(outf, "\t.pushsection\t" SPA_RANGES_SECTION ",\"\",@progbits\n");
+    fprintf(outf, "\t.quad\t.Lspa_range_%u, .Lspa_range_end_%u\n", spa_range_cnt, spa_range_cnt);
+    fprintf(outf, "\t.popsection\n");
+    spa_range_cnt++;
+}
+
+// delete the comments at the end of an instruction
+static void spa_strip_comment(char *line){
+    // FIXME: a little ugly
+    static const char *comment_starts[] = {" # ", "\t#\t", " #\t", "\t# "};
+    for(int i = 0; i < sizeof(comment_starts) / sizeof(comment_starts[0]); i++){
+        char *comment = strstr(line, comment_starts[i]);
+        if(comment){
+            *comment = 0;
+        }
+    }
+}
+
+// call a function in the runtime library at the entry of a function
+static void spa_call_runtime(FILE *outf, const char *func){
+    // FIXME: no more than 3 arguments
+    // rdi, rsi, rdx, rcx, r8, r9
+    fprintf(outf, "\tpushq\t" "%%rdi\n");
+    fprintf(outf, "\tpushq\t" "%%rsi\n");
+    fprintf(outf, "\tpushq\t" "%%rdx\n");
+    fprintf(outf, "\tcallq\t" "%s@plt\n", func);
+    fprintf(outf, "\tpopq\t" "%%rdx\n");
+    fprintf(outf, "\tpopq\t" "%%rsi\n");
+    fprintf(outf, "\tpopq\t" "%%rdi\n");
+}
+
+// select the mode from __SPA_MODE and __SPA_INSTRUMENT_CALLS
+static void spa_select_mode(void){
+    char *calls = getenv(SPA_INSTRUMENT_CALLS_ENV);
+
+    spa_mode = spa_find_mode(getenv(SPA_MODE_ENV));
+    if(!spa_mode){
+        FATAL("Unknown instrumentation mode '%s' in %s", getenv(SPA_MODE_ENV), SPA_MODE_ENV);
+    }
+    spa_layout = &spa_mode_layouts[spa_mode - spa_modes];
+    spa_instrument_calls = calls ? (atoi(calls) != 0) : SPA_DEFAULT_INSTRUMENT_CALLS;
+    if(spa_instrument_calls && (!spa_mode->save_ret || !spa_layout->magic)){
+        FATAL("Calls can not be instrumented in the mode '%s'", spa_mode->name);
+    }
+}
+
+static int spa_cmp_func_names(const void *a, const void *b){
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+    gcc -flto generates the code at link time, one partition per assembly file,
+    each starting with .file "<artificial>".
+
+    The linker has already resolved every symbol of the whole program by then,
+    so a function defined in the partition is the one that is called, and we know
+    whether its prologue is instrumented. These functions are added to the
+    protected functions, without the list from a previous build.
+    Weak definitions are skipped, as they may still be preempted at run time.
+ */
+static void spa_add_lto_protected_funcs(FILE *inf){
+    static u8 tmp_line[MAX_LINE];
+    char **defined = NULL, **weak = NULL;
+    int n_defined = 0, n_weak = 0;
+    char *last_label = NULL;
+
+    if(!fgets(tmp_line, MAX_LINE, inf) || strcmp(tmp_line, "\t.file\t\"<artificial>\"\n")){
+        rewind(inf);
+        return;
+    }
+    while(fgets(tmp_line, MAX_LINE, inf)){
+        if(!strncmp(tmp_line, "\t.weak\t", 7)){
+            tmp_line[strcspn(tmp_line, "\n")] = 0;
+            weak = ck_realloc(weak, (n_weak + 1) * sizeof(char *));
+            weak[n_weak++] = ck_strdup(tmp_line + 7);
+        }else if(!strcmp(tmp_line, SPA_CFI_STARTPROC)){
+            if(last_label){
+                defined = ck_realloc(defined, (n_defined + 1) * sizeof(char *));
+                defined[n_defined++] = last_label;
+                last_label = NULL;
+            }
+        }else if(isalpha(tmp_line[0]) || tmp_line[0] == '_'){
+            char *colon = strchr(tmp_line, ':');
+            if(!colon){
+                continue;
+            }
+            // the same functions as the prologue is skipped for in add_instrumentation()
+            if((spa_mode->flags & SPA_MODE_F_SPECIAL_FUNCS)
+                    && (is_no_instr_func(tmp_line) || is_customized_libc_func(tmp_line)
+                        || (is_on_stack_handler(tmp_line) && (spa_mode->flags & SPA_MODE_F_COUNT_CRASH)))){
+                last_label = NULL;
+                continue;
+            }
+            *colon = 0;
+            last_label = ck_strdup(tmp_line);
+        }
+    }
+    rewind(inf);
+
+    qsort(weak, n_weak, sizeof(char *), spa_cmp_func_names);
+    for(int i = 0; i < n_defined; i++){
+        if(n_weak && bsearch(&defined[i], weak, n_weak, sizeof(char *), spa_cmp_func_names)){
+            continue;
+        }
+        if(num_of_protected_funcs >= MAX_NUM_OF_SPA_PROTECTED_FUNCS){
+            FATAL("Too many protected functions");
+        }
+        spa_protected_funcs[num_of_protected_funcs++] = defined[i];
+    }
+    // is_protected_function() does a binary search
+    qsort(spa_protected_funcs, num_of_protected_funcs, sizeof(char *), spa_cmp_func_names);
+}
+
+
+/*
+    Stack usage of the current function, for static worst-case stack-depth analysis.
+
+    We simulate %rsp along the text of the function. It is not path-sensitive,
+    so after a ret / tail call we conservatively continue with the deepest offset seen.
+    The return address pushed by the caller is included (offset 8 at the entry).
+ */
+#define  SPA_STK_MAX_REMEMBERED_STATES   64
+
+static u8   spa_stk_info_enabled;
+static char spa_stk_func_name[MAX_LINE];
+static long spa_stk_cur_offset, spa_stk_max_offset, spa_stk_flags;
+static long spa_stk_remembered[SPA_STK_MAX_REMEMBERED_STATES];
+static int  spa_stk_remembered_cnt;
+static char ** spa_stk_callees;
+static int  spa_stk_callee_cnt, spa_stk_callee_cap;
+
+// \t.type\tfoo,@function  (clang)   or    \t.type\tfoo, @function  (gcc)
+static void spa_stk_set_func_name(char *line){
+    char *p = line + strlen(SPA_TYPE_PREFIX);
+    int n = 0;
+    if(*p == '"'){
+        p++;
+    }
+    while(p[n] && p[n] != ',' && p[n] != '"' && n < MAX_LINE - 1){
+        n++;
+    }
+    memcpy(spa_stk_func_name, p, n);
+    spa_stk_func_name[n] = 0;
+}
+
+static void spa_stk_begin_func(void){
+    spa_stk_cur_offset = SPA_CPU_WORD_LENGTH;
+    spa_stk_max_offset = SPA_CPU_WORD_LENGTH;
+    spa_stk_flags = 0;
+    spa_stk_remembered_cnt = 0;
+    for(int i = 0; i < spa_stk_callee_cnt; i++){
+        ck_free(spa_stk_callees[i]);
+    }
+    spa_stk_callee_cnt = 0;
+}
+
+static void spa_stk_add_callee(char *operand){
+    char name[MAX_LINE];
+    int n = 0;
+    if(*operand == '"'){
+        operand++;
+    }
+    while(operand[n] && !isspace(operand[n]) && operand[n] != '@'
+            && operand[n] != '"' && operand[n] != '#' && n < MAX_LINE - 1){
+        n++;
+    }
+    if(n == 0){
+        return;
+    }
+    memcpy(name, operand, n);
+    name[n] = 0;
+    for(int i = 0; i < spa_stk_callee_cnt; i++){
+        if(!strcmp(spa_stk_callees[i], name)){
+            return;
+        }
+    }
+    if(spa_stk_callee_cnt == spa_stk_callee_cap){
+        spa_stk_callee_cap = spa_stk_callee_cap ? 2 * spa_stk_callee_cap : 16;
+        spa_stk_callees = ck_realloc(spa_stk_callees, spa_stk_callee_cap * sizeof(char *));
+    }
+    spa_stk_callees[spa_stk_callee_cnt++] = ck_strdup(name);
+}
+
+static void spa_stk_grow(long n){
+    spa_stk_cur_offset += n;
+    if(spa_stk_cur_offset > spa_stk_max_offset){
+        spa_stk_max_offset = spa_stk_cur_offset;
+    }
+}
+
+// "$24, %rsp"  -->  24
+static int spa_stk_get_imm_to_rsp(char *operands, long *imm){
+    char *comma = strchr(operands, ',');
+    if(operands[0] != '$' || !comma || strncmp(comma + 1 + strspn(comma + 1, " \t"), "%rsp", 4)){
+        return 0;
+    }
+    *imm = strtol(operands + 1, NULL, 0);
+    return 1;
+}
+
+static int spa_stk_writes_rsp(char *operands){
+    char *comma = strrchr(operands, ',');
+    return comma && !strncmp(comma + 1 + strspn(comma + 1, " \t"), "%rsp", 4);
+}
+
+// called for every line between .cfi_startproc and .cfi_endproc
+static void spa_stk_track_line(char *line){
+    char mnemonic[32];
+    char *p = line + strspn(line, " \t");
+    int n = strcspn(p, " \t\n");
+    long imm;
+
+    if(n == 0 || n >= sizeof(mnemonic)){
+        return;
+    }
+    memcpy(mnemonic, p, n);
+    mnemonic[n] = 0;
+    char *operands = p + n + strspn(p + n, " \t");
+
+    if(!strcmp(mnemonic, ".cfi_def_cfa_offset")){
+        spa_stk_cur_offset = 0;
+        spa_stk_grow(strtol(operands, NULL, 0));
+    }else if(!strcmp(mnemonic, ".cfi_def_cfa")){
+        char *comma = strchr(operands, ',');
+        if(comma){
+            spa_stk_cur_offset = 0;
+            spa_stk_grow(strtol(comma + 1, NULL, 0));
+        }
+    }else if(!strcmp(mnemonic, ".cfi_remember_state")){
+        if(spa_stk_remembered_cnt < SPA_STK_MAX_REMEMBERED_STATES){
+            spa_stk_remembered[spa_stk_remembered_cnt++] = spa_stk_cur_offset;
+        }
+    }else if(!strcmp(mnemonic, ".cfi_restore_state")){
+        if(spa_stk_remembered_cnt > 0){
+            spa_stk_cur_offset = spa_stk_remembered[--spa_stk_remembered_cnt];
+        }
+    }else if(!strcmp(mnemonic, "pushq") || !strcmp(mnemonic, "push")){
+        spa_stk_grow(SPA_CPU_WORD_LENGTH);
+    }else if(!strcmp(mnemonic, "popq") || !strcmp(mnemonic, "pop")){
+        spa_stk_cur_offset -= SPA_CPU_WORD_LENGTH;
+    }else if(!strcmp(mnemonic, "subq") || !strcmp(mnemonic, "sub")){
+        if(spa_stk_get_imm_to_rsp(operands, &imm)){
+            spa_stk_grow(imm);
+        }else if(spa_stk_writes_rsp(operands)){
+            spa_stk_flags |= SPA_STACK_INFO_DYNAMIC_FRAME;
+        }
+    }else if(!strcmp(mnemonic, "addq") || !strcmp(mnemonic, "add")){
+        if(spa_stk_get_imm_to_rsp(operands, &imm)){
+            spa_stk_grow(-imm);
+        }else if(spa_stk_writes_rsp(operands)){
+            spa_stk_flags |= SPA_STACK_INFO_DYNAMIC_FRAME;
+        }
+    }else if(!strcmp(mnemonic, "andq") || !strcmp(mnemonic, "and")){
+        // stack realignment, e.g. andq $-32, %rsp
+        if(spa_stk_get_imm_to_rsp(operands, &imm)){
+            spa_stk_grow(-imm - 1);
+        }
+    }else if(!strcmp(mnemonic, "movq") || !strcmp(mnemonic, "mov")){
+        // movq %rbp, %rsp is an epilogue, others come from alloca()
+        if(spa_stk_writes_rsp(operands) && strncmp(operands, "%rbp", 4)){
+            spa_stk_flags |= SPA_STACK_INFO_DYNAMIC_FRAME;
+        }
+    }else if(!strcmp(mnemonic, "callq") || !strcmp(mnemonic, "call")){
+        if(*operands == '*'){
+            spa_stk_flags |= SPA_STACK_INFO_INDIRECT_CALL;
+        }else{
+            spa_stk_add_callee(operands);
+        }
+    }else if(!strcmp(mnemonic, "jmpq") || !strcmp(mnemonic, "jmp")){
+        if(*operands == '*'){
+            // jump tables are fine, but not indirect tail calls
+            if(strstr(operands, "TAILCALL")){
+                spa_stk_flags |= SPA_STACK_INFO_INDIRECT_CALL;
+            }
+        }else if(operands[0] != '.'){ // .LBB0_1 is a local label
+            spa_stk_add_callee(operands);
+        }
+        spa_stk_cur_offset = spa_stk_max_offset;
+    }else if(!strcmp(mnemonic, "retq") || !strcmp(mnemonic, "ret")){
+        spa_stk_cur_offset = spa_stk_max_offset;
+    }
+}
+
+static void spa_stk_end_func(FILE *outf){
+    if(!spa_stk_func_name[0]){
+        return;
+    }
+    fprintf(outf, "\t.pushsection\t" SPA_STACK_INFO_SECTION ",\"\",@progbits\n");
+    fprintf(outf, "\t.ascii\t\"F %s %ld %ld\\n\"\n", spa_stk_func_name, spa_stk_max_offset, spa_stk_flags);
+    for(int i = 0; i < spa_stk_callee_cnt; i++){
+        fprintf(outf, "\t.ascii\t\"C %s\\n\"\n", spa_stk_callees[i]);
+    }
+    fprintf(outf, "\t.popsection\n");
+    spa_stk_func_name[0] = 0;
+}
+
+
 /* Examine and modify parameters to pass to 'as'. Note that the file name
    is always the last parameter passed by GCC, so we exploit this property
    to keep the code simple. */
@@ -6895,6 +7212,9 @@ static void add_instrumentation(void) {
     inf = fopen(input_file, "r");
     if (!inf) PFATAL("Unable to read '%s'", input_file);
 
+    if (spa_instrument_calls && !pass_thru && use_64bit)
+      spa_add_lto_protected_funcs(inf);
+
   } else inf = stdin;
 
   outfd = open(modified_file, O_WRONLY | O_EXCL | O_CREAT, 0600);
@@ -6940,6 +7260,14 @@ static void add_instrumentation(void) {
 
 #endif
 
+    if(spa_stk_info_enabled && !pass_thru && use_64bit){
+        if(!strncmp(line, SPA_TYPE_PREFIX, strlen(SPA_TYPE_PREFIX)) && strstr(line, "@function")){
+            spa_stk_set_func_name(line);
+        }else if(start2end){
+            spa_stk_track_line(line);
+        }
+    }
+
     /* In some cases, we want to defer writing the instrumentation trampoline
        until after all the labels, macros, comments, etc. If we're in this
        mode, and if the line starts with a tab followed by a character, dump
@@ -7008,253 +7336,47 @@ static void add_instrumentation(void) {
     if(!strncmp(line, SPA_CFI_STARTPROC, strlen(SPA_CFI_STARTPROC))){
         start2end = 1;
         n_start++;
+        if(spa_stk_info_enabled){
+            spa_stk_begin_func();
+        }
         if(!pass_thru && use_64bit){
-#if defined(USE_SPA_SHADOW_STACK)
             fprintf(outf, "%s", line);
-            fprintf(outf, "\tpopq\t-%ld(%%rsp)\n", (DEF_SPA_SS_OFFSET));
-            fprintf(outf, "\tsubq\t$8, %%rsp\n");
-            continue;
-
-
-#elif defined(USE_SPA_SHADOW_STACK_VIA_REG)
-            char * reg_name = "%rax";
-            fprintf(outf, "%s", line);
-            fprintf(outf, "\tmovq\t" "(%%rsp), %s\n", reg_name);
-            fprintf(outf, "\tmovq\t" "%s, -%ld(%%rsp)\n", reg_name, (long)(DEF_SPA_SS_OFFSET));
-            continue;
-
-
-#elif defined(USE_SPA_BUDDY_STACK_TLS)
-            fprintf(outf, "%s", line);
-            char * reg_x = "%r11";
-            fprintf(outf, "###SPA### FUNCTION_ENTRY\n");
-            // Get the random value from TLS
-            fprintf(outf, "\tmovq\t" "%%rsp, %s\n", reg_x);
-            fprintf(outf, "\tandq\t" "$%ld, %s\n", (long)DEF_BUDDY_CALL_STACK_SIZE_MASK, reg_x);
-            fprintf(outf, "\tmovq\t" "-%ld(%s), %s\n", (long)(DEF_BUDDY_FUNCTION_LOCAL_STORAGE_SIZE), reg_x, reg_x);
-            // randomize return address
-            fprintf(outf, "\taddq\t" "(%%rsp), %s\n", reg_x);
-            // Save it on the shadow stack
-            fprintf(outf, "\tmovq\t" "%s, -%ld(%%rsp)\n", reg_x, (long)(DEF_SPA_SS_OFFSET));
-            continue;
-
-#elif defined(USE_SPA_GS_RSP)
-            //
-            fprintf(outf, "%s", line);
-            //
-            if(in_no_instr_func){
-                continue;
-            }
-
-            if(on_stack_handler){
-                // FIXME: no more than 3 arguments
-                // rdi, rsi, rdx, rcx, r8, r9
-                fprintf(outf, "\tpushq\t" "%%rdi\n");
-                fprintf(outf, "\tpushq\t" "%%rsi\n");
-                fprintf(outf, "\tpushq\t" "%%rdx\n");
-                fprintf(outf, "\tcallq\t" "unsw_inc_asm_js_crash_cnt@plt\n");
-                fprintf(outf, "\tpopq\t" "%%rdx\n");
-                fprintf(outf, "\tpopq\t" "%%rsi\n");
-                fprintf(outf, "\tpopq\t" "%%rdi\n");
-
-                continue;
-            }
-            /*
-                workaroud,
-                a protected malloc() might be called before initialization of gs register.
-             */
-            if(in_customized_func){ // including malloc
-                /*
-                    If we use "callq init_main_shadow_stack"
-                    then we get this error when building Firefox79.0.
-
-                     0:30.44 /usr/bin/ld: ../../memory/build/Unified_cpp_memory_build0.o:
-                             warning: relocation against `init_main_shadow_stack'
-                             in read-only section `.text.malloc'
-                     0:30.46 /usr/bin/ld: read-only segment has dynamic relocations.
-                     0:30.46 clang-7: error: linker command failed with exit code 1
-                             (use -v to see invocation)
-                 */
-                // FIXME: no more than 3 arguments
-                // rdi, rsi, rdx, rcx, r8, r9
-                fprintf(outf, "\tpushq\t" "%%rdi\n");
-                fprintf(outf, "\tpushq\t" "%%rsi\n");
-                fprintf(outf, "\tpushq\t" "%%rdx\n");
-                fprintf(outf, "\tcallq\t" "init_main_shadow_stack@plt\n");
-                fprintf(outf, "\tpopq\t" "%%rdx\n");
-                fprintf(outf, "\tpopq\t" "%%rsi\n");
-                fprintf(outf, "\tpopq\t" "%%rdi\n");
-
-                continue;
-            }
-            //
-            fprintf(outf, "\tmovq\t(%%rsp), %%r11\n");
-            fprintf(outf, "\tmovq\t$-0x%lx, %%r10\n", SPA_USER_SPACE_SIZE);
-            fprintf(outf, "\tmovq\t%%r11, %%gs:(%%rsp, %%r10, 1)\n");
-            continue;
-
-// USE_SHADESMAR_GS
-#elif defined(USE_SHADESMAR_GS)
-            //
-            fprintf(outf, "%s", line);
-            //
-            if(in_no_instr_func){
-                continue;
-            }
-
-            /*
-                workaroud,
-                a protected malloc() might be called before initialization of gs register.
-             */
-            if(in_customized_func){ // including malloc
-                /*
-                    If we use "callq init_main_shadow_stack"
-                    then we get this error when building Firefox79.0.
-
-                     0:30.44 /usr/bin/ld: ../../memory/build/Unified_cpp_memory_build0.o:
-                             warning: relocation against `init_main_shadow_stack'
-                             in read-only section `.text.malloc'
-                     0:30.46 /usr/bin/ld: read-only segment has dynamic relocations.
-                     0:30.46 clang-7: error: linker command failed with exit code 1
-                             (use -v to see invocation)
-                 */
-                // FIXME: no more than 3 arguments
-                // rdi, rsi, rdx, rcx, r8, r9
-                fprintf(outf, "\tpushq\t" "%%rdi\n");
-                fprintf(outf, "\tpushq\t" "%%rsi\n");
-                fprintf(outf, "\tpushq\t" "%%rdx\n");
-                fprintf(outf, "\tcallq\t" "init_main_shadow_stack@plt\n");
-                fprintf(outf, "\tpopq\t" "%%rdx\n");
-                fprintf(outf, "\tpopq\t" "%%rsi\n");
-                fprintf(outf, "\tpopq\t" "%%rdi\n");
-
-                continue;
-            }
-
-            continue;
-
-#elif defined(USE_SPA_FS_GS_TLS)
-            fprintf(outf, "%s", line);
-#if 1
-            if(in_no_instr_func){
-                continue;
-            }
-
-            if(on_stack_handler){
-                //
-//                fprintf(outf, "\tmovq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-//                fprintf(outf, "\tmovq\t%%r11, %%gs:(%ld)\n", GET_GS_METADATA_FIELD_OFFSET(saved_diff));
-
-//                fprintf(outf, "\tmovq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(shadow_stack));
-//                fprintf(outf, "\taddq\t$0x%lx, %%r11\n", DEF_BUDDY_SHADOW_STACK_SIZE);
-//                fprintf(outf, "\tsubq\t%%rsp, %%r11\n");
-//                fprintf(outf, "\tmovq\t%%r11, %%gs:(%ld)\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-
-                // FIXME: no more than 3 arguments
-                // rdi, rsi, rdx, rcx, r8, r9
-                fprintf(outf, "\tpushq\t" "%%rdi\n");
-                fprintf(outf, "\tpushq\t" "%%rsi\n");
-                fprintf(outf, "\tpushq\t" "%%rdx\n");
-                fprintf(outf, "\tcallq\t" "unsw_inc_asm_js_crash_cnt@plt\n");
-                fprintf(outf, "\tpopq\t" "%%rdx\n");
-                fprintf(outf, "\tpopq\t" "%%rsi\n");
-                fprintf(outf, "\tpopq\t" "%%rdi\n");
-
-                continue;
-            }
-            /*
-                workaroud,
-                a protected malloc() might be called before initialization of gs register.
-             */
-            // in_malloc = 0, in_valloc = 0, in_realloc = 0, in_calloc = 0, in_free = 0, in_abort = 0;
-
-            if(in_customized_func){ // including malloc
+            if(spa_mode->flags & SPA_MODE_F_SPECIAL_FUNCS){
+                if(in_no_instr_func){
+                    continue;
+                }
+                if(on_stack_handler && (spa_mode->flags & SPA_MODE_F_COUNT_CRASH)){
+                    spa_range_begin(outf);
+                    spa_call_runtime(outf, "unsw_inc_asm_js_crash_cnt");
+                    spa_range_end(outf);
+                    continue;
+                }
                 /*
-                    If we use "callq init_main_shadow_stack"
-                    then we get this error when building Firefox79.0.
-
-                     0:30.44 /usr/bin/ld: ../../memory/build/Unified_cpp_memory_build0.o:
-                             warning: relocation against `init_main_shadow_stack'
-                             in read-only section `.text.malloc'
-                     0:30.46 /usr/bin/ld: read-only segment has dynamic relocations.
-                     0:30.46 clang-7: error: linker command failed with exit code 1
-                             (use -v to see invocation)
+                    workaroud,
+                    a protected malloc() might be called before initialization of gs register.
                  */
-                // FIXME: no more than 3 arguments
-                // rdi, rsi, rdx, rcx, r8, r9
-                fprintf(outf, "\tpushq\t" "%%rdi\n");
-                fprintf(outf, "\tpushq\t" "%%rsi\n");
-                fprintf(outf, "\tpushq\t" "%%rdx\n");
-                fprintf(outf, "\tcallq\t" "init_main_shadow_stack@plt\n");
-                fprintf(outf, "\tpopq\t" "%%rdx\n");
-                fprintf(outf, "\tpopq\t" "%%rsi\n");
-                fprintf(outf, "\tpopq\t" "%%rdi\n");
-
-                continue;
+                if(in_customized_func){ // including malloc
+                    /*
+                        If we use "callq init_main_shadow_stack"
+                        then we get this error when building Firefox79.0.
+
+                         0:30.44 /usr/bin/ld: ../../memory/build/Unified_cpp_memory_build0.o:
+                                 warning: relocation against `init_main_shadow_stack'
+                                 in read-only section `.text.malloc'
+                         0:30.46 /usr/bin/ld: read-only segment has dynamic relocations.
+                         0:30.46 clang-7: error: linker command failed with exit code 1
+                                 (use -v to see invocation)
+                     */
+                    spa_range_begin(outf);
+                    spa_call_runtime(outf, "init_main_shadow_stack");
+                    spa_range_end(outf);
+                    continue;
+                }
             }
-#endif
-            // if (r11 == gs:(shadow stack))
-            //      no need to add
-            // else
-            //
-
-//            fprintf(outf, "\taddq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(R));
-//            fprintf(outf, "\tmovq\t%%gs:(%ld), %%r10\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-//            fprintf(outf, "\tcmpq\t%%r11, (%%rsp, %%r10, 1)\n");
-//            fprintf(outf, "\tje\t1f\n");
-//            fprintf(outf, "\tmovq\t(%%rsp), %%r11\n");
-//            fprintf(outf, "\taddq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(R));
-//            fprintf(outf, "\tmovq\t%%r11, (%%rsp, %%r10, 1)\n");
-//            fprintf(outf, "1:\n");
-
-
-            fprintf(outf, "\tmovq\t(%%rsp), %%r11\n");
-
-            // Disable MSR
-#if defined(SPA_ENABLE_GS_MSR)
-            fprintf(outf, "\taddq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(R));
-#endif
-
-            fprintf(outf, "\tmovq\t%%gs:(%ld), %%r10\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-            fprintf(outf, "\tmovq\t%%r11, (%%rsp, %%r10, 1)\n");
-            continue;
-
-#elif defined(USE_SPA_BUDDY_STACK_TLS_WITH_STK_SIZE)
-            fprintf(outf, "%s", line);
-            char *reg_x = "%r11";
-            char *reg_y = "%r10";
-            fprintf(outf, "###SPA### FUNCTION_ENTRY\n");
-            // reg_x = rsp
-            fprintf(outf, "\tmovq\t" "%%rsp, %s\n", reg_x);
-#if defined(NON_PIE_GLOBAL_VAR_FOR_STK_SIZE)
-            // reg_y = BUDDY_CALL_STACK_SIZE_MASK
-            fprintf(outf, "\tmovq\t" ".BUDDY.CALL_STACK_SIZE_MASK, %s\n", reg_y);
-#else
-            // reg_y = BUDDY_CALL_STACK_SIZE_MASK
-            fprintf(outf, "\tmovq\t" ".BUDDY.CALL_STACK_SIZE_MASK@GOTPCREL(%%rip), %s\n", reg_y);
-            fprintf(outf, "\tmovq\t" "(%s), %s\n", reg_y, reg_y);
-#endif
-            // reg_x &= BUDDY_CALL_STACK_SIZE_MASK
-            fprintf(outf, "\tandq\t" "%s, %s\n", reg_y, reg_x);
-            // rand_val =
-            fprintf(outf, "\tmovq\t" "(%s, %s, 2), %s\n", reg_x, reg_y, reg_x);
-            // randomize return address
-            fprintf(outf, "\taddq\t" "(%%rsp), %s\n", reg_x);
-            // Save it on the shadow stack
-            fprintf(outf, "\tmovq\t" "%s, (%%rsp, %s, 1)\n", reg_x, reg_y);
+            spa_range_begin(outf);
+            fputs(spa_mode->prologue, outf);
+            spa_range_end(outf);
             continue;
-
-
-#else       // SE_SPA_SHADOW_STACK_PLUS_GLOBAL_RANDVAR
-            fprintf(outf, "%s", line);
-            char * reg_name = "%rax";
-            // USE movq here.
-            fprintf(outf, "\tmovq\t" "%s, %s\n", SPA_RANDOM_VAL, reg_name);
-            fprintf(outf, "\taddq\t" "(%%rsp), %s\n", reg_name);
-            fprintf(outf, "\tmovq\t" "%s, -%ld(%%rsp)\n", reg_name, (long)(DEF_SPA_SS_OFFSET));
-            continue;
-#endif
-
         }
     }
 
@@ -7264,154 +7386,40 @@ static void add_instrumentation(void) {
         n_end++;
         if(!pass_thru){
             fprintf(outf, "%s", line);
-            continue;
-        }
-    }
-
-#if defined(ENABLE_GS_RSP_CALL_INSTRUMENTED)
-
-    if(!pass_thru && !skip_intel && !skip_app && !skip_csect && instr_ok && use_64bit && start2end
-            && with_64_bit_cmd_option){ // ignore 32 bit now       
-    // FIXME:  merge the following tow cases to avoid redundancy
-#if defined(USE_SPA_GS_RSP)
-        if(!strncmp(line, SPA_CALLQ_STAR, strlen(SPA_CALLQ_STAR))){ // indirect call
-            // "\n" --> "\0"
-            // callq *32(%rsp)               # 8-byte Folded Reload
-            line[strlen(line) - 1] = 0;
-            // FIXME: a little ugly
-            char *comment = strstr(line, " # ");
-            if(comment){
-                *comment = 0;
-            }
-            comment = strstr(line, "\t#\t");
-            if(comment){
-                *comment = 0;
+            if(spa_stk_info_enabled && use_64bit){
+                spa_stk_end_func(outf);
             }
-            comment = strstr(line, " #\t");
-            if(comment){
-                *comment = 0;
-            }
-            comment = strstr(line, "\t# ");
-            if(comment){
-                *comment = 0;
-            }
-
-            fprintf(outf, "\tmovq\t%s, %%rax\n", line + strlen(SPA_CALLQ_STAR));
-            fprintf(outf, "\tmovq\t$0x%lx, %%r11\n", SPA_PROTECTED_FUNC_MAGIC_NUM);
-            fprintf(outf, "\tcmpq\t(%%rax), %%r11\n");
-            fprintf(outf, "\tjne\t1f\n");
-
-            // write randomized return address to the shadow stack
-            fprintf(outf, "\tleaq\t2f(%%rip), %%r11\n");
-
-
-            fprintf(outf, "\tmovq\t$-0x%lx, %%r10\n", SPA_USER_SPACE_SIZE);
-            fprintf(outf, "\tmovq\t%%r11, %%gs:-8(%%rsp, %%r10, 1)\n");
-
-            // skip the prologue of the protected function
-            fprintf(outf, "\taddq\t$0x%x, %%rax\n", SPA_LENGTH_OF_PROTECTED_PROLOGUE);
-            fprintf(outf, "1:\n");
-            fprintf(outf, "\tcallq\t*%%rax\n");
-            fprintf(outf, "2:\n");
             continue;
         }
-        else if(!strncmp(line, SPA_CALLQ_NO_STAR, strlen(SPA_CALLQ_NO_STAR))
-                    && line[strlen(SPA_CALLQ_NO_STAR)] != '*'){ // direct call
-            // FIXME:  No need for unprotected library function
-            // __tls_get_addr also needs to be specially handled? due to 16 bytes aligned?
-            // callq	__tls_get_addr@PLT
-
-            if(strstr(line, "@PLT") || strstr(line, "@plt")
-                    || strstr(line, "__tls_get_addr")){  // including library functions ?
-                fprintf(outf, "%s", line);
-                continue;
-            }
-            // +1 to skip the white space, either " " or "\t"
-            char * func_name_line = (line + strlen(SPA_CALLQ_NO_STAR) + 1);
-            if(is_libcxx_func_called(func_name_line) || is_libc_func_called(func_name_line)){
-                fprintf(outf, "%s", line);
-                continue;
-            }
-
-            if(is_protected_function(func_name_line)){
-                line[strlen(line) - 1] = 0;
-                // delete the comments
-                char *comment = strstr(line, " # ");
-                if(comment){
-                    *comment = 0;
-                }
-                comment = strstr(line, "\t#\t");
-                if(comment){
-                    *comment = 0;
-                }
-                comment = strstr(line, " #\t");
-                if(comment){
-                    *comment = 0;
-                }
-                comment = strstr(line, "\t# ");
-                if(comment){
-                    *comment = 0;
-                }
-                // write randomized return address to the shadow stack
-                fprintf(outf, "\tleaq\t1f(%%rip), %%r11\n");
-
-
-                fprintf(outf, "\tmovq\t$-0x%lx, %%r10\n", SPA_USER_SPACE_SIZE);
-                fprintf(outf, "\tmovq\t%%r11, %%gs:-8(%%rsp, %%r10, 1)\n");
-
+    }
 
-                // direct call
-                fprintf(outf, "%s+%d\n", line, SPA_LENGTH_OF_PROTECTED_PROLOGUE);
-                //fprintf(stderr, "%s", line);
-                fprintf(outf, "1:\n");
-                continue;
-            }
-            fprintf(outf, "%s", line);
-            continue;
+    if(spa_instrument_calls && !pass_thru && !skip_intel && !skip_app && !skip_csect && instr_ok && use_64bit
+            && start2end && with_64_bit_cmd_option){ // ignore 32 bit now
+        if(!strncmp(line, SPA_GCC_CALL, strlen(SPA_GCC_CALL)) && strlen(line) + 1 < MAX_LINE){
+            // "\tcall\t" --> "\tcallq\t"
+            memmove(line + 6, line + 5, strlen(line + 5) + 1);
+            line[5] = 'q';
         }
-
-
-#elif defined(USE_SPA_FS_GS_TLS)
         if(!strncmp(line, SPA_CALLQ_STAR, strlen(SPA_CALLQ_STAR))){ // indirect call
             // "\n" --> "\0"
             // callq *32(%rsp)               # 8-byte Folded Reload
             line[strlen(line) - 1] = 0;
-            // FIXME: a little ugly
-            char *comment = strstr(line, " # ");
-            if(comment){
-                *comment = 0;
-            }
-            comment = strstr(line, "\t#\t");
-            if(comment){
-                *comment = 0;
-            }
-            comment = strstr(line, " #\t");
-            if(comment){
-                *comment = 0;
-            }
-            comment = strstr(line, "\t# ");
-            if(comment){
-                *comment = 0;
-            }
+            spa_strip_comment(line);
 
+            spa_range_begin(outf);
             fprintf(outf, "\tmovq\t%s, %%rax\n", line + strlen(SPA_CALLQ_STAR));
-            fprintf(outf, "\tmovq\t$0x%lx, %%r11\n", SPA_PROTECTED_FUNC_MAGIC_NUM);
+            fprintf(outf, "\tmovq\t$0x%lx, %%r11\n", spa_layout->magic);
             fprintf(outf, "\tcmpq\t(%%rax), %%r11\n");
             fprintf(outf, "\tjne\t1f\n");
 
             // write randomized return address to the shadow stack
             fprintf(outf, "\tleaq\t2f(%%rip), %%r11\n");
+            fputs(spa_mode->save_ret, outf);
 
-            // Disable MSR
-#if defined(SPA_ENABLE_GS_MSR)
-            fprintf(outf, "\taddq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(R));
-#endif
-
-            fprintf(outf, "\tmovq\t%%gs:(%ld), %%r10\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-            fprintf(outf, "\tmovq\t%%r11, -8(%%rsp, %%r10, 1)\n");
             // skip the prologue of the protected function
-            fprintf(outf, "\taddq\t$0x%x, %%rax\n", SPA_LENGTH_OF_PROTECTED_PROLOGUE);
+            fprintf(outf, "\taddq\t$0x%x, %%rax\n", spa_layout->prologue_len);
             fprintf(outf, "1:\n");
+            spa_range_end(outf);
             fprintf(outf, "\tcallq\t*%%rax\n");
             fprintf(outf, "2:\n");
             continue;
@@ -7437,36 +7445,15 @@ static void add_instrumentation(void) {
             if(is_protected_function(func_name_line)){
                 line[strlen(line) - 1] = 0;
                 // delete the comments
-                char *comment = strstr(line, " # ");
-                if(comment){
-                    *comment = 0;
-                }
-                comment = strstr(line, "\t#\t");
-                if(comment){
-                    *comment = 0;
-                }
-                comment = strstr(line, " #\t");
-                if(comment){
-                    *comment = 0;
-                }
-                comment = strstr(line, "\t# ");
-                if(comment){
-                    *comment = 0;
-                }
+                spa_strip_comment(line);
                 // write randomized return address to the shadow stack
+                spa_range_begin(outf);
                 fprintf(outf, "\tleaq\t1f(%%rip), %%r11\n");
-
-                // Disable MSR
-#if defined(SPA_ENABLE_GS_MSR)
-                fprintf(outf, "\taddq\t%%gs:%ld, %%r11\n", GET_GS_METADATA_FIELD_OFFSET(R));
-#endif
-
-                fprintf(outf, "\tmovq\t%%gs:%ld, %%r10\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-                fprintf(outf, "\tmovq\t%%r11, -8(%%rsp, %%r10, 1)\n");
-
+                fputs(spa_mode->save_ret, outf);
+                spa_range_end(outf);
 
                 // direct call
-                fprintf(outf, "%s+%d\n", line, SPA_LENGTH_OF_PROTECTED_PROLOGUE);
+                fprintf(outf, "%s+%d\n", line, spa_layout->prologue_len);
                 //fprintf(stderr, "%s", line);
                 fprintf(outf, "1:\n");
                 continue;
@@ -7474,9 +7461,7 @@ static void add_instrumentation(void) {
             fprintf(outf, "%s", line);
             continue;
         }
-#endif
     }
-#endif
 
     if(!pass_thru && !skip_intel && !skip_app && use_64bit && start2end){ // ignore 32 bit now
 
@@ -7484,58 +7469,18 @@ static void add_instrumentation(void) {
                 || !strncmp(line, SPA_CLANG_RETQ, strlen(SPA_CLANG_RETQ))){
 
           //if(!strncmp(line, SPA_CLANG_RETQ, strlen(SPA_CLANG_RETQ))){
-#if defined(USE_SPA_SHADOW_STACK)
-            fprintf(outf, "\taddq\t$8, %%rsp\n");
-            fprintf(outf, "\tmovq\t-%ld(%%rsp), %%r11\n", (DEF_SPA_SS_OFFSET));
-            fprintf(outf, "\tjmpq\t*%%r11\n");
-            continue;
-
-
-#elif defined(USE_SPA_SHADOW_STACK_VIA_REG)
-            fprintf(outf, "\tmovq\t-%ld(%%rsp), %%r11\n", (DEF_SPA_SS_OFFSET));
-            fprintf(outf, "\taddq\t$8, %%rsp\n");
-            fprintf(outf, "\tjmpq\t*%%r11\n");
-            continue;
-
-
-#elif defined(USE_SPA_BUDDY_STACK_TLS)
-            char * reg_x = "%r11";
-            char * reg_y = "%r10";
-            fprintf(outf, "###SPA### FUNCTION_EXIT\n");
-            // Load the random value and do de-randomization
-            fprintf(outf, "\tmovq\t" "%%rsp, %s\n", reg_y);
-            fprintf(outf, "\tandq\t" "$%ld, %s\n", DEF_BUDDY_CALL_STACK_SIZE_MASK, reg_y);
-            // Load randomized ret addr
-            fprintf(outf, "\tmovq\t" "-%ld(%%rsp), %s\n", (long)(DEF_SPA_SS_OFFSET), reg_x);
-            // de-randomization
-            fprintf(outf, "\tsubq\t" "-%ld(%s), %s\n", (long)(DEF_BUDDY_FUNCTION_LOCAL_STORAGE_SIZE), reg_y, reg_x);
-            // adjust call stack pointer
-            fprintf(outf, "\taddq\t" "$%ld, %%rsp\n", (long)(SPA_CPU_WORD_LENGTH));
-            // jump to call-site
-            fprintf(outf, "\tjmp\t"  "*%s\n", reg_x);
-            continue;
-
-#elif defined(USE_SPA_GS_RSP)
-
-            if(in_customized_func || in_no_instr_func){
+            if(!spa_mode->epilogue){
                 fprintf(outf, "%s", line);
                 continue;
             }
 
-            if(on_stack_handler){
+            if((spa_mode->flags & SPA_MODE_F_SPECIAL_FUNCS)
+                    && (in_customized_func || in_no_instr_func || on_stack_handler)){
                 fprintf(outf, "%s", line);
                 continue;
             }
 
-            // 22 bytes
-            /*
-                 598:	49 ba 00 00 00 00 00 	movabs $0xffff800000000000,%r10
-                 59f:	80 ff ff
-                 5a2:	65 4e 8b 1c 14       	mov    %gs:(%rsp,%r10,1),%r11
-                 5a7:	48 83 c4 08          	add    $0x8,%rsp
-                 5ab:	41 ff e3             	jmpq   *%r11
-             */
-            // 20 bytes
+            // gs-rsp, 20 bytes
             /*
                  598:	49 ba 00 00 00 00 00 	movabs $0xffff800000000000,%r10
                  59f:	80 ff ff
@@ -7543,112 +7488,22 @@ static void add_instrumentation(void) {
                  5a6:	65 42 ff 64 14 f8    	jmpq   *%gs:-0x8(%rsp,%r10,1)
 
              */
-            // epilogue
-            fprintf(outf, "\tmovq\t$-0x%lx, %%r10\n", SPA_USER_SPACE_SIZE);
-            fprintf(outf, "\taddq\t" "$%ld, %%rsp\n", (long)(SPA_CPU_WORD_LENGTH));
-            fprintf(outf, "\tjmpq\t*%%gs:-8(%%rsp, %%r10, 1)\n");
+            spa_range_begin(outf);
+            fputs(spa_mode->epilogue, outf);
+            spa_range_end(outf);
             continue;
+        }
 
-// USE_SHADESMAR_GS
-#elif defined(USE_SHADESMAR_GS)
-            fprintf(outf, "%s", line);
-            continue;
-
-#elif defined(USE_SPA_FS_GS_TLS)
-
-            if(in_customized_func || in_no_instr_func){
-                fprintf(outf, "%s", line);
-                continue;
-            }
-
-            if(on_stack_handler){
-
-//                // FIXME: save return values ?
-//                fprintf(outf, "\tpushq\t" "%%rax\n");
-//                fprintf(outf, "\tpushq\t" "%%rdx\n");
-//                fprintf(outf, "\tcallq\t" "unsw_inc_asm_js_crash_cnt@plt\n");
-//                fprintf(outf, "\tpopq\t" "%%rdx\n");
-//                fprintf(outf, "\tpopq\t" "%%rax\n");
-
-
-
-//                fprintf(outf, "\tmovq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(saved_diff));
-//                fprintf(outf, "\tmovq\t%%r11, %%gs:(%ld)\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-
-
-
-                fprintf(outf, "%s", line);
-                continue;
+        // tail call, e.g., "jmp foo" or "jmp foo@PLT", but not "jmp .L3", "jmp 1f" or "jmp *%rax"
+        if(spa_mode->tail_call && !strncmp(line, SPA_JMP_NO_STAR, strlen(SPA_JMP_NO_STAR))){
+            char c = line[strlen(SPA_JMP_NO_STAR)];
+            if(c != '.' && c != '*' && !isdigit(c)
+                    && !((spa_mode->flags & SPA_MODE_F_SPECIAL_FUNCS)
+                            && (in_customized_func || in_no_instr_func || on_stack_handler))){
+                spa_range_begin(outf);
+                fputs(spa_mode->tail_call, outf);
+                spa_range_end(outf);
             }
-
-            fprintf(outf, "\tmovq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-            fprintf(outf, "\tmovq\t(%%rsp, %%r11, 1), %%r11\n");
-
-            // Disable MSR
-#if defined(SPA_ENABLE_GS_MSR)
-            fprintf(outf, "\tsubq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(R));
-#endif
-
-            fprintf(outf, "\taddq\t" "$%ld, %%rsp\n", (long)(SPA_CPU_WORD_LENGTH));
-            fprintf(outf, "\tjmpq\t*%%r11\n");
-
-
-//            fprintf(outf, "\tmovq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-//            fprintf(outf, "\tmovq\t(%%rsp, %%r11, 1), %%r10\n");
-//            fprintf(outf, "\tsubq\t%%gs:(%ld), %%r10\n", GET_GS_METADATA_FIELD_OFFSET(R));
-//            fprintf(outf, "\taddq\t" "$%ld, %%rsp\n", (long)(SPA_CPU_WORD_LENGTH));
-//            fprintf(outf, "\tjmpq\t*%%r10\n");
-
-
-//            fprintf(outf, "\tmovq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(diff));
-//            fprintf(outf, "\tmovq\t(%%rsp, %%r11, 1), %%r11\n");
-//            fprintf(outf, "\tsubq\t%%gs:(%ld), %%r11\n", GET_GS_METADATA_FIELD_OFFSET(R));
-//            fprintf(outf, "\tpopq\t%%r10\n");
-//            fprintf(outf, "\tcmpq\t%%r10, %%r11\n");
-//            fprintf(outf, "\tjne\t 1f\n");
-//            fprintf(outf, "\tjmpq\t*%%r11\n");
-//            fprintf(outf, "1:\n");
-//            fprintf(outf, "\tud2\n");
-
-            continue;
-
-#elif defined(USE_SPA_BUDDY_STACK_TLS_WITH_STK_SIZE)
-            char *reg_x = "%r11";
-            char *reg_y = "%r10";
-            fprintf(outf, "###SPA### FUNCTION_EXIT\n");
-            // reg_x = rsp
-            fprintf(outf, "\tmovq\t" "%%rsp, %s\n", reg_x);
-#if defined(NON_PIE_GLOBAL_VAR_FOR_STK_SIZE)
-            // reg_y = BUDDY_CALL_STACK_SIZE_MASK
-            fprintf(outf, "\tmovq\t" ".BUDDY.CALL_STACK_SIZE_MASK, %s\n", reg_y);
-#else
-            // reg_y = BUDDY_CALL_STACK_SIZE_MASK
-            fprintf(outf, "\tmovq\t" ".BUDDY.CALL_STACK_SIZE_MASK@GOTPCREL(%%rip), %s\n", reg_y);
-            fprintf(outf, "\tmovq\t" "(%s), %s\n", reg_y, reg_y);
-#endif
-            // reg_x &= CALL_STACK_SIZE_MASK
-            fprintf(outf, "\tandq\t" "%s, %s\n", reg_y, reg_x);
-            // reg_x = rand_val
-            fprintf(outf, "\tmovq\t" "(%s, %s, 2), %s\n", reg_x, reg_y, reg_x);
-            // reg_y = saved return address
-            fprintf(outf, "\tmovq\t" "(%%rsp, %s, 1), %s\n", reg_y, reg_y);
-            fprintf(outf, "\tsubq\t" "%s, %s\n", reg_x, reg_y);
-            // adjust call stack pointer
-            fprintf(outf, "\taddq\t" "$%ld, %%rsp\n", (long)(SPA_CPU_WORD_LENGTH));
-            // jump to call-site
-            fprintf(outf, "\tjmp\t"  "*%s\n", reg_y);
-            continue;
-
-
-#else       // USE_SPA_SHADOW_STACK_PLUS_GLOBAL_RANDVAR
-            char * reg_name = "%r11";
-            //
-            fprintf(outf, "\tmovq\t" "-%ld(%%rsp), %s\n", (long)(DEF_SPA_SS_OFFSET), reg_name);
-            fprintf(outf, "\tsubq\t" "%s, %s\n", SPA_RANDOM_VAL, reg_name);
-            fprintf(outf, "\taddq\t" "$%ld, %%rsp\n", (long)(SPA_CPU_WORD_LENGTH));
-            fprintf(outf, "\tjmp\t"  "*%s\n", reg_name);
-            continue;
-#endif
         }
     }
 
@@ -7876,8 +7731,7 @@ static void add_instrumentation(void) {
   if(is_main_exe){
       fprintf(outf, "###SPA### this module contains main().\n");
       SAYF("###SPA###  %s contains main().\n", input_file);
-#if defined(USE_SPA_SHADOW_STACK_PLUS_GLOBAL_RANDVAR)
-        if(!pass_thru){
+        if(!pass_thru && (spa_mode->flags & SPA_MODE_F_GLOBAL_RANDVAR)){
             /*
           .type .unsw.randomval,@object         # @bssData
               .globl  .unsw.randomval
@@ -7896,7 +7750,16 @@ static void add_instrumentation(void) {
             fprintf(outf, "\t.zero\t%u\n", (u32) PAGE_SIZE);
             fprintf(outf, "\t.size\t.unsw.randomval, %u\n", (u32) PAGE_SIZE);
         }
-#endif
+        if(!pass_thru && (spa_mode->flags & SPA_MODE_F_TLS_DIFF)){
+            // %fs:__spa_fs_diff@tpoff requires the definition in the main executable
+            fprintf(outf, "\n\t.type\t%s, @object\n", SPA_FS_TLS_DIFF);
+            fprintf(outf, "\t.globl\t%s\n", SPA_FS_TLS_DIFF);
+            fprintf(outf, "\t.section\t.tbss,\"awT\",@nobits\n");
+            fprintf(outf, "\t.p2align\t3\n");
+            fprintf(outf, "%s:\n", SPA_FS_TLS_DIFF);
+            fprintf(outf, "\t.zero\t8\n");
+            fprintf(outf, "\t.size\t%s, 8\n", SPA_FS_TLS_DIFF);
+        }
   }
 
 #if 0
@@ -8050,6 +7913,11 @@ int main(int argc, char** argv) {
   //spa_open_protected_funcs_list("/home/iron/test/spa/tocttou/spa_protected_funcs.txt");
   spa_open_protected_funcs_list(getenv(SPA_PROTECTED_FUNCS_PATH_ENV));
 
+  spa_select_mode();
+
+  spa_stk_info_enabled = !!getenv(SPA_EMIT_STACK_INFO_ENV);
+  spa_ranges_enabled = !!getenv(SPA_EMIT_RANGES_ENV);
+
   if (!just_version) add_instrumentation();
 
   if (!(pid = fork())) {
@@ -44,6 +44,7 @@
 #include <string.h>
 
 #include "spa.h"
+#include "spa_modes.h"
 
 
 //#define DYN_SYM_TABLE_FILE  "/dynamic_symbol_table.txt"
@@ -233,6 +234,23 @@ static void edit_params(u32 argc, char** argv) {
 
     if (!strcmp(cur, "-pipe")) continue;
 
+    /* gcc generates the code of -flto in the link, through the 'as' found via
+       -B, so the partitions are instrumented by afl-as with the whole program
+       in view. LLVM does it inside the linker with its integrated assembler,
+       where nothing could be instrumented. */
+
+    if (!strncmp(cur, "-flto", 5) && (!cur[5] || cur[5] == '=')) {
+
+      if (clang_mode) {
+        if (!be_quiet) WARNF("'%s' is dropped, LLVM LTO bypasses afl-as", cur);
+        continue;
+      }
+
+      /* The closest gcc has to ThinLTO: parallel partitions */
+      if (!strcmp(cur, "-flto=thin")) cur = "-flto=auto";
+
+    }
+
 #if defined(__FreeBSD__) && defined(__x86_64__)
     if (!strcmp(cur, "-m32")) m32_set = 1;
 #endif
@@ -252,6 +270,15 @@ static void edit_params(u32 argc, char** argv) {
   if (clang_mode)
     cc_params[cc_par_cnt++] = "-no-integrated-as";
 
+  /* gcc's IPA-RA lets a caller keep values in %r10/%r11 across a call to a
+     callee it has compiled, which never happens to use them. The callee is
+     then instrumented by afl-as, and its prologue and epilogue clobber both.
+     Within one TU this needs a static callee, but with -flto it is any callee.
+     The flag is given at link time too, where the LTO code is generated. */
+
+  if (!clang_mode)
+    cc_params[cc_par_cnt++] = "-fno-ipa-ra";
+
   if (getenv("AFL_HARDEN")) {
 
     cc_params[cc_par_cnt++] = "-fstack-protector-all";
@@ -333,37 +360,35 @@ static void edit_params(u32 argc, char** argv) {
 
   }
 
-#if defined(USE_SPA_BUDDY_STACK_TLS_WITH_STK_SIZE)
-  //if(!is_so){
-    //cc_params[cc_par_cnt++] = "-Wl,--dynamic-list=" DEFAULT_SPA_DYNAMIC_SYMBOL_TABLE_PATH;
-    cc_params[cc_par_cnt++] = "-Wl,-L=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
-    cc_params[cc_par_cnt++] = "-Wl,-lbustk";
-    cc_params[cc_par_cnt++] = "-Wl,-rpath=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
-  //}
-#endif
-
-
-#if defined(USE_SPA_FS_GS_TLS)
-  //if(!is_so){
-    //cc_params[cc_par_cnt++] = "-Wl,--dynamic-list=" DEFAULT_SPA_DYNAMIC_SYMBOL_TABLE_PATH;
-    cc_params[cc_par_cnt++] = "-Wl,-L=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
-    cc_params[cc_par_cnt++] = "-Wl,-lfsgs";
-    cc_params[cc_par_cnt++] = "-Wl,-rpath=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
-    // -Wunused-command-line-argument
+  // the runtime library of the instrumentation mode, e.g. -lgsrsp for gs-rsp
+  const struct spa_mode *mode = spa_find_mode(getenv(SPA_MODE_ENV));
+  if (!mode)
+    FATAL("Unknown instrumentation mode '%s' in %s", getenv(SPA_MODE_ENV), SPA_MODE_ENV);
+
+  u8 *static_rt = getenv(SPA_STATIC_RT_ENV);
+  if (mode->rt_lib && !is_so && static_rt && !strcmp(static_rt, "1")) {
+    // the runtime is linked into the executable, so neither PLT hops nor rpath is needed
+    u8 *rt_archive = alloc_printf(DEFAULT_BUDDY_STACK_SIZE_LIB_PATH "/lib%s.a", mode->rt_lib);
+    if (access(rt_archive, R_OK))
+      FATAL("No static runtime library %s for the mode '%s'", rt_archive, mode->name);
+    cc_params[cc_par_cnt++] = "-Wl,--wrap=pthread_create";
+    // the call stacks from libgsrsp.a are retired once their threads are joined or detached
+    cc_params[cc_par_cnt++] = "-Wl,--wrap=pthread_join,--wrap=pthread_tryjoin_np";
+    cc_params[cc_par_cnt++] = "-Wl,--wrap=pthread_timedjoin_np,--wrap=pthread_detach";
+    // their guard pages are reported by pthread_getattr_np()
+    cc_params[cc_par_cnt++] = "-Wl,--wrap=pthread_getattr_np";
+    cc_params[cc_par_cnt++] = alloc_printf("-Wl,--push-state,--whole-archive,%s,--pop-state", rt_archive);
+    cc_params[cc_par_cnt++] = "-Wl,-lpthread,-ldl";
     cc_params[cc_par_cnt++] = "-Wno-unused-command-line-argument";
-  //}
-#endif
-
-#if defined(USE_SPA_GS_RSP)
-  //if(!is_so){
+  } else if (mode->rt_lib) {
     //cc_params[cc_par_cnt++] = "-Wl,--dynamic-list=" DEFAULT_SPA_DYNAMIC_SYMBOL_TABLE_PATH;
     cc_params[cc_par_cnt++] = "-Wl,-L=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
-    cc_params[cc_par_cnt++] = "-Wl,-lgsrsp";
+    // linked even if no symbol is referenced (--as-needed), e.g. fs-tls
+    cc_params[cc_par_cnt++] = alloc_printf("-Wl,--push-state,--no-as-needed,-l%s,--pop-state", mode->rt_lib);
     cc_params[cc_par_cnt++] = "-Wl,-rpath=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
     // -Wunused-command-line-argument
     cc_params[cc_par_cnt++] = "-Wno-unused-command-line-argument";
-  //}
-#endif
+  }
 
   // TBD: Add the following one, and also delete -fomit-frame-pointer from options
   //cc_params[cc_par_cnt++] = "-fno-omit-frame-pointer";
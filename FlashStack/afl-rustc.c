@@ -1,4 +1,3 @@
-
 #define AFL_MAIN
 
 #include "config.h"
@@ -10,22 +9,446 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "spa.h"
-
-
-
-
+#include "spa_modes.h"
+
+/*
+    Recent rustc no longer accepts -C no-integrated-as, so the objects are
+    instrumented by spa-rustc itself.
+
+    (1) --emit=asm is added to the compilation, so that the assembly of every codegen
+        unit X.rcgu.o is written next to it as X.rcgu.s, in parallel as usual.
+    (2) spa-rustc is passed to rustc as the linker. Before calling the real linker,
+        each X.rcgu.o on the command line is replaced by the object assembled from
+        X.rcgu.s by afl-as.
+    (3) rlibs and staticlibs are archived by rustc itself, so their X.rcgu.o members are
+        replaced after rustc returns.
+
+    The codegen units are assembled in parallel. With __SPA_RUSTC_CACHE=<dir>, the
+    instrumented objects are cached by the hash of their assembly and the afl-as options,
+    so the units that incremental compilation reuses, or that are built again unchanged,
+    are not instrumented twice. The crate hash (-C metadata) cannot be the key, as it
+    does not change with the source, and rustc is not run at all for the crates that
+    cargo finds unchanged.
+ */
+
+#define SPA_RCGU_OBJ_SUFFIX     ".rcgu.o"
+
+#define SPA_CRATE_BIN           0x1
+#define SPA_CRATE_RLIB          0x2
+#define SPA_CRATE_STATICLIB     0x4
+#define SPA_CRATE_DYLIB         0x8
+#define SPA_CRATE_PROC_MACRO    0x10
 
 //#define MAX_SPA_PATH_LEN    4096
 
-//static u8*  as_path;                /* Path to the AFL 'as' wrapper      */
+static u8*  afl_as;                 /* Path to afl-as                    */
 static u8** cc_params;              /* Parameters passed to the real CC  */
 static u32  cc_par_cnt = 1;         /* Param count, including argv0      */
 //static u8   be_quiet,               /* Quiet mode                        */
 //clang_mode;             /* Invoked as afl-clang*?            */
 
+static u8*  crate_name;             /* --crate-name                      */
+static u8*  extra_filename = "";    /* -C extra-filename                 */
+static u8*  out_dir = ".";          /* --out-dir                         */
+static u8*  out_file;               /* -o                                */
+static u8*  input_file;             /* The crate root, e.g. lib.rs       */
+static u8*  linker;                 /* -C linker                         */
+static u32  crate_types;            /* SPA_CRATE_*                       */
+static u8   instrumented;           /* Objects are rewritten by us       */
+
+
+static void find_afl_as(u8* argv0) {
+    u8 *afl_path = getenv("AFL_PATH");
+    u8 *self;
+
+    if (afl_path) {
+        afl_as = alloc_printf("%s/afl-as", afl_path);
+        if (!access(afl_as, X_OK)) return;
+        ck_free(afl_as);
+    }
+
+    // the directory of spa-rustc, even if it is invoked through the rustc symlink
+    self = realpath("/proc/self/exe", NULL);
+    if (!self) self = (u8*)realpath(argv0, NULL);
+    if (self) {
+        // alloc_printf() evaluates its arguments twice, and dirname() is in place
+        u8 *dir = dirname(self);
+        afl_as = alloc_printf("%s/afl-as", dir);
+        free(self);
+        if (!access(afl_as, X_OK)) return;
+    }
+
+    FATAL("Unable to find afl-as. Please set AFL_PATH");
+}
+
+
+/* FNV-1a */
+
+static u64 spa_hash(u64 h, const u8* buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static u64 spa_hash_file(u64 h, const u8* path) {
+    struct stat st;
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0) PFATAL("Unable to open '%s'", path);
+    if (fstat(fd, &st) < 0) PFATAL("fstat() failed");
+    if (st.st_size) {
+        u8 *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) PFATAL("mmap() failed");
+        h = spa_hash(h, buf, st.st_size);
+        munmap(buf, st.st_size);
+    }
+    close(fd);
+    return h;
+}
+
+/* Everything but the assembly that changes the output of afl-as */
+
+static u64 spa_options_hash(void) {
+    extern char **environ;
+    struct stat st;
+    u64 sum = 0;
+
+    // __SPA_MODE, __SPA_INSTRUMENT_CALLS, __SPA_EMIT_*, ... in any order
+    for (char **env = environ; *env; env++) {
+        if (!strncmp(*env, "__SPA_", 6) && strncmp(*env, SPA_RUSTC_CACHE_ENV "=", strlen(SPA_RUSTC_CACHE_ENV) + 1)) {
+            sum += spa_hash(0xcbf29ce484222325ULL, *env, strlen(*env));
+        }
+    }
+    u8 *funcs = getenv(SPA_PROTECTED_FUNCS_PATH_ENV);
+    if (funcs) sum += spa_hash_file(0xcbf29ce484222325ULL, funcs);
+
+    // a rebuilt afl-as invalidates the cache
+    if (!stat(afl_as, &st)) {
+        sum = spa_hash(sum, (u8*)&st.st_mtime, sizeof(st.st_mtime));
+        sum = spa_hash(sum, (u8*)&st.st_size, sizeof(st.st_size));
+    }
+    return sum;
+}
+
+static s32 spa_copy_file(const u8* from, const u8* to) {
+    static u8 buf[1 << 16];
+    s32 in, out, n = 0;
+
+    unlink(to);
+    if (!link(from, to)) return 0;
+
+    in = open(from, O_RDONLY);
+    if (in < 0) return -1;
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write(out, buf, n) != n) {
+            n = -1;
+            break;
+        }
+    }
+    close(in);
+    close(out);
+    return n < 0 ? -1 : 0;
+}
+
+static s32 spa_run(u8** argv) {
+    s32 status;
+    pid_t pid = fork();
+
+    if (pid < 0) PFATAL("fork() failed");
+    if (!pid) {
+        execvp(argv[0], (char**)argv);
+        PFATAL("Oops, failed to execute '%s'", argv[0]);
+    }
+    if (waitpid(pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+
+/* A codegen unit, X.rcgu.o and its assembly */
+
+struct spa_cgu {
+    u8 *obj;
+    u8 *asm_file;
+};
+
+/*
+    Write the instrumented objects from the assembly of the codegen units,
+    running up to one afl-as per CPU.
+ */
+
+static void spa_instrument_cgus(struct spa_cgu* cgus, u32 n) {
+    u8 *cache = getenv(SPA_RUSTC_CACHE_ENV);
+    u8 **cached = ck_alloc(n * sizeof(u8*));
+    pid_t *pids = ck_alloc(n * sizeof(pid_t));
+    u64 opts = 0;
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    u32 next = 0, running = 0;
+
+    if (cache) {
+        mkdir(cache, 0755);
+        opts = spa_options_hash();
+    }
+    if (max_jobs < 1) max_jobs = 1;
+
+    for (u32 i = 0; i < n; i++) {
+        if (cache) {
+            u64 h = spa_hash_file(0xcbf29ce484222325ULL, cgus[i].asm_file);
+            cached[i] = alloc_printf("%s/%016llx%016llx.o", cache, (unsigned long long)h,
+                                     (unsigned long long)opts);
+            if (!access(cached[i], R_OK) && !spa_copy_file(cached[i], cgus[i].obj)) {
+                ck_free(cached[i]);
+                cached[i] = NULL;
+                continue;
+            }
+        }
+        // rustc hard-links its outputs with the incremental cache, never write in place
+        unlink(cgus[i].obj);
+        pids[i] = -1;
+    }
+
+    while (next < n || running) {
+        if (next < n && running < max_jobs) {
+            if (pids[next] != -1) {     // cached
+                next++;
+                continue;
+            }
+            u8 *argv[] = { afl_as, "--64", "-o", cgus[next].obj, cgus[next].asm_file, NULL };
+            pids[next] = fork();
+            if (pids[next] < 0) PFATAL("fork() failed");
+            if (!pids[next]) {
+                execv(afl_as, (char**)argv);
+                PFATAL("Oops, failed to execute '%s'", afl_as);
+            }
+            next++;
+            running++;
+            continue;
+        }
+
+        s32 status;
+        pid_t pid = wait(&status);
+        if (pid < 0) PFATAL("wait() failed");
+        running--;
+        for (u32 i = 0; i < n; i++) {
+            if (pids[i] != pid) continue;
+            if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+                FATAL("afl-as failed on '%s'", cgus[i].asm_file);
+            }
+            if (cache) {
+                u8 *tmp = alloc_printf("%s.%d", cached[i], getpid());
+                if (!spa_copy_file(cgus[i].obj, tmp)) rename(tmp, cached[i]);
+                unlink(tmp);
+                ck_free(tmp);
+            }
+            break;
+        }
+    }
+
+    // the assembly is only a by-product, unless --emit=asm was given
+    if (!getenv(SPA_RUSTC_KEEP_ASM_ENV)) {
+        for (u32 i = 0; i < n; i++) unlink(cgus[i].asm_file);
+    }
+
+    for (u32 i = 0; i < n; i++) {
+        if (cache && cached[i]) ck_free(cached[i]);
+    }
+    ck_free(cached);
+    ck_free(pids);
+}
+
+/*
+    The assembly of X.rcgu.o is X.rcgu.s, or <crate>.s in the same directory
+    if it is the only codegen unit, where X is <crate>.<cgu>[.<session>]
+    and <cgu> is given by the .file directive.
+ */
+
+static u8* spa_asm_of(const u8* obj) {
+    static u8 tmp_line[MAX_LINE];
+    size_t len = strlen(obj), n = strlen(SPA_RCGU_OBJ_SUFFIX);
+    u8 *s_file, *base, *dot, *cgu;
+    FILE *f;
+
+    if (len <= n || strcmp(obj + len - n, SPA_RCGU_OBJ_SUFFIX)) return NULL;
+
+    s_file = ck_strdup((u8*)obj);
+    s_file[len - 1] = 's';
+    if (!access(s_file, R_OK)) return s_file;
+    ck_free(s_file);
+
+    base = strrchr(obj, '/');
+    base = base ? base + 1 : (u8*)obj;
+    dot = strchr(base, '.');
+    s_file = alloc_printf("%.*s.s", (int)(dot - obj), obj);
+    f = fopen(s_file, "r");
+    if (f && fgets(tmp_line, MAX_LINE, f) && !strncmp(tmp_line, "\t.file\t\"", 8)) {
+        cgu = tmp_line + 8;
+        cgu[strcspn(cgu, "\"")] = 0;
+        if (!strncmp(dot + 1, cgu, strlen(cgu)) && dot[1 + strlen(cgu)] == '.') {
+            fclose(f);
+            return s_file;
+        }
+    }
+    if (f) fclose(f);
+    ck_free(s_file);
+    return NULL;
+}
+
+static void spa_add_cgu(struct spa_cgu** cgus, u32* n, u8* obj) {
+    u8 *asm_file = spa_asm_of(obj);
+    if (asm_file) {
+        *cgus = ck_realloc(*cgus, (*n + 1) * sizeof(struct spa_cgu));
+        (*cgus)[*n].obj = ck_strdup(obj);
+        (*cgus)[*n].asm_file = asm_file;
+        (*n)++;
+    }
+}
+
+
+/*
+    Invoked by rustc as the linker (-C linker=spa-rustc).
+    The arguments might be in a response file @file, one per line.
+ */
+
+static void spa_rustc_link(u32 argc, char** argv) {
+    struct spa_cgu *cgus = NULL;
+    u32 n = 0;
+    u8 *real_linker = getenv(SPA_RUSTC_LINKER_ENV);
+
+    for (u32 i = 1; i < argc; i++) {
+        if (argv[i][0] == '@') {
+            static u8 tmp_line[MAX_LINE];
+            FILE *f = fopen(argv[i] + 1, "r");
+            if (!f) continue;
+            while (fgets(tmp_line, MAX_LINE, f)) {
+                tmp_line[strcspn(tmp_line, "\n")] = 0;
+                spa_add_cgu(&cgus, &n, tmp_line);
+            }
+            fclose(f);
+        } else {
+            spa_add_cgu(&cgus, &n, argv[i]);
+        }
+    }
+
+    if (n) spa_instrument_cgus(cgus, n);
+
+    /* The runtime library of the mode (see spa_modes.h) goes ahead of the objects
+       and the libraries rustc adds, libc included. It is then before libc in
+       DT_NEEDED, so its pthread_create() interposes. -C link-args would come after
+       libc. It is linked even if no symbol is referenced (--as-needed), e.g. fs-tls. */
 
+    const struct spa_mode *mode = spa_find_mode(getenv(SPA_MODE_ENV));
+    u8 **ld_params = ck_alloc((argc + 8) * sizeof(u8*));
+    u32 ld_par_cnt = 0;
 
+    ld_params[ld_par_cnt++] = *real_linker ? real_linker : (u8*)"cc";
+    if (mode && mode->rt_lib) {
+        ld_params[ld_par_cnt++] = "-L" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
+        ld_params[ld_par_cnt++] = "-Wl,--push-state,--no-as-needed";
+        ld_params[ld_par_cnt++] = alloc_printf("-l%s", mode->rt_lib);
+        ld_params[ld_par_cnt++] = "-Wl,--pop-state";
+        ld_params[ld_par_cnt++] = "-Wl,-rpath=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
+    }
+    for (u32 i = 1; i < argc; i++) ld_params[ld_par_cnt++] = argv[i];
+    ld_params[ld_par_cnt] = NULL;
+
+    unsetenv(SPA_RUSTC_LINKER_ENV);
+    execvp(ld_params[0], (char**)ld_params);
+
+    FATAL("Oops, failed to execute '%s' - check your PATH", ld_params[0]);
+}
+
+
+/* Replace the X.rcgu.o members of an rlib or a staticlib */
+
+static void spa_rustc_patch_archive(u8* archive) {
+    static u8 tmp_line[MAX_LINE];
+    struct spa_cgu *cgus = NULL;
+    u32 n = 0;
+    u8 *cmd = alloc_printf("ar t '%s'", archive);
+    FILE *f = popen(cmd, "r");
+
+    if (!f) PFATAL("popen() failed");
+    while (fgets(tmp_line, MAX_LINE, f)) {
+        tmp_line[strcspn(tmp_line, "\n")] = 0;
+        u8 *obj = alloc_printf("%s/%s", out_dir, tmp_line);
+        spa_add_cgu(&cgus, &n, obj);
+        ck_free(obj);
+    }
+    if (pclose(f)) FATAL("Unable to list the members of '%s'", archive);
+    ck_free(cmd);
+
+    if (!n) return;
+
+    spa_instrument_cgus(cgus, n);
+
+    u8 **ar_params = ck_alloc((n + 4) * sizeof(u8*));
+    ar_params[0] = "ar";
+    ar_params[1] = "r";
+    ar_params[2] = archive;
+    for (u32 i = 0; i < n; i++) ar_params[i + 3] = cgus[i].obj;
+    if (spa_run(ar_params)) FATAL("Unable to update '%s'", archive);
+
+    for (u32 i = 0; i < n; i++) {
+        unlink(cgus[i].obj);
+        ck_free(cgus[i].obj);
+        ck_free(cgus[i].asm_file);
+    }
+    ck_free(cgus);
+    ck_free(ar_params);
+}
+
+static u8* spa_rustc_output(u32 type) {
+    switch (type) {
+        case SPA_CRATE_BIN:         return alloc_printf("%s/%s%s", out_dir, crate_name, extra_filename);
+        case SPA_CRATE_RLIB:        return alloc_printf("%s/lib%s%s.rlib", out_dir, crate_name, extra_filename);
+        case SPA_CRATE_STATICLIB:   return alloc_printf("%s/lib%s%s.a", out_dir, crate_name, extra_filename);
+        default:                    return alloc_printf("%s/lib%s%s.so", out_dir, crate_name, extra_filename);
+    }
+}
+
+static u32 spa_crate_type(const u8* types) {
+    u8 *tmp = ck_strdup((u8*)types);
+    char *saveptr = NULL;
+    u32 ret = 0;
+
+    for (u8 *t = strtok_r(tmp, ",", &saveptr); t; t = strtok_r(NULL, ",", &saveptr)) {
+        if (!strcmp(t, "bin")) ret |= SPA_CRATE_BIN;
+        else if (!strcmp(t, "rlib") || !strcmp(t, "lib")) ret |= SPA_CRATE_RLIB;
+        else if (!strcmp(t, "staticlib")) ret |= SPA_CRATE_STATICLIB;
+        else if (!strcmp(t, "dylib") || !strcmp(t, "cdylib")) ret |= SPA_CRATE_DYLIB;
+        else if (!strcmp(t, "proc-macro")) ret |= SPA_CRATE_PROC_MACRO;
+    }
+    ck_free(tmp);
+    return ret;
+}
+
+// the value of "--opt=val", "--opt val", "-Xval" or "-X val"
+static u8* spa_opt_value(u8* opt, u32* argc, char*** argv) {
+    u8 *cur = **argv;
+    size_t len = strlen(opt);
+
+    if (strncmp(cur, opt, len)) return NULL;
+    if (cur[len] == '=' && opt[1] == '-') return cur + len + 1;
+    if (cur[len] && opt[1] != '-') return cur + len;
+    if (!cur[len] && *argc > 1) {
+        (*argc)--;
+        (*argv)++;
+        return **argv;
+    }
+    return NULL;
+}
 
 
 /* Copy argv to cc_params, making the necessary edits. */
@@ -34,6 +457,8 @@ static void edit_params(u32 argc, char** argv) {
     //u8 *spa_path;
 //    u8 *name;
 //    int is_so = 0;
+    u8 *emit = NULL, pass_thru = 0;
+
     cc_params = ck_alloc((argc + 128) * sizeof(u8*));
 
 //    name = strrchr(argv[0], '/');
@@ -44,19 +469,109 @@ static void edit_params(u32 argc, char** argv) {
 
     while (--argc) {
         u8* cur = *(++argv);
+        u8* val;
+
+        // tracked by cargo in RUSTFLAGS, unlike the environment variable
+        if ((val = spa_opt_value("--spa-protected-funcs", &argc, &argv))) {
+            setenv(SPA_PROTECTED_FUNCS_PATH_ENV, val, 1);
+            continue;
+        }
+        if ((val = spa_opt_value("--emit", &argc, &argv))) {
+            emit = val;
+            continue;
+        }
+        if ((val = spa_opt_value("-o", &argc, &argv))) {
+            out_file = val;
+            continue;
+        }
+        if ((val = spa_opt_value("-C", &argc, &argv)) || (val = spa_opt_value("--codegen", &argc, &argv))) {
+            if (!strncmp(val, "linker=", 7)) {
+                linker = val + 7;
+                continue;
+            }
+            if (!strncmp(val, "extra-filename=", 15)) extra_filename = val + 15;
+            cc_params[cc_par_cnt++] = "-C";
+            cc_params[cc_par_cnt++] = val;
+            continue;
+        }
+
+        if ((val = spa_opt_value("--crate-name", &argc, &argv))) crate_name = val;
+        else if ((val = spa_opt_value("--crate-type", &argc, &argv))) crate_types |= spa_crate_type(val);
+        else if ((val = spa_opt_value("--out-dir", &argc, &argv))) out_dir = val;
+        else if (!strncmp(cur, "--print", 7) || !strcmp(cur, "-V") || !strcmp(cur, "-vV")
+                 || !strcmp(cur, "--version") || !strncmp(cur, "--explain", 9)) pass_thru = 1;
+        else if (cur[0] != '-' && strlen(cur) > 3 && !strcmp(cur + strlen(cur) - 3, ".rs")) input_file = cur;
+
+        if (val) {
+            cc_params[cc_par_cnt++] = cur;
+            if (cur != val && (u8*)*argv == val) cc_params[cc_par_cnt++] = val;
+            continue;
+        }
         cc_params[cc_par_cnt++] = cur;
     }
 
+#if 0
     cc_params[cc_par_cnt++] = "-C";
     cc_params[cc_par_cnt++] = "no-integrated-as";
+#endif
 
+    if (!crate_types) crate_types = SPA_CRATE_BIN;
+    if (!crate_name && input_file) {
+        u8 *base = strrchr(input_file, '/');
+        crate_name = ck_strdup(base ? base + 1 : input_file);
+        crate_name[strlen(crate_name) - 3] = 0;
+        for (u8 *p = crate_name; *p; p++) if (*p == '-') *p = '_';
+    }
 
-#if defined(USE_SPA_BUDDY_STACK_TLS_WITH_STK_SIZE)
-    cc_params[cc_par_cnt++] = "-L="DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
-    cc_params[cc_par_cnt++] = "-lbustk";
-    cc_params[cc_par_cnt++] = "-C";
-    cc_params[cc_par_cnt++] = "link-args=-Wl,-rpath=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
-#endif
+    // proc-macros are loaded by rustc itself, never instrument them
+    instrumented = !pass_thru && crate_name && !(crate_types & SPA_CRATE_PROC_MACRO)
+                   && (!emit || strstr(emit, "link"));
+
+    if (instrumented) {
+        if (emit && strstr(emit, "asm")) setenv(SPA_RUSTC_KEEP_ASM_ENV, "1", 1);
+        cc_params[cc_par_cnt++] = emit ? alloc_printf("--emit=%s,asm", emit) : (u8*)"--emit=link,asm";
+
+        /* -o with --emit=asm forces one codegen unit, so the default name
+           in the same directory is renamed afterwards */
+        if (out_file) {
+            u8 *tmp = ck_strdup(out_file);
+            out_dir = ck_strdup(dirname(tmp));
+            ck_free(tmp);
+            cc_params[cc_par_cnt++] = "--out-dir";
+            cc_params[cc_par_cnt++] = out_dir;
+        }
+
+        u8 *self = realpath("/proc/self/exe", NULL);
+        if (!self) PFATAL("realpath() failed");
+        cc_params[cc_par_cnt++] = "-C";
+        cc_params[cc_par_cnt++] = alloc_printf("linker=%s", self);
+        free(self);
+        setenv(SPA_RUSTC_LINKER_ENV, linker ? linker : (u8*)"", 1);
+    } else {
+        if (emit) cc_params[cc_par_cnt++] = alloc_printf("--emit=%s", emit);
+        if (out_file) {
+            cc_params[cc_par_cnt++] = "-o";
+            cc_params[cc_par_cnt++] = out_file;
+        }
+        if (linker) {
+            cc_params[cc_par_cnt++] = "-C";
+            cc_params[cc_par_cnt++] = alloc_printf("linker=%s", linker);
+        }
+    }
+
+    // the runtime library of the instrumentation mode (see spa_modes.h)
+    const struct spa_mode *mode = spa_find_mode(getenv(SPA_MODE_ENV));
+    if(!mode){
+        FATAL("Unknown instrumentation mode '%s' in %s", getenv(SPA_MODE_ENV), SPA_MODE_ENV);
+    }
+    // when instrumented, spa_rustc_link() puts it ahead of libc instead
+    if(mode->rt_lib && !instrumented && !(crate_types & SPA_CRATE_PROC_MACRO)){
+        cc_params[cc_par_cnt++] = "-L="DEFAULT_BUDDY_STACK_SIZE_LIB_PATH;
+        // linked even if no symbol is referenced (--as-needed), e.g. fs-tls
+        cc_params[cc_par_cnt++] = "-C";
+        cc_params[cc_par_cnt++] = alloc_printf("link-args=-Wl,--push-state,--no-as-needed,-l%s,--pop-state "
+                                               "-Wl,-rpath=" DEFAULT_BUDDY_STACK_SIZE_LIB_PATH, mode->rt_lib);
+    }
 
 #if 0
     // https://github.com/rust-lang/rust/pull/48786
@@ -78,18 +593,35 @@ int main(int argc, char** argv) {
              "It serves as a drop-in replacement for rustc, \n"
              "letting you recompile third-party code with the required\n"
              "runtime instrumentation.\n\n"
+             "  --spa-protected-funcs <path>  the same as __SPA_PROTECTED_FUNCS_PATH\n"
+             "  __SPA_RUSTC_CACHE=<dir>       cache the instrumented codegen units\n\n"
             );
         exit(1);
 
     }
 
     //find_rustc(argv[0]);
+    find_afl_as(argv[0]);
+
+    if (getenv(SPA_RUSTC_LINKER_ENV)) spa_rustc_link(argc, argv);
 
     edit_params(argc, argv);
 
-    execvp(cc_params[0], (char**)cc_params);
+    if (!instrumented) {
+        execvp(cc_params[0], (char**)cc_params);
+        FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
+    }
+
+    s32 status = spa_run(cc_params);
+    if (status) exit(status);
 
-    FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
+    for (u32 type = SPA_CRATE_BIN; type <= SPA_CRATE_DYLIB; type <<= 1) {
+        if (!(crate_types & type)) continue;
+        u8 *output = spa_rustc_output(type);
+        if (type & (SPA_CRATE_RLIB | SPA_CRATE_STATICLIB)) spa_rustc_patch_archive(output);
+        if (out_file && rename(output, out_file)) PFATAL("Unable to rename '%s' to '%s'", output, out_file);
+        ck_free(output);
+    }
 
     return 0;
 
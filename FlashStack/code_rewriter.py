@@ -16,6 +16,9 @@
 #
 #       the stack size of an exe/so is 8192;  that of the output is 4096
 #
+#  spa-set-stack-size (spa-set-stack-size.c) does the same natively and in parallel,
+#  scanning only the executable sections.
+#
 #
 #
 #                                                    sheisc@163.com
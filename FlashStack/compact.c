@@ -0,0 +1,432 @@
+/*****************************************************************
+            Compact shadow stack
+
+   The shadow stack is a dense array of struct CompactEntry,
+   the return address and the address of its slot on the call stack,
+   indexed by a shadow stack pointer (ssp) in the gs page.
+
+        %gs:(0)     self_addr
+        %gs:(8)     ssp, the next free entry
+
+   Unlike gs-rsp, the shadow stack is not a mirror of the call stack,
+   so its memory is proportional to the call depth instead of the stack size.
+   Every non-leaf frame takes at least 16 bytes on the call stack,
+   so the stack size (plus guard pages) is enough.
+   The array is reserved with MAP_NORESERVE, only the touched pages are backed.
+
+   When the return address on the call stack is not on the top of the
+   shadow stack (longjmp(), C++ exceptions, indirect tail calls, ...),
+   the epilogue jumps to __spa_compact_ret_slow_path(),
+   which pops the entries of the frames below the current one.
+   The entry then on the top must be the one of the current frame.
+
+******************************************************************/
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/user.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+// gettid()
+#include <sys/syscall.h>
+#include <sys/types.h>
+// _GNU_SOURCE has already been set in Makefile
+#include <pthread.h>
+#include <asm/prctl.h>
+#include <sys/prctl.h>
+
+#include <dlfcn.h>
+#include <x86intrin.h>
+#include <limits.h>
+
+#include "spa.h"
+
+
+#define  SPA_MAX_MMAP_ATTEMPTS   5
+
+
+int arch_prctl(int code, ...);
+
+#define  REAL_META_DATA_SIZE        (PAGE_SIZE)
+#define  SHADOW_STACK_GUARD_SIZE    (PAGE_SIZE)
+// the shadow stack of a thread with a 8MB call stack
+#define  MIN_SHADOW_STACK_SIZE      (DEF_BUDDY_CALL_STACK_SIZE)
+// when the stack of the main thread is unlimited
+#define  MAX_SHADOW_STACK_SIZE      (1L << 29)
+
+#define  MAX_THREAD_BUF_CNT         1024
+#define  MONITOR_INTERVAL_IN_SECS       30
+// 10 second
+#define  CPU_CYCLES_AFTER_THREAD_EXITING        ((CPU_CYCLES_PER_RANDOMIZATION) * 1000L * 10)
+
+struct ArgInfo{
+    void *(*start_routine) (void *);
+    void *arg;
+    long stack_size;
+};
+
+// see spa_modes.h
+struct CompactEntry{
+    long ret_addr;
+    long *ret_slot;         // where the return address is on the call stack
+};
+
+struct ThreadRegionInfo{
+    long valid;
+    void *metadata;
+    long metadata_size;
+    void *shadow_stack;
+    long shadow_stack_size;
+    long expired_time;
+    long tid;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+__thread long unsw_flash_stack_inited = 0;
+
+/// Thread data for the cleanup handler
+static pthread_key_t thread_cleanup_key;
+
+static __thread int relaxing_sandbox = 0;
+
+//
+static pthread_t cleaner_tid;
+//
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+//
+static struct ThreadRegionInfo thread_info[MAX_THREAD_BUF_CNT];
+
+static long  total_crash_cnt;
+/////////////////////////////////////////////////////////////////////////////////
+
+void unsw_inc_asm_js_crash_cnt(void){
+    __sync_fetch_and_add(&total_crash_cnt, 1);
+}
+
+static int add_memory_region(struct ThreadRegionInfo * region_info){
+    pthread_mutex_lock(&mutex);
+    for(int i = 0; i < MAX_THREAD_BUF_CNT; i++){
+        if(!thread_info[i].valid){
+            thread_info[i] = *region_info;
+            thread_info[i].valid = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+static void * release_memory_region(void *arg){
+    while(1){
+        pthread_mutex_lock(&mutex);
+        for(int i = 0; i < MAX_THREAD_BUF_CNT; i++){
+            if(thread_info[i].valid &&
+                    (__rdtsc() - thread_info[i].expired_time) > CPU_CYCLES_AFTER_THREAD_EXITING){
+                // unmap the shadow stack first
+                munmap(thread_info[i].shadow_stack, thread_info[i].shadow_stack_size);
+                // then the metadata
+                munmap(thread_info[i].metadata, thread_info[i].metadata_size);
+                thread_info[i].valid = 0;
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+        //
+        sleep(MONITOR_INTERVAL_IN_SECS);
+    }
+    return NULL;
+}
+
+int spa_is_relaxing_sandbox(void){
+    return relaxing_sandbox;
+}
+
+void spa_set_relaxing_sandbox(int v){
+    relaxing_sandbox = v;
+}
+
+static void *get_memory_at_random(unsigned long size, int prot, int flags){
+    void *addr =  MAP_FAILED;
+    long i = 0;
+    while( MAP_FAILED == addr ){
+      unsigned long x = SPA_GEN_RANDOM_VAL();
+
+      x &= 0x7FFFFFFFF000;
+      if(i > SPA_MAX_MMAP_ATTEMPTS){ // avoid dead looping ?
+        x = 0;
+      }
+      addr = mmap( (void *) x, size, prot,
+                            MAP_ANONYMOUS | MAP_PRIVATE | flags, -1, 0);
+      i++;
+    }
+    return addr;
+}
+
+// the guard pages and the shadow stack
+static long get_shadow_region_size(struct compact_metadata *pMetadata){
+    return pMetadata->shadow_stack_size + 2 * SHADOW_STACK_GUARD_SIZE;
+}
+
+static void *get_shadow_region(struct compact_metadata *pMetadata){
+    return ((char *) pMetadata->shadow_stack) - SHADOW_STACK_GUARD_SIZE;
+}
+
+static long get_shadow_stack_size(long call_stack_size){
+    long size = call_stack_size;
+    if(size < MIN_SHADOW_STACK_SIZE){
+        size = MIN_SHADOW_STACK_SIZE;
+    }
+    if(size > MAX_SHADOW_STACK_SIZE){
+        size = MAX_SHADOW_STACK_SIZE;
+    }
+    return (size + PAGE_SIZE - 1) & (-PAGE_SIZE);
+}
+
+// No malloc() here, see init_main_shadow_stack()
+static int do_init_shadow_stack(long call_stack_size){
+    struct compact_metadata * pMetadata = (struct compact_metadata *)
+            get_memory_at_random(REAL_META_DATA_SIZE, PROT_READ | PROT_WRITE, 0);
+
+    if(pMetadata == MAP_FAILED){
+        SPA_ERROR("mmap().");
+    }
+    long shadow_stack_size = get_shadow_stack_size(call_stack_size);
+    // PROT_NONE for the guard pages at both ends
+    char *region = (char *) get_memory_at_random(shadow_stack_size + 2 * SHADOW_STACK_GUARD_SIZE,
+                                                 PROT_NONE, MAP_NORESERVE);
+    if(region == MAP_FAILED){
+        SPA_ERROR("mmap().");
+    }
+    long *shadow_stack = (long *) (region + SHADOW_STACK_GUARD_SIZE);
+    if(mprotect(shadow_stack, shadow_stack_size, PROT_READ | PROT_WRITE) != 0){
+        SPA_ERROR("mprotect().");
+    }
+
+    memset(pMetadata, 0, sizeof(*pMetadata));
+    // %gs:(0)
+    pMetadata->self_addr = pMetadata;
+    // %gs:(8)
+    pMetadata->ssp = shadow_stack;
+    pMetadata->shadow_stack = shadow_stack;
+    pMetadata->shadow_stack_size = shadow_stack_size;
+    pMetadata->cpu_cycles = 0;
+    pMetadata->is_randomizing = 0;
+
+    arch_prctl(ARCH_SET_GS, pMetadata);
+    pMetadata->state = FLASH_STACK_INITED;
+#if 0
+    fprintf(stderr, "tid = %ld, gs_page = %p, shadow_stack = %p, shadow_stack_size = %ld: %s, %d\n",
+                syscall(SYS_gettid), pMetadata, shadow_stack, shadow_stack_size, __FILE__, __LINE__);
+#endif
+    return 0;
+}
+
+static int init_shadow_stack(long call_stack_size){
+    if(unsw_flash_stack_inited){
+        return 0;
+    }
+    unsw_flash_stack_inited = 1;
+    do_init_shadow_stack(call_stack_size);
+    return 0;
+}
+
+static int release_shadow_stack(void){
+    struct compact_metadata * pMetadata = (struct compact_metadata *) (GET_GS_VALUE_AT_OFFSET(0));
+
+    struct ThreadRegionInfo region_info;
+    memset(&region_info, 0, sizeof(region_info));
+    region_info.expired_time = __rdtsc();
+    region_info.metadata = pMetadata;
+    region_info.metadata_size = REAL_META_DATA_SIZE;
+    region_info.shadow_stack = get_shadow_region(pMetadata);
+    region_info.shadow_stack_size = get_shadow_region_size(pMetadata);
+    region_info.tid = syscall(SYS_gettid);
+    add_memory_region(&region_info);
+
+    return 0;
+}
+
+/*
+    Called by __spa_compact_ret_slow_path() when the return address at @ret_slot is not on the top.
+    The frames skipped by longjmp(), exceptions or indirect tail calls are below the current one
+    on the call stack, so their entries are popped. A matching entry of a caller frame is not accepted,
+    which would let a forged return address go to any live caller.
+    (A longjmp() out of a signal handler on a sigaltstack above the call stack is not supported.)
+ */
+__attribute__((used))
+static void compact_unwind_shadow_stack(long ret_addr, long *ret_slot){
+    struct compact_metadata * pMetadata = (struct compact_metadata *) (GET_GS_VALUE_AT_OFFSET(0));
+    struct CompactEntry *bottom = (struct CompactEntry *) pMetadata->shadow_stack;
+    struct CompactEntry *p = (struct CompactEntry *) pMetadata->ssp;
+
+    while(p > bottom && p[-1].ret_slot < ret_slot){
+        p--;
+    }
+    if(p > bottom && p[-1].ret_slot == ret_slot && p[-1].ret_addr == ret_addr){
+        // pop it and all the entries above it
+        pMetadata->ssp = (long *) (p - 1);
+        return;
+    }
+    SPA_ERROR("tid = %ld, return address 0x%lx at %p is not on the shadow stack.",
+              syscall(SYS_gettid), ret_addr, ret_slot);
+}
+
+/*
+    Jumped to from the epilogue, with the return address at (%rsp).
+    The return values in %rax, %rdx, %xmm0 and %xmm1 are preserved
+    (long double in st(0) is not touched by the C code above).
+ */
+__asm__(
+    "\t.text\n"
+    "\t.globl\t"    "__spa_compact_ret_slow_path\n"
+    "\t.type\t"     "__spa_compact_ret_slow_path, @function\n"
+    "__spa_compact_ret_slow_path:\n"
+    "\tpushq\t"     "%rax\n"
+    "\tpushq\t"     "%rdx\n"
+    // keep %rsp 16-byte aligned
+    "\tsubq\t"      "$40, %rsp\n"
+    "\tmovdqu\t"    "%xmm0, (%rsp)\n"
+    "\tmovdqu\t"    "%xmm1, 16(%rsp)\n"
+    "\tmovq\t"      "56(%rsp), %rdi\n"
+    "\tleaq\t"      "56(%rsp), %rsi\n"
+    "\tcall\t"      "compact_unwind_shadow_stack\n"
+    "\tmovdqu\t"    "16(%rsp), %xmm1\n"
+    "\tmovdqu\t"    "(%rsp), %xmm0\n"
+    "\taddq\t"      "$40, %rsp\n"
+    "\tpopq\t"      "%rdx\n"
+    "\tpopq\t"      "%rax\n"
+    "\tret\n"
+    "\t.size\t"     "__spa_compact_ret_slow_path, .-__spa_compact_ret_slow_path\n"
+);
+
+static void * do_start_routine(void *arg){
+    // copy to local variables, then release the heap object
+    struct ArgInfo * pArg = (struct ArgInfo *)arg;
+    struct ArgInfo argInfo = *pArg;
+    // now we are in the new thread context.
+    init_shadow_stack(argInfo.stack_size);
+    free(pArg);
+
+    pthread_setspecific(thread_cleanup_key, (void*) 1);
+
+    return (argInfo.start_routine)(argInfo.arg);
+}
+
+typedef int (* PTHREAD_CREATE_FUNC)(pthread_t *thread, const pthread_attr_t *attr,
+                          void *(*start_routine) (void *), void *arg);
+static PTHREAD_CREATE_FUNC _pthread_create;
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                          void *(*start_routine) (void *), void *arg){
+    size_t stacksize = DEF_BUDDY_CALL_STACK_SIZE;
+    // FIXME: race condition
+    if(!_pthread_create){
+        _pthread_create = (PTHREAD_CREATE_FUNC) dlsym(RTLD_NEXT, "pthread_create");
+
+        // create a thread for
+        _pthread_create(&cleaner_tid, NULL, release_memory_region, NULL);
+    }
+    // The stack size is only read, the shadow stack follows it.
+    if(attr){
+        pthread_attr_getstacksize(attr, &stacksize);
+    }else{
+        pthread_attr_t defaultAttr;
+        if(pthread_getattr_default_np(&defaultAttr) == 0){
+            pthread_attr_getstacksize(&defaultAttr, &stacksize);
+            pthread_attr_destroy(&defaultAttr);
+        }
+    }
+
+    struct ArgInfo * pArgInfo = (struct ArgInfo *) malloc(sizeof(struct ArgInfo));
+    pArgInfo->start_routine= start_routine;
+    pArgInfo->arg = arg;
+    pArgInfo->stack_size = stacksize;
+    return _pthread_create(thread, attr, &do_start_routine, pArgInfo);
+}
+
+// we call it in customized malloc(), so no malloc() here.
+int init_main_shadow_stack(void){
+    struct rlimit rlim;
+    long call_stack_size = DEF_BUDDY_CALL_STACK_SIZE;
+
+    if(unsw_flash_stack_inited){
+        return 0;
+    }
+    if(getrlimit(RLIMIT_STACK, &rlim) == 0){
+        call_stack_size = (rlim.rlim_cur == RLIM_INFINITY) ? 2 * MAX_SHADOW_STACK_SIZE : (long) rlim.rlim_cur;
+    }
+    init_shadow_stack(call_stack_size);
+    return 0;
+}
+
+void compact_runtime_rerandomize(void){
+    if(!unsw_flash_stack_inited){
+        return;
+    }
+    struct compact_metadata *old_metadata = (struct compact_metadata *) GET_GS_VALUE_AT_OFFSET(0);
+
+    if(old_metadata->state != FLASH_STACK_INITED){
+        return;
+    }
+    if(old_metadata->is_randomizing){
+        return;
+    }
+    old_metadata->is_randomizing = 1;
+
+    unsigned long last_clocks = old_metadata->cpu_cycles;
+    unsigned long cur_clocks = __rdtsc();
+    if((cur_clocks - last_clocks) < CPU_CYCLES_PER_RANDOMIZATION){
+        old_metadata->is_randomizing = 0;
+        return;
+    }
+    old_metadata->cpu_cycles = cur_clocks;
+
+    long region_size = get_shadow_region_size(old_metadata);
+    struct compact_metadata *new_metadata = (struct compact_metadata *)
+            get_memory_at_random(REAL_META_DATA_SIZE, PROT_READ | PROT_WRITE, 0);
+    char *new_region = (char *) get_memory_at_random(region_size, PROT_NONE, MAP_NORESERVE);
+
+    if((new_metadata != MAP_FAILED) && (new_region != MAP_FAILED)){
+        char *old_region = get_shadow_region(old_metadata);
+        // the guard pages are moved together
+        char *region = mremap(old_region, region_size, region_size,
+                              MREMAP_MAYMOVE | MREMAP_FIXED, new_region);
+        long delta = region - old_region;
+
+        *new_metadata = *old_metadata;
+        new_metadata->self_addr = new_metadata;
+        new_metadata->shadow_stack = (long *) (((char *) old_metadata->shadow_stack) + delta);
+        new_metadata->ssp = (long *) (((char *) old_metadata->ssp) + delta);
+        arch_prctl(ARCH_SET_GS, new_metadata);
+
+        munmap(old_metadata, REAL_META_DATA_SIZE);
+        old_metadata = new_metadata;
+    }else{ // FIXME: it should not get here.
+        fprintf(stderr, "tid = %ld: while(1) %s, %d \n",
+               syscall(SYS_gettid),  __FILE__, __LINE__);
+        while(1);
+    }
+    old_metadata->is_randomizing = 0;
+}
+
+/// Thread-specific data destructor
+static void thread_cleanup_handler(void* _iter) {
+  // Release the shadow stack only after all other destructors have already run.
+  size_t iter = (size_t) _iter;
+  if (iter < PTHREAD_DESTRUCTOR_ITERATIONS) {
+    pthread_setspecific(thread_cleanup_key, (void*) (iter + 1));
+  } else {
+    // This is the last iteration
+    release_shadow_stack();
+  }
+}
+
+static int __attribute__((constructor(101))) do_init_main_shadow_stack(void){
+    pthread_key_create(&thread_cleanup_key, thread_cleanup_handler);
+
+    init_main_shadow_stack();
+    buddy_init_rt_lib_hooker();
+    return 0;
+}
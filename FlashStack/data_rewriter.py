@@ -10,6 +10,9 @@
 #
 #       the stack size of an exe is 8192;  that of the output is 4096
 #
+#  spa-set-stack-size (spa-set-stack-size.c) does the same by the symbol
+#  .BUDDY.CALL_STACK_SIZE_MASK, instead of searching the whole file for the page.
+#
 #
 #
 #                                                    sheisc@163.com
@@ -42,18 +42,22 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
     stacksize = BUDDY_STACK_SIZE;
 
 
-    if(!attr){
+    // The buddy stack needs exactly BUDDY_STACK_SIZE, set in a copy of the caller's attr.
+    // A thread with its own stack is left as it is.
+    if(!attr || spa_copy_thread_attr(&threadAttr, attr) == 0){
+        if(pthread_attr_setstacksize(&threadAttr, stacksize) != 0){
+            fprintf(stderr, "error in pthread_attr_setstacksize()\n");
+        }
         attr = &threadAttr;
     }
-    if(pthread_attr_setstacksize(( pthread_attr_t *)attr, stacksize) != 0){
-        fprintf(stderr, "error in pthread_attr_setstacksize()\n");
-    }
 #if 0
     SPA_DEBUG_OUTPUT(printf("pthread_create() is hijacked. \n"));
 #endif
     //fprintf(stderr, "%s, %s, %d\n", __FUNCTION__, __FILE__, __LINE__);
 
-    return _pthread_create(thread, attr, start_routine, arg);
+    int ret = _pthread_create(thread, attr, start_routine, arg);
+    pthread_attr_destroy(&threadAttr);
+    return ret;
 }
 
 
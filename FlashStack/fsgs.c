@@ -54,6 +54,26 @@
 int arch_prctl(int code, ...);
 int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
 
+#if defined(SPA_ENABLE_FS_TLS)
+/*
+    The instrumented code reads the offset via %fs (see fs-tls in spa_modes.h),
+    so neither arch_prctl() nor %gs is needed.
+    The main executable defines its own __spa_fs_diff for %fs:__spa_fs_diff@tpoff,
+    which takes precedence over this one.
+ */
+__thread long __spa_fs_diff __attribute__((tls_model("initial-exec")));
+static __thread struct gs_metadata *fstls_metadata;
+
+#define  GET_FSGS_METADATA()        (fstls_metadata)
+#define  SET_FSGS_METADATA(m)       do{ \
+    fstls_metadata = (m); \
+    __spa_fs_diff = (m)->diff; \
+}while(0)
+#else
+#define  GET_FSGS_METADATA()        ((struct gs_metadata *) GET_GS_VALUE_AT_OFFSET(0))
+#define  SET_FSGS_METADATA(m)       arch_prctl(ARCH_SET_GS, (m))
+#endif
+
 
 
 
@@ -71,8 +91,8 @@ int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
 //})
 
 
-// (8 + 1) MB
-#define  REAL_SHADOW_STACK_SIZE   ((DEF_BUDDY_CALL_STACK_SIZE) + (1L << 20))
+// (8 + 1) MB for a call stack of 8MB, the shadow stack is proportional to the call stack
+#define  REAL_SHADOW_STACK_SIZE(css)    ((css) + (1L << 20))
 #define  REAL_META_DATA_SIZE      (PAGE_SIZE)
 
 #define  MAX_THREAD_BUF_CNT         1024
@@ -83,6 +103,7 @@ int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
 struct ArgInfo{
     void *(*start_routine) (void *);
     void *arg;
+    long call_stack_size;
 };
 
 struct ThreadRegionInfo{
@@ -124,8 +145,14 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct ThreadRegionInfo thread_info[MAX_THREAD_BUF_CNT];
 
 static long  total_crash_cnt;
+
+// see SPA_RERAND_COPY_ENV
+static int rerand_copy;
+
+// the shadow stacks this thread has left behind
+static __thread struct spa_retired_shadow_stacks retired_shadow_stacks;
 /////////////////////////////////////////////////////////////////////////////////
-static int init_shadow_stack(void);
+static int init_shadow_stack(long call_stack_size);
 
 void unsw_inc_asm_js_crash_cnt(void){
     //total_crash_cnt++;
@@ -207,7 +234,7 @@ void *get_memory_at_random(unsigned long size){
     return addr;
 }
 
-static int set_call_stack_info(struct gs_metadata * pMetadata){
+static int set_call_stack_info(struct gs_metadata * pMetadata, long call_stack_size){
     pthread_attr_t attr;
     int ret;
     size_t stack_size;
@@ -226,7 +253,7 @@ static int set_call_stack_info(struct gs_metadata * pMetadata){
     stack_high = (char *)stack_low + stack_size;
 
     // Adjust stack_size
-    stack_size = DEF_BUDDY_CALL_STACK_SIZE;
+    stack_size = call_stack_size;
 
     //FIXME
     if(stack_high < (char *)stack_low + stack_size){
@@ -234,7 +261,7 @@ static int set_call_stack_info(struct gs_metadata * pMetadata){
     }
 
     pMetadata->call_stack_top = stack_high;
-    pMetadata->shadow_stack_top = (char *)(pMetadata->shadow_stack) + DEF_BUDDY_CALL_STACK_SIZE;
+    pMetadata->shadow_stack_top = (char *)(pMetadata->shadow_stack) + call_stack_size;
     // Now pMetadata is ready
     pMetadata->state = FLASH_STACK_INITED;
 
@@ -245,7 +272,7 @@ static int set_call_stack_info(struct gs_metadata * pMetadata){
 }
 
 
-static int do_init_shadow_stack(void){
+static int do_init_shadow_stack(long call_stack_size){
     struct gs_metadata * pMetadata =
             (struct gs_metadata *) get_memory_at_random(REAL_META_DATA_SIZE);
 
@@ -254,7 +281,7 @@ static int do_init_shadow_stack(void){
     }
 
     long * shadow_stack =
-            (long *) get_memory_at_random(REAL_SHADOW_STACK_SIZE);
+            (long *) get_memory_at_random(REAL_SHADOW_STACK_SIZE(call_stack_size));
 
     if(shadow_stack == MAP_FAILED){
         SPA_ERROR("mmap().");
@@ -280,7 +307,7 @@ static int do_init_shadow_stack(void){
 
     // int pthread_attr_setstacksize(pthread_attr_t *attr, size_t stacksize);
 
-    long diff = ((long) shadow_stack) + DEF_BUDDY_CALL_STACK_SIZE - ((long) SPA_GET_RSP());
+    long diff = ((long) shadow_stack) + call_stack_size - ((long) SPA_GET_RSP());
 
 #if 0
     fprintf(stderr, "tid = %ld, gs_page = %p, shadow_stack = %p %s, %d\n",
@@ -306,11 +333,11 @@ static int do_init_shadow_stack(void){
     long x = 0;
 
     //spa_set_relaxing_sandbox(1);
-    arch_prctl(ARCH_SET_GS, pMetadata);
+    SET_FSGS_METADATA(pMetadata);
     //spa_set_relaxing_sandbox(0);
 
     // now we can set the top of the call stack
-    set_call_stack_info(pMetadata);
+    set_call_stack_info(pMetadata, call_stack_size);
 
 
 
@@ -330,24 +357,32 @@ static int do_init_shadow_stack(void){
 
 // we call it in customized malloc().
 // so no call malloc() here to make sure the register gs is ready before real work of malloc().
-static int init_shadow_stack(void){
+static int init_shadow_stack(long call_stack_size){
     if(unsw_flash_stack_inited){
         return 0;
     }
     unsw_flash_stack_inited = 1;
-    do_init_shadow_stack();
+    do_init_shadow_stack(call_stack_size);
     return 0;
 }
 
 
 
+static void unmap_retired_shadow_stack(void *addr, unsigned long size){
+    munmap(addr, size);
+}
+
 static int release_shadow_stack(void){
 
     // release the shadow stack
     // At the stage, we can use gs:(0) and gs:(8) respectively.
 
-    struct gs_metadata * pMetadata = (struct gs_metadata *) (GET_GS_VALUE_AT_OFFSET(0));
+    struct gs_metadata * pMetadata = GET_FSGS_METADATA();
     void *shadow_stack = pMetadata->shadow_stack;
+    long call_stack_size = ((char *) pMetadata->shadow_stack_top) - ((char *) shadow_stack);
+
+    spa_release_retired_shadow_stacks(&retired_shadow_stacks, REAL_SHADOW_STACK_SIZE(call_stack_size),
+                                      unmap_retired_shadow_stack);
 
 #if 0
     fprintf(stderr, "release_shadow_stack(): tid = %ld, gs_page = %p, shadow_stack = %p: %s, %d \n",
@@ -356,7 +391,7 @@ static int release_shadow_stack(void){
 
 #if 0
     // unmap the shadow stack first
-    munmap(shadow_stack, REAL_SHADOW_STACK_SIZE);
+    munmap(shadow_stack, REAL_SHADOW_STACK_SIZE(call_stack_size));
     // then the metadata
     munmap(pMetadata, REAL_META_DATA_SIZE);
 
@@ -368,7 +403,7 @@ static int release_shadow_stack(void){
     region_info.metadata = pMetadata;
     region_info.metadata_size = REAL_META_DATA_SIZE;
     region_info.shadow_stack = shadow_stack;
-    region_info.shadow_stack_size = REAL_SHADOW_STACK_SIZE;
+    region_info.shadow_stack_size = REAL_SHADOW_STACK_SIZE(call_stack_size);
     region_info.tid = syscall(SYS_gettid);
     add_memory_region(&region_info);
 
@@ -377,7 +412,7 @@ static int release_shadow_stack(void){
 
 static void * do_start_routine(void *arg){
     // now we are in the new thread context.
-    init_shadow_stack();
+    init_shadow_stack(((struct ArgInfo *) arg)->call_stack_size);
     // call it without checking
     //do_init_shadow_stack();
 #if 0
@@ -436,17 +471,31 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
     stacksize = DEF_BUDDY_CALL_STACK_SIZE;
 
     if(!attr){
+        if(pthread_attr_setstacksize(&threadAttr, stacksize) != 0){
+            fprintf(stderr, "error in pthread_attr_setstacksize()\n");
+        }
         attr = &threadAttr;
-    }
-    if(pthread_attr_setstacksize(( pthread_attr_t *)attr, stacksize) != 0){
-        fprintf(stderr, "error in pthread_attr_setstacksize()\n");
+    }else{
+        // keep the size requested by the caller if the shadow stack can cover it, see gs.rsp.c
+        pthread_attr_getstacksize(attr, &stacksize);
+        if(stacksize > DEF_BUDDY_CALL_STACK_SIZE){
+            if(spa_copy_thread_attr(&threadAttr, attr) == 0
+                    && pthread_attr_setstacksize(&threadAttr, DEF_BUDDY_CALL_STACK_SIZE) == 0){
+                attr = &threadAttr;
+            }
+            stacksize = DEF_BUDDY_CALL_STACK_SIZE;
+        }
+        stacksize = (stacksize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     }
 
     struct ArgInfo * pArgInfo = (struct ArgInfo *) malloc(sizeof(struct ArgInfo));
     pArgInfo->start_routine= start_routine;
     pArgInfo->arg = arg;
+    pArgInfo->call_stack_size = stacksize;
 #if 1
-    return _pthread_create(thread, attr, &do_start_routine, pArgInfo);
+    int ret = _pthread_create(thread, attr, &do_start_routine, pArgInfo);
+    pthread_attr_destroy(&threadAttr);
+    return ret;
 #endif
     //return _pthread_create(thread, attr, start_routine, arg);
 }
@@ -485,6 +534,10 @@ int futex(int *uaddr, int futex_op, int val,
 #endif
 
 int init_main_shadow_stack(void){
+    // called at the entry of the customized malloc(), free(), ..., so nothing but a TLS load once inited
+    if(unsw_flash_stack_inited){
+        return 0;
+    }
 #if 0
     long x = 0;
     arch_prctl(ARCH_GET_GS, &x);
@@ -526,7 +579,7 @@ int init_main_shadow_stack(void){
 //        _pthread_exit = (PTHREAD_EXIT_FUNC)dlsym(RTLD_NEXT, "pthread_exit");
 //    }
 
-    init_shadow_stack();
+    init_shadow_stack(spa_main_call_stack_size(DEF_BUDDY_CALL_STACK_SIZE));
 
 #if 0
     arch_prctl(ARCH_GET_GS, &x);
@@ -567,11 +620,28 @@ static inline void avx2_64_x_4_add(unsigned long * ss_ptr, unsigned long * ss_en
 }
 
 
+/*
+    Copy the live part of the shadow stack to @new_shadow_stack (see spa_copy_shadow_stack()).
+    The live part is from the shadow of the current frame up to the highest resident page above
+    shadow_stack_top (the frames above the initial %rsp).
+ */
+static void *copy_shadow_stack(struct gs_metadata *pMetadata, char *new_shadow_stack, long size){
+    char *old_shadow_stack = (char *) pMetadata->shadow_stack;
+    char *top = (char *) pMetadata->shadow_stack_top;
+    char *from = (char *) ((SPA_GET_RSP() + pMetadata->diff) & ~(PAGE_SIZE - 1));
+    if(from < old_shadow_stack){
+        from = old_shadow_stack;
+    }
+    char *to = spa_resident_end(top, old_shadow_stack + size);
+    spa_copy_shadow_stack(from, to, new_shadow_stack - old_shadow_stack);
+    return new_shadow_stack;
+}
+
 void fsgs_runtime_rerandomize(void){
     if(!unsw_flash_stack_inited){
         return;
     }
-    struct gs_metadata *old_metadata = (struct gs_metadata *) GET_GS_VALUE_AT_OFFSET(0);
+    struct gs_metadata *old_metadata = GET_FSGS_METADATA();
 
     if(old_metadata->state != FLASH_STACK_INITED){
         return;
@@ -623,8 +693,10 @@ void fsgs_runtime_rerandomize(void){
         struct gs_metadata *new_metadata =
                 (struct gs_metadata *) get_memory_at_random(REAL_META_DATA_SIZE);
 
+        long shadow_stack_size = REAL_SHADOW_STACK_SIZE(((char *) old_metadata->shadow_stack_top)
+                                                        - ((char *) old_metadata->shadow_stack));
         void * new_shadow_stack =
-                (long *) get_memory_at_random(REAL_SHADOW_STACK_SIZE);
+                (long *) get_memory_at_random(shadow_stack_size);
 
         if((new_metadata != MAP_FAILED) && (new_shadow_stack != MAP_FAILED)){
             // copy() is faster than mremap() for metatdata?
@@ -636,15 +708,21 @@ void fsgs_runtime_rerandomize(void){
             //new_metadata->cpu_cycles = __rdtsc();
 
             void * old_shadow_stack = old_metadata->shadow_stack;
-            // To be optimized, old size can be shrinked ?
-            void *shadow_stack = mremap(old_shadow_stack,
-                                     REAL_SHADOW_STACK_SIZE,
-                                     REAL_SHADOW_STACK_SIZE,
-                                     MREMAP_MAYMOVE | MREMAP_FIXED,
-                                     new_shadow_stack);
+            void *shadow_stack;
+            if(rerand_copy){
+                shadow_stack = copy_shadow_stack(old_metadata, new_shadow_stack, shadow_stack_size);
+            }else{
+                // To be optimized, old size can be shrinked ?
+                shadow_stack = mremap(old_shadow_stack,
+                                         shadow_stack_size,
+                                         shadow_stack_size,
+                                         MREMAP_MAYMOVE | MREMAP_FIXED,
+                                         new_shadow_stack);
+            }
             new_metadata->shadow_stack = shadow_stack;
-            new_metadata->shadow_stack_top = shadow_stack + DEF_BUDDY_CALL_STACK_SIZE;
-            arch_prctl(ARCH_SET_GS, new_metadata);
+            new_metadata->shadow_stack_top = shadow_stack + (((char *) old_metadata->shadow_stack_top)
+                                                             - ((char *) old_metadata->shadow_stack));
+            SET_FSGS_METADATA(new_metadata);
 
 //            fprintf(stderr, "tid = %ld, old_shadow_stack = %p, new_stack_stack = %p, shadow_stack = %p\n",
 //                    syscall(SYS_gettid), old_shadow_stack, new_shadow_stack, shadow_stack);
@@ -652,6 +730,10 @@ void fsgs_runtime_rerandomize(void){
 //                    syscall(SYS_gettid), old_metadata, new_metadata);
 
             munmap(old_metadata, REAL_META_DATA_SIZE);
+            if(rerand_copy){
+                spa_retire_shadow_stack(&retired_shadow_stacks, old_shadow_stack, shadow_stack_size,
+                                        unmap_retired_shadow_stack);
+            }
             // sanity check
 
         }else{ // FIXME: it should not get here.
@@ -727,6 +809,9 @@ static int __attribute__((constructor(101))) do_init_main_shadow_stack(void){
 
     pthread_key_create(&thread_cleanup_key, thread_cleanup_handler);
 
+    char *env = getenv(SPA_RERAND_COPY_ENV);
+    rerand_copy = env && atoi(env);
+
     init_main_shadow_stack();
     buddy_init_rt_lib_hooker();
     return 0;
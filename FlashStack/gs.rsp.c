@@ -15,6 +15,7 @@
 #include <pthread.h>
 #include <asm/prctl.h>
 #include <sys/prctl.h>
+#include <sys/auxv.h>
 
 #include <dlfcn.h>
 #include <link.h>
@@ -32,6 +33,8 @@
 
 // fast user-space locking
 #include <linux/futex.h>
+// MPOL_PREFERRED, without libnuma
+#include <linux/mempolicy.h>
 #include <sys/time.h>
 #include <assert.h>
 
@@ -81,25 +84,107 @@ int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
 #define  INIT_SHADOW_STACK_OFFSET           (DEF_BUDDY_CALL_STACK_SIZE)
 //#define  REAL_META_DATA_SIZE      (PAGE_SIZE)
 
-#define  MAX_THREAD_BUF_CNT         1024
-#define  MONITOR_INTERVAL_IN_SECS       30
-// 10 second
-#define  CPU_CYCLES_AFTER_THREAD_EXITING        ((CPU_CYCLES_PER_RANDOMIZATION) * 1000L)
+/*
+    A thread with a call stack of @css bytes only touches the top @css bytes
+    below INIT_SHADOW_STACK_OFFSET, so only this window of the 10MB slot is mapped.
+    The slot itself is still 8MB-aligned to find the metadata with DEF_BUDDY_CALL_STACK_SIZE_MASK.
+ */
+#define  SHADOW_WINDOW_OFFSET(css)          ((INIT_SHADOW_STACK_OFFSET) - (css))
+#define  SHADOW_WINDOW_SIZE(css)            ((REAL_SHADOW_STACK_SIZE) - SHADOW_WINDOW_OFFSET(css))
 
 #define  MAX_GS_BASE_ADDR           (0x7FFFFFFFEFFFL)
 
+// a 10MB slot crosses an 8MB boundary, so the slots in the slab are 16MB apart
+#define  SHADOW_SLAB_SLOT_SIZE      (2 * (DEF_BUDDY_CALL_STACK_SIZE))
+// 1TB of address space, 16 bits of entropy
+#define  SHADOW_SLAB_MAX_SLOTS      (1L << 16)
+
+// the call stacks of threads get 1/16 as many slots, in a region of their own above the slab
+#define  SHADOW_SLAB_STACK_SHARE    16
+
+// the windows kept for reuse
+#define  SHADOW_POOL_SIZE           64
+
+// the windows are 2MB-aligned when backed by transparent huge pages
+#define  SHADOW_HUGE_PAGE_SIZE      (2L << 20)
+
+// the destinations the helper thread keeps ready for each thread (see SPA_RERAND_HELPER_ENV)
+#define  RERAND_QUEUE_SIZE          4
+// how long the helper thread sleeps unless a queue runs dry, in ms
+#define  RERAND_HELPER_INTERVAL_MS  10
+
+// resident shadow pages below the live depth are discarded once they add up to so many bytes
+#define  SHADOW_TRIM_THRESHOLD      (256L << 10)
+
+#ifndef MAP_FIXED_NOREPLACE
+#define  MAP_FIXED_NOREPLACE        0x100000
+#endif
+
+// how the shadow stacks are placed on NUMA nodes
+#define  SHADOW_NUMA_NONE           0
+#define  SHADOW_NUMA_AT_INIT        1
+#define  SHADOW_NUMA_FOLLOW         2
+
+// the start routines whose shadow depth is learned
+#define  SHADOW_PREFAULT_SIZE       1024
+
+// the NUMA nodes in the mask passed to mbind()
+#define  SHADOW_NUMA_MAX_NODES      1024
+
+// in <asm/hwcap2.h>, set by Linux 5.9+ when wrgsbase/rdgsbase are enabled for user space
+#ifndef HWCAP2_FSGSBASE
+#define  HWCAP2_FSGSBASE            (1 << 1)
+#endif
+
 
 struct ArgInfo{
     void *(*start_routine) (void *);
     void *arg;
+    long call_stack_size;
+    long prefault_size;
+    void *stack;                // NULL if the stack is not from get_thread_stack()
+    unsigned long stack_size;
+    void *window;               // the window of an exited thread, taken together with its stack
+    unsigned long window_size;
 };
 
-struct ThreadRegionInfo{
-    long valid;
-    void *shadow_stack;
-    long shadow_stack_size;
-    long expired_time;
+// see spa-stack-depth.c
+struct StackBound{
+    unsigned long offset;
+    long bound;
+    char *module;
+};
+
+/*
+    The deepest the shadow stacks of the threads started at @start_routine have been,
+    so that the shadow pages of later such threads are faulted in at once.
+ */
+struct ShadowPrefault{
+    void *start_routine;
+    long depth;
+};
+
+/*
+    An exiting thread whose shadow stack is still in use until the kernel reports it gone.
+    It is kept in the shadow stack itself, right after the metadata,
+    so there is neither a limit on the number of exiting threads nor a malloc().
+ */
+struct RetiredThread{
+    struct RetiredThread *next;
+    void *window;
+    unsigned long size;
     long tid;
+    void *stack;
+    unsigned long stack_size;
+};
+
+/*
+    The page right above a stack from get_thread_stack().
+    Such a stack holds the struct pthread of its thread until the thread is joined or detached,
+    so it is not reused before.
+ */
+struct ThreadStackInfo{
+    long released;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -124,20 +209,113 @@ static __thread int relaxing_sandbox_during_init = 0;
 long gsrsp_total_rand_cnt = 0;
 //long gsrsp_total_cleaning_cnt = 0;
 long gsrsp_total_fail_rand_cnt = 0;
+// the shadow stacks taken from the pool of exited threads
+long gsrsp_total_reused_cnt = 0;
+// the shadow pages discarded by trim_shadow_stack()
+long gsrsp_total_trimmed_pages = 0;
 long gsrsp_total_cpu_cycles = 0;
 
 long gsrsp_total_attempts[SPA_MAX_MMAP_ATTEMPTS+1];
 
 static __thread long gsrsp_thread_rand_cnt = 0;
 //
-static pthread_t cleaner_tid;
-//
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-//
-static struct ThreadRegionInfo thread_info[MAX_THREAD_BUF_CNT];
+static struct RetiredThread *retired_threads;
 
 static long  gsrsp_total_crash_cnt;
 
+static struct StackBound *stack_bounds;
+static long stack_bounds_cnt;
+
+/*
+    The PROT_NONE region reserved for shadow stacks, and the slots in use.
+    shadow_slab_slots is 0 if there is no such region.
+ */
+static unsigned long shadow_slab_start;
+static long shadow_slab_slots;
+static unsigned long shadow_slab_bitmap[SHADOW_SLAB_MAX_SLOTS / 64];
+static pthread_once_t shadow_slab_once = PTHREAD_ONCE_INIT;
+
+/*
+    The PROT_NONE region reserved for the call stacks of threads, with slots as in the slab.
+    It is at a random address above the slab, so that the shadow stacks are below the call stacks,
+    but a leaked stack address does not tell where the slab is.
+    stack_slab_slots is 0 if there is no such region.
+ */
+static unsigned long stack_slab_start;
+static long stack_slab_slots;
+static unsigned long stack_slab_bitmap[SHADOW_SLAB_MAX_SLOTS / SHADOW_SLAB_STACK_SHARE / 64];
+
+/*
+    The windows of exited threads in the slab, claimed by new threads without locking.
+    At most SHADOW_POOL_SIZE of them are kept, the others are released.
+    A window is kept together with the call stack of its thread if the stack is from the slab.
+ */
+struct ShadowPoolNode{
+    void *window;
+    unsigned long size;
+    struct ShadowPoolNode *next;
+    void *stack;
+    unsigned long stack_size;
+};
+static struct ShadowPoolNode shadow_pool_nodes[SHADOW_POOL_SIZE];
+static unsigned long shadow_pool_used, shadow_pool_free;
+
+// the environment passed to our constructor (see gs_rsp_getenv())
+static char **gs_rsp_envp;
+
+// see SPA_SHADOW_TRIM_KB_ENV, 0 if the shadow pages are never discarded
+static long shadow_trim_threshold = SHADOW_TRIM_THRESHOLD;
+
+// see SPA_SHADOW_HUGEPAGE_ENV, cleared if the kernel has no transparent huge pages
+static int shadow_hugepage;
+
+static struct ShadowPrefault shadow_prefault[SHADOW_PREFAULT_SIZE];
+
+// see SPA_SHADOW_NUMA_ENV
+static int shadow_numa = SHADOW_NUMA_AT_INIT;
+// the highest online NUMA node, 0 if the shadow stacks are not placed
+static long shadow_numa_max_node;
+
+// see SPA_RERAND_COPY_ENV
+static int rerand_copy;
+
+// the windows this thread has left behind
+static __thread struct spa_retired_shadow_stacks retired_windows;
+
+/*
+    The slots prepared for the next rerandomizations of a thread, with their windows mapped
+    (and, for copy_shadow_stack(), the pages it is going to write faulted in).
+    The helper thread is the only producer and the thread itself the only consumer, so no lock is needed.
+    It lives in the TLS of the thread and is on rerand_queues from the first rerandomization
+    until release_shadow_stack().
+ */
+struct RerandQueue{
+    struct RerandQueue *next;
+    long call_stack_size;       // 0 if not on rerand_queues
+    unsigned long rsp;          // the slots are below it, as in get_memory_at_random()
+    long depth;                 // the bytes copied by the last copy_shadow_stack()
+    long numa_node;             // the NUMA node of the thread's shadow stack, -1 if none
+    volatile unsigned long head;
+    volatile unsigned long tail;
+    void *slots[RERAND_QUEUE_SIZE];
+};
+
+// see SPA_RERAND_HELPER_ENV
+static int rerand_helper;
+static int rerand_helper_running;
+// bumped to wake the helper thread up
+static int rerand_helper_futex;
+static struct RerandQueue *rerand_queues;
+static pthread_mutex_t rerand_queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct RerandQueue rerand_queue;
+
+/*
+    1 if wrgsbase can be used instead of arch_prctl(ARCH_SET_GS, ...).
+    Set once by the constructor and only read afterwards, so it is never written while threads run.
+    A shadow stack built by a malloc() before the constructor just uses arch_prctl().
+ */
+static int gs_rsp_has_fsgsbase;
+
 struct gs_rsp_metadata{
     //struct gs_rsp_metadata *buddy;
     void *shadow_stack;     //
@@ -147,10 +325,44 @@ struct gs_rsp_metadata{
     long state;             //
     long diff;
     long relaxing;          // relax the policy of sandbox
-
+    long call_stack_size;   // only SHADOW_WINDOW_SIZE(call_stack_size) bytes are mapped
+    void *start_routine;    // NULL for the main thread
+    long hwm;               // the deepest the shadow stack has been, in bytes below its top
+    long prefault_size;     // the bytes below the top faulted in at start, never trimmed
+    long numa_node;         // the NUMA node preferred for the shadow stack, -1 if none
+    void *stack;            // the call stack from get_thread_stack(), retired together
+    unsigned long stack_size;
 };
+
+/*
+    The metadata of the current thread, updated whenever the shadow stack is moved,
+    so finding it needs neither arch_prctl(ARCH_GET_GS) nor the distance from the initial %rsp.
+    NULL if the shadow stack of this thread is not ready yet (%gs is inherited from the creator).
+ */
+__thread struct gs_rsp_metadata *gs_rsp_cur_metadata __attribute__((tls_model("initial-exec")));
 /////////////////////////////////////////////////////////////////////////////////
-static int init_shadow_stack(void);
+static int init_shadow_stack(long call_stack_size, void *window, unsigned long window_size);
+static void put_shadow_window(void *addr, unsigned long size, int moved);
+static void retire_shadow_window(void *addr, unsigned long size, void *stack, unsigned long stack_size);
+static void push_pool_node(unsigned long *list, struct ShadowPoolNode *node);
+static long find_deepest_shadow_page(struct gs_rsp_metadata *pMetadata, char *window, char *end, long *resident);
+static void learn_shadow_depth(void *start_routine, long depth);
+static void release_retired_windows(unsigned long size);
+static void remove_rerand_queue(void);
+static void start_rerand_helper(void);
+
+static void detect_fsgsbase(void){
+    gs_rsp_has_fsgsbase = (getauxval(AT_HWCAP2) & HWCAP2_FSGSBASE) != 0;
+}
+
+// no kernel entry if the CPU and the kernel (5.9+) both support FSGSBASE
+static inline int set_gs_base(long base){
+    if(gs_rsp_has_fsgsbase){
+        __asm__ __volatile__("wrgsbase %0" : : "r"(base) : "memory");
+        return 0;
+    }
+    return arch_prctl(ARCH_SET_GS, base);
+}
 
 inline struct gs_rsp_metadata * get_gs_rsp_metadata_by_shadow_stack(long shadow_stack){
 
@@ -160,18 +372,9 @@ inline struct gs_rsp_metadata * get_gs_rsp_metadata_by_shadow_stack(long shadow_
 }
 
 
+// called on every hooked libc function, so no system call here
 inline struct gs_rsp_metadata * get_gs_rsp_metadata_by_rsp(){
-    long rsp = SPA_GET_RSP();
-    long gs_base = 0;
-    int r = arch_prctl(ARCH_GET_GS, &gs_base);
-    if(r < 0){
-        return NULL;
-    }
-    long ssp = rsp + gs_base - SPA_USER_SPACE_SIZE;
-    // get the shadow stack
-    long shadow_stack = (ssp & DEF_BUDDY_CALL_STACK_SIZE_MASK);
-
-    return get_gs_rsp_metadata_by_shadow_stack(shadow_stack);
+    return gs_rsp_cur_metadata;
 }
 
 
@@ -181,7 +384,7 @@ void unsw_inc_asm_js_crash_cnt(void){
     fprintf(stderr, "total_crash_cnt = %ld\n", gsrsp_total_crash_cnt);
 }
 
-static int init_metadata_on_shadow_stack(long shadow_stack, long diff){
+static int init_metadata_on_shadow_stack(long shadow_stack, long diff, long call_stack_size){
     struct gs_rsp_metadata * pMetadata = get_gs_rsp_metadata_by_shadow_stack(shadow_stack);
 
     memset(pMetadata, 0, sizeof(struct gs_rsp_metadata));
@@ -191,50 +394,110 @@ static int init_metadata_on_shadow_stack(long shadow_stack, long diff){
     pMetadata->cpu_cycles = 0;
     pMetadata->relaxing = 0;
     pMetadata->diff = diff;
+    pMetadata->call_stack_size = call_stack_size;
+    pMetadata->numa_node = -1;
 
     return 0;
 }
 
-static int add_memory_region(struct ThreadRegionInfo * region_info){
-    pthread_mutex_lock(&mutex);
-    for(int i = 0; i < MAX_THREAD_BUF_CNT; i++){
-        if(!thread_info[i].valid){
-            thread_info[i] = *region_info;
-            thread_info[i].valid = 1;
-            break;
-        }
+/*
+    The last number in /sys/devices/system/node/online, e.g. "0-1".
+    open() and read() rather than fopen(), which might call malloc() before libc is ready.
+ */
+static void detect_numa_nodes(void){
+    char buf[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if(fd < 0){
+        return;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0){
+        return;
+    }
+    buf[n] = 0;
+    char *p = buf + n;
+    while(p > buf && (p[-1] < '0' || p[-1] > '9')){
+        p--;
+    }
+    while(p > buf && p[-1] >= '0' && p[-1] <= '9'){
+        p--;
+    }
+    shadow_numa_max_node = atol(p);
+    if(shadow_numa_max_node >= SHADOW_NUMA_MAX_NODES){
+        shadow_numa_max_node = 0;
     }
-    pthread_mutex_unlock(&mutex);
-    return 0;
 }
 
-static void * release_memory_region(void *arg){
-    // FIXME:  compact the array after releasing entries
+// the NUMA node the thread runs on, -1 if unknown; getcpu() is a vDSO call
+static long get_numa_node(void){
+    unsigned int cpu, node;
+    return getcpu(&cpu, &node) == 0 ? (long) node : -1;
+}
 
-    while(1){
-#if 0
-        fprintf(stderr, "..................   Thread clearner: pid = %d, tid = %ld ...................... \n",
-                               getpid(),  syscall(SYS_gettid));
-#endif
-        pthread_mutex_lock(&mutex);
-        for(int i = 0; i < MAX_THREAD_BUF_CNT; i++){
-            if(thread_info[i].valid &&
-                    (__rdtsc() - thread_info[i].expired_time) > CPU_CYCLES_AFTER_THREAD_EXITING){
-                // unmap the shadow stack
-                munmap(thread_info[i].shadow_stack, thread_info[i].shadow_stack_size);
-                thread_info[i].valid = 0;
-                //__sync_fetch_and_add(&gsrsp_total_cleaning_cnt, 1);
-#if 0
-                fprintf(stderr, "Thread clearner: pid = %d, tid = %ld, shadow_stack = %p: %s, %d \n",
-                            getpid(),
-                            thread_info[i].tid,
-                            thread_info[i].shadow_stack, __FILE__, __LINE__);
-#endif
-            }
+// with @move, the resident pages of the window are moved to @node too
+static int bind_shadow_window(char *window, long size, unsigned long node, int move){
+    unsigned long mask[SHADOW_NUMA_MAX_NODES / 64];
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / 64] = 1UL << (node % 64);
+    return syscall(SYS_mbind, window, size, MPOL_PREFERRED,
+                   mask, SHADOW_NUMA_MAX_NODES + 1, move ? MPOL_MF_MOVE : 0);
+}
+
+/*
+    Prefer the NUMA node the thread runs on for the shadow stack, so that its pages are not
+    first touched on another node by an early migration.
+    The policy is moved together with the window by mremap().
+    With @move, the resident pages are moved too if the thread has moved to another node.
+ */
+static void place_shadow_window(struct gs_rsp_metadata *pMetadata, int move){
+    long node = get_numa_node();
+
+    if(node < 0 || pMetadata->numa_node == node){
+        return;
+    }
+    char *window = ((char *) pMetadata->shadow_stack) + SHADOW_WINDOW_OFFSET(pMetadata->call_stack_size);
+    if(bind_shadow_window(window, SHADOW_WINDOW_SIZE(pMetadata->call_stack_size), node, move) == 0){
+        pMetadata->numa_node = node;
+    }
+}
+
+static void add_retired_thread(struct RetiredThread *rt){
+    struct RetiredThread *old;
+    do{
+        old = *(struct RetiredThread * volatile *) &retired_threads;
+        rt->next = old;
+    }while(!__sync_bool_compare_and_swap(&retired_threads, old, rt));
+}
+
+/*
+    Retire the shadow stacks of the threads that have exited.
+    A thread is gone once tgkill(pid, tid, 0) fails with ESRCH; it runs no more code then,
+    including the destructors and __libc_thread_freeres() after release_shadow_stack().
+    Its stack from get_thread_stack() is also waited for being joined or detached.
+    If its tid has been reused in this process, it is only retired later.
+ */
+static struct ThreadStackInfo *get_thread_stack_info(void *stack, unsigned long stack_size){
+    return (struct ThreadStackInfo *) (((char *) stack) + stack_size);
+}
+
+static void reap_retired_threads(void){
+    if(!retired_threads){
+        return;
+    }
+    // take the whole list, so the threads pushing at the same time cannot cause ABA
+    struct RetiredThread *rt = __sync_lock_test_and_set(&retired_threads, NULL);
+    pid_t pid = getpid();
+    while(rt){
+        struct RetiredThread *next = rt->next;
+        if(syscall(SYS_tgkill, pid, rt->tid, 0) < 0 && errno == ESRCH
+                && (!rt->stack || get_thread_stack_info(rt->stack, rt->stack_size)->released)){
+            retire_shadow_window(rt->window, rt->size, rt->stack, rt->stack_size);
+        }else{
+            add_retired_thread(rt);
         }
-        pthread_mutex_unlock(&mutex);
-        //
-        sleep(MONITOR_INTERVAL_IN_SECS);
+        rt = next;
     }
 }
 
@@ -248,11 +511,367 @@ static void * release_memory_region(void *arg){
 //    relaxing_sandbox_during_init = v;
 //}
 
-static void *get_memory_at_random(unsigned long size, int init){
+/*
+    libgsrsp.so is linked with -z initfirst, so its constructor runs before libc sets environ,
+    when getenv() always returns NULL.
+ */
+static char *gs_rsp_getenv(const char *name){
+    char **envp = environ ? environ : gs_rsp_envp;
+    size_t n = strlen(name);
+    for(; envp && *envp; envp++){
+        if(!strncmp(*envp, name, n) && (*envp)[n] == '='){
+            return *envp + n + 1;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Reserve @slots 8MB-aligned slots at a random address in [@low, @high),
+    with neither memory nor page tables committed. Return 0 if the kernel does not take any of our hints.
+ */
+static unsigned long reserve_slab(unsigned long low, unsigned long high, long slots){
+    unsigned long size = slots * SHADOW_SLAB_SLOT_SIZE;
+    if(slots <= 0 || low + size + DEF_BUDDY_CALL_STACK_SIZE >= high){
+        return 0;
+    }
+    for(int i = 0; i < SPA_MAX_MMAP_ATTEMPTS; i++){
+        unsigned long x = low + SPA_GEN_RANDOM_VAL() % (high - low - size - DEF_BUDDY_CALL_STACK_SIZE);
+        // one more 8MB for the alignment
+        char *p = (char *) mmap((void *) (x & SPA_SHADOW_STACK_8MB_RAND_ADDR_MASK),
+                                size + DEF_BUDDY_CALL_STACK_SIZE, PROT_NONE,
+                                MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        if(p == MAP_FAILED){
+            return 0;
+        }
+        unsigned long start = (((unsigned long) p) + SPA_8MB_MASK) & ~SPA_8MB_MASK;
+        if(start < low || start + size > high){
+            munmap(p, size + DEF_BUDDY_CALL_STACK_SIZE);
+            continue;
+        }
+        if(start > (unsigned long) p){
+            munmap(p, start - (unsigned long) p);
+        }
+        munmap((void *) (start + size), ((unsigned long) p) + DEF_BUDDY_CALL_STACK_SIZE - start);
+        return start;
+    }
+    return 0;
+}
+
+/*
+    Reserve SHADOW_SLAB_MAX_SLOTS (or SPA_SHADOW_SLAB_SLOTS_ENV) slots for shadow stacks
+    below SPA_MAX_SHADOW_STACK_ADDR, and 1/16 as many for call stacks above them.
+    Without the slab, shadow stacks are mmap()-ed one by one as before,
+    and without the stack slab, glibc allocates the call stacks.
+ */
+static void init_shadow_slab(void){
+    long slots = SHADOW_SLAB_MAX_SLOTS;
+    char *env = gs_rsp_getenv(SPA_SHADOW_SLAB_SLOTS_ENV);
+    if(env){
+        slots = atol(env);
+        if(slots > SHADOW_SLAB_MAX_SLOTS){
+            slots = SHADOW_SLAB_MAX_SLOTS;
+        }
+    }
+    unsigned long start = reserve_slab(0, SPA_MAX_SHADOW_STACK_ADDR, slots);
+    if(!start){
+        return;
+    }
+    shadow_slab_start = start;
+    shadow_slab_slots = slots;
+    for(int k = SHADOW_POOL_SIZE - 1; k >= 0; k--){
+        push_pool_node(&shadow_pool_free, &shadow_pool_nodes[k]);
+    }
+
+    long stack_slots = slots / SHADOW_SLAB_STACK_SHARE;
+    start = reserve_slab(start + slots * SHADOW_SLAB_SLOT_SIZE, SPA_MAX_SHADOW_STACK_ADDR, stack_slots);
+    if(start){
+        stack_slab_start = start;
+        stack_slab_slots = stack_slots;
+    }
+}
+
+// a random free slot of the @slots ones from @start, 0 if there is none
+static unsigned long claim_slot_in(unsigned long *bitmap, unsigned long start, long slots){
+    if(slots <= 0){
+        return 0;
+    }
+    long words = (slots + 63) / 64;
+    unsigned long r = SPA_GEN_RANDOM_VAL();
+    long w = (r >> 6) % words;
+    for(long i = 0; i <= words; i++, w = (w + 1) % words){
+        unsigned long used = bitmap[w];
+        long n = slots - w * 64;
+        unsigned long valid = n >= 64 ? ~0UL : (1UL << n) - 1;
+        unsigned long free_bits = ~used & valid;
+        if(!free_bits){
+            continue;
+        }
+        // the first free slot after a random one in this word
+        int b = r & 63;
+        unsigned long rotated = (free_bits >> b) | (b ? free_bits << (64 - b) : 0);
+        b = (b + __builtin_ctzl(rotated)) & 63;
+        unsigned long bit = 1UL << b;
+        if(__sync_fetch_and_or(&bitmap[w], bit) & bit){
+            // taken by another thread
+            i--;
+            continue;
+        }
+        return start + (w * 64 + b) * SHADOW_SLAB_SLOT_SIZE;
+    }
+    return 0;
+}
+
+// a random free slot in the slab below @adjusted_rsp, 0 if there is none
+static unsigned long claim_slab_slot(unsigned long adjusted_rsp){
+    pthread_once(&shadow_slab_once, init_shadow_slab);
+    if(!shadow_slab_slots || adjusted_rsp <= shadow_slab_start){
+        return 0;
+    }
+    long slots = (adjusted_rsp - shadow_slab_start) / SHADOW_SLAB_SLOT_SIZE + 1;
+    if(slots > shadow_slab_slots){
+        slots = shadow_slab_slots;
+    }
+    return claim_slot_in(shadow_slab_bitmap, shadow_slab_start, slots);
+}
+
+// @addr is anywhere in the slot
+static void unclaim_slot(unsigned long *bitmap, unsigned long start, unsigned long addr){
+    long k = (addr - start) / SHADOW_SLAB_SLOT_SIZE;
+    __sync_fetch_and_and(&bitmap[k / 64], ~(1UL << (k % 64)));
+}
+static void unclaim_slab_slot(unsigned long slot){
+    unclaim_slot(shadow_slab_bitmap, shadow_slab_start, slot);
+}
+
+static int in_shadow_slab(void *addr){
+    unsigned long a = (unsigned long) addr;
+    return shadow_slab_slots && a >= shadow_slab_start
+            && a < shadow_slab_start + shadow_slab_slots * SHADOW_SLAB_SLOT_SIZE;
+}
+static int in_stack_slots(void *addr){
+    unsigned long a = (unsigned long) addr;
+    return stack_slab_slots && a >= stack_slab_start
+            && a < stack_slab_start + stack_slab_slots * SHADOW_SLAB_SLOT_SIZE;
+}
+// the start of the slot of @addr in the stack slab
+static unsigned long get_stack_slot(void *addr){
+    return stack_slab_start + (((unsigned long) addr) - stack_slab_start) / SHADOW_SLAB_SLOT_SIZE * SHADOW_SLAB_SLOT_SIZE;
+}
+
+/*
+    A call stack of @size bytes at the top of a slot of the stack slab, with its ThreadStackInfo right above it.
+    The rest of the slot stays PROT_NONE as its guard, so there is no mprotect() as in glibc.
+ */
+static void *get_stack_from_slab(unsigned long size){
+    pthread_once(&shadow_slab_once, init_shadow_slab);
+    // at least 8MB of guard below it
+    if(size > DEF_BUDDY_CALL_STACK_SIZE){
+        return NULL;
+    }
+    unsigned long slot = claim_slot_in(stack_slab_bitmap, stack_slab_start, stack_slab_slots);
+    if(!slot){
+        return NULL;
+    }
+    char *stack = (char *) (slot + SHADOW_SLAB_SLOT_SIZE - PAGE_SIZE - size);
+    void *addr = mmap(stack, size + PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_STACK, -1, 0);
+    if(addr == MAP_FAILED){
+        unclaim_slot(stack_slab_bitmap, stack_slab_start, slot);
+        return NULL;
+    }
+    return stack;
+}
+static void put_thread_stack(void *stack, unsigned long size){
+    void *p = mmap(stack, size + PAGE_SIZE, PROT_NONE,
+                   MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if(p == stack){
+        unclaim_slot(stack_slab_bitmap, stack_slab_start, (unsigned long) stack);
+    }
+}
+
+// called once @thread has been joined or detached
+static void release_thread_stack(pthread_t thread){
+    if(in_stack_slots((void *) thread)){
+        // the struct pthread is at the top of the stack, in the same slot
+        struct ThreadStackInfo *info = (struct ThreadStackInfo *)
+                (get_stack_slot((void *) thread) + SHADOW_SLAB_SLOT_SIZE - PAGE_SIZE);
+        __sync_lock_test_and_set(&info->released, 1);
+        // a joined thread is gone already
+        reap_retired_threads();
+    }
+}
+
+/*
+    Commit @size bytes at @offset of a random free slot in the slab, below @adjusted_rsp.
+    The slot is claimed in the bitmap first, so only one mmap() is needed.
+ */
+static void *get_memory_from_slab(unsigned long offset, unsigned long size, unsigned long adjusted_rsp){
+    unsigned long slot = claim_slab_slot(adjusted_rsp);
+    if(!slot){
+        return MAP_FAILED;
+    }
+    void *addr = mmap((void *) (slot + offset), size, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+    if(addr == MAP_FAILED){
+        unclaim_slab_slot(slot);
+        return MAP_FAILED;
+    }
+    return (void *) slot;
+}
+
+/*
+    Release the shadow stack window [@addr, @addr + @size).
+    A window in the slab is reserved again with PROT_NONE, then its slot is free.
+    If it has been moved away by mremap(), the hole might have been taken by others
+    in the meantime, so it is only reserved if still free (MAP_FIXED_NOREPLACE, Linux 4.17+);
+    otherwise the slot is never used again.
+ */
+static void put_shadow_window(void *addr, unsigned long size, int moved){
+    if(!in_shadow_slab(addr)){
+        if(!moved){
+            munmap(addr, size);
+        }
+        return;
+    }
+    int flags = MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | (moved ? MAP_FIXED_NOREPLACE : MAP_FIXED);
+    void *p = mmap(addr, size, PROT_NONE, flags, -1, 0);
+    if(p != addr){
+        if(p != MAP_FAILED){
+            // MAP_FIXED_NOREPLACE is only a hint before Linux 4.17
+            munmap(p, size);
+        }
+        return;
+    }
+    unclaim_slab_slot((unsigned long) addr);
+}
+
+// lists of shadow_pool_nodes[], (tag << 32) | (index + 1), the tag is against ABA
+static unsigned long shadow_pool_list(struct ShadowPoolNode *node, unsigned long old){
+    return (((old >> 32) + 1) << 32) | (node ? (unsigned long) (node - shadow_pool_nodes) + 1 : 0);
+}
+
+static struct ShadowPoolNode *pop_pool_node(unsigned long *list){
+    unsigned long old, idx;
+    do{
+        old = *(volatile unsigned long *) list;
+        idx = old & 0xFFFFFFFFUL;
+        if(!idx){
+            return NULL;
+        }
+    }while(!__sync_bool_compare_and_swap(list, old,
+                    shadow_pool_list(shadow_pool_nodes[idx - 1].next, old)));
+    return &shadow_pool_nodes[idx - 1];
+}
+
+static void push_pool_node(unsigned long *list, struct ShadowPoolNode *node){
+    unsigned long old, idx;
+    do{
+        old = *(volatile unsigned long *) list;
+        idx = old & 0xFFFFFFFFUL;
+        node->next = idx ? &shadow_pool_nodes[idx - 1] : NULL;
+    }while(!__sync_bool_compare_and_swap(list, old, shadow_pool_list(node, old)));
+}
+
+/*
+    Keep the window of an exited thread in the pool for the next thread,
+    or release it if the pool is full (or it is not in the slab).
+ */
+static void retire_shadow_window(void *addr, unsigned long size, void *stack, unsigned long stack_size){
+    struct ShadowPoolNode *node = in_shadow_slab(addr) ? pop_pool_node(&shadow_pool_free) : NULL;
+    if(!node){
+        put_shadow_window(addr, size, 0);
+        if(stack){
+            put_thread_stack(stack, stack_size);
+        }
+        return;
+    }
+    node->window = addr;
+    node->size = size;
+    node->stack = stack;
+    node->stack_size = stack_size;
+    push_pool_node(&shadow_pool_used, node);
+}
+
+/*
+    The call stack of a new thread, taken from the pool together with the window of an exited thread,
+    which do_init_shadow_stack() then moves to a random slot.
+    *window is NULL if the pool is empty.
+ */
+static void *get_thread_stack(unsigned long size, void **window, unsigned long *window_size){
+    void *stack = NULL;
+    struct ShadowPoolNode *node = pop_pool_node(&shadow_pool_used);
+
+    *window = NULL;
+    if(node){
+        *window = node->window;
+        *window_size = node->size;
+        stack = node->stack;
+        unsigned long stack_size = node->stack_size;
+        push_pool_node(&shadow_pool_free, node);
+        if(stack && stack_size != size){
+            put_thread_stack(stack, stack_size);
+            stack = NULL;
+        }
+    }
+    if(!stack){
+        stack = get_stack_from_slab(size);
+    }
+    return stack;
+}
+
+/*
+    Move a retired window to a new random slot, as a shadow stack of @size bytes at @offset.
+    Its pages are discarded first, so it is as clean as a fresh mapping.
+ */
+static void *move_shadow_window(void *window, unsigned long window_size, unsigned long offset, unsigned long size){
+    unsigned long slot = claim_slab_slot(SPA_GET_RSP() - 2 * REAL_SHADOW_STACK_SIZE);
+    if(!slot){
+        put_shadow_window(window, window_size, 0);
+        return MAP_FAILED;
+    }
+    madvise(window, window_size, MADV_DONTNEED);
+    void *addr = mremap(window, window_size, size, MREMAP_MAYMOVE | MREMAP_FIXED, (void *) (slot + offset));
+    if(addr == MAP_FAILED){
+        unclaim_slab_slot(slot);
+        put_shadow_window(window, window_size, 0);
+        return MAP_FAILED;
+    }
+    put_shadow_window(window, window_size, 1);
+    __sync_fetch_and_add(&gsrsp_total_reused_cnt, 1);
+    return (void *) slot;
+}
+static void *get_memory_from_pool(unsigned long offset, unsigned long size){
+    struct ShadowPoolNode *node = pop_pool_node(&shadow_pool_used);
+    if(!node){
+        return MAP_FAILED;
+    }
+    void *window = node->window;
+    unsigned long window_size = node->size;
+    void *stack = node->stack;
+    unsigned long stack_size = node->stack_size;
+    push_pool_node(&shadow_pool_free, node);
+
+    // this thread has a stack already
+    if(stack){
+        put_thread_stack(stack, stack_size);
+    }
+    return move_shadow_window(window, window_size, offset, size);
+}
+
+// map @size bytes at @offset of a random 8MB-aligned slot well below @rsp, return the slot
+static void *get_memory_below(unsigned long offset, unsigned long size, int init, unsigned long rsp){
     void *addr =  MAP_FAILED;
     long i = 0;
-    unsigned long rsp = SPA_GET_RSP();
     unsigned long adjusted_rsp = rsp - 2 * REAL_SHADOW_STACK_SIZE;
+
+    addr = get_memory_from_slab(offset, size, adjusted_rsp);
+    if(addr != MAP_FAILED){
+        if(!init){
+            __sync_fetch_and_add(&gsrsp_total_attempts[1], 1);
+        }
+        return addr;
+    }
     while( MAP_FAILED == addr ){
       unsigned long x = SPA_GEN_RANDOM_VAL();     
       // below 0x7f0000000000
@@ -268,17 +887,19 @@ static void *get_memory_at_random(unsigned long size, int init){
         //x = 0;
           break;
       }
-      addr = mmap( (void *) x, size,
+      addr = mmap( (void *) (x + offset), size,
                             PROT_READ | PROT_WRITE,
                             MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 
       if(addr != MAP_FAILED){
-          unsigned long allocated = (unsigned long) addr;
+          unsigned long allocated = ((unsigned long) addr) - offset;
           // If not 8MB-aligned or larger than adjusted_rsp
           if((allocated & SPA_8MB_MASK) || (allocated > adjusted_rsp)){
               munmap(addr, size);
               addr = MAP_FAILED;
               //continue;
+          }else{
+              addr = (void *) allocated;
           }
       }
       i++;
@@ -299,6 +920,10 @@ static void *get_memory_at_random(unsigned long size, int init){
     return addr;
 }
 
+static void *get_memory_at_random(unsigned long offset, unsigned long size, int init){
+    return get_memory_below(offset, size, init, SPA_GET_RSP());
+}
+
 static inline int set_call_stack_info(struct gs_rsp_metadata * pMetadata){
     // Now pMetadata is ready
     pMetadata->state = FLASH_STACK_INITED;
@@ -306,22 +931,43 @@ static inline int set_call_stack_info(struct gs_rsp_metadata * pMetadata){
 }
 
 
-static int do_init_shadow_stack(void){
+static void advise_shadow_window(char *window, long size){
+    if(shadow_hugepage && madvise(window, size, MADV_HUGEPAGE) != 0){
+        shadow_hugepage = 0;
+    }
+}
+
+static int do_init_shadow_stack(long call_stack_size, void *window, unsigned long window_size){
     long rsp = (long) SPA_GET_RSP();
     if(rsp < 0x7F0000000000L){
 //        fprintf(stderr, "pid = %d, tid = %ld, rsp = 0x%lx < 0x7F0000000000L:  %s, %d\n",
 //                getpid(), syscall(SYS_gettid), rsp, __FILE__, __LINE__);
     }
     //assert(rsp > SPA_MAX_SHADOW_STACK_ADDR && "rsp > SPA_MAX_SHADOW_STACK_ADDR");
-    long * shadow_stack = MAP_FAILED;
+    if(shadow_hugepage){
+        // the slot is 8MB-aligned, so the window is 2MB-aligned, also after rerandomization
+        call_stack_size = (call_stack_size + SHADOW_HUGE_PAGE_SIZE - 1) & ~(SHADOW_HUGE_PAGE_SIZE - 1);
+    }
+    long * shadow_stack;
+    if(window){
+        shadow_stack = (long *) move_shadow_window(window, window_size, SHADOW_WINDOW_OFFSET(call_stack_size),
+                                                   SHADOW_WINDOW_SIZE(call_stack_size));
+    }else{
+        shadow_stack = (long *) get_memory_from_pool(SHADOW_WINDOW_OFFSET(call_stack_size),
+                                                     SHADOW_WINDOW_SIZE(call_stack_size));
+    }
 
     while(shadow_stack == MAP_FAILED){ // Do it until it succeeds
-        shadow_stack = (long *) get_memory_at_random(REAL_SHADOW_STACK_SIZE, 1);
+        shadow_stack = (long *) get_memory_at_random(SHADOW_WINDOW_OFFSET(call_stack_size),
+                                                     SHADOW_WINDOW_SIZE(call_stack_size), 1);
 //        if(shadow_stack == MAP_FAILED){
 //            fprintf(stderr, "tid = %ld, get_memory_at_random():  %s, %d\n",
 //                    syscall(SYS_gettid), __FILE__, __LINE__);
 //        }
     }
+    // mremap() keeps the advice when the window is moved
+    advise_shadow_window(((char *) shadow_stack) + SHADOW_WINDOW_OFFSET(call_stack_size),
+                         SHADOW_WINDOW_SIZE(call_stack_size));
 
 
     // malloc() might be called be pthread_getattr_np()
@@ -329,15 +975,19 @@ static int do_init_shadow_stack(void){
     long diff = ((long) shadow_stack) + INIT_SHADOW_STACK_OFFSET + SPA_USER_SPACE_SIZE - rsp;
 
     // init double metadata
-    init_metadata_on_shadow_stack((long) shadow_stack, diff);
+    init_metadata_on_shadow_stack((long) shadow_stack, diff, call_stack_size);
 
     //relaxing_sandbox_during_init = 1;
-    arch_prctl(ARCH_SET_GS, diff);
+    set_gs_base(diff);
     //relaxing_sandbox_during_init = 0;
 
     // now we can set the top of the call stack
     struct gs_rsp_metadata * metadata = get_gs_rsp_metadata_by_shadow_stack((long) shadow_stack);
+    if(shadow_numa != SHADOW_NUMA_NONE && shadow_numa_max_node > 0){
+        place_shadow_window(metadata, 0);
+    }
     set_call_stack_info(metadata);
+    gs_rsp_cur_metadata = metadata;
 
     return 0;
 }
@@ -345,13 +995,13 @@ static int do_init_shadow_stack(void){
 
 // we call it in customized malloc().
 // so no call malloc() here to make sure the register gs is ready before real work of malloc().
-static int init_shadow_stack(void){
+static int init_shadow_stack(long call_stack_size, void *window, unsigned long window_size){
     if(gs_rsp_flash_stack_inited){
         return 0;
     }
     // FIXME
     gs_rsp_flash_stack_inited = 1;
-    do_init_shadow_stack();
+    do_init_shadow_stack(call_stack_size, window, window_size);
     //gs_rsp_flash_stack_inited = 1;
     return 0;
 }
@@ -368,17 +1018,29 @@ static int release_shadow_stack(void){
         return -1;
     }
     void *shadow_stack = pMetadata->shadow_stack;
+    long call_stack_size = pMetadata->call_stack_size;
+
+    // no more rerandomization, which would move the shadow stack with the list node in it
+    pMetadata->state = FLASH_STACK_RELEASED;
+    release_retired_windows(SHADOW_WINDOW_SIZE(call_stack_size));
+    remove_rerand_queue();
+
+    if(pMetadata->start_routine){
+        long resident;
+        find_deepest_shadow_page(pMetadata, ((char *) shadow_stack) + SHADOW_WINDOW_OFFSET(call_stack_size),
+                                 ((char *) shadow_stack) + INIT_SHADOW_STACK_OFFSET, &resident);
+        learn_shadow_depth(pMetadata->start_routine, pMetadata->hwm);
+    }
 
-    //
-    struct ThreadRegionInfo region_info;
-    memset(&region_info, 0, sizeof(region_info));
-    region_info.valid = 0;
-    region_info.expired_time = __rdtsc();
-    region_info.shadow_stack = shadow_stack;
-    region_info.shadow_stack_size = REAL_SHADOW_STACK_SIZE;
-    region_info.tid = syscall(SYS_gettid);
+    struct RetiredThread *rt = (struct RetiredThread *) (pMetadata + 1);
+    rt->window = ((char *) shadow_stack) + SHADOW_WINDOW_OFFSET(call_stack_size);
+    rt->size = SHADOW_WINDOW_SIZE(call_stack_size);
+    rt->tid = syscall(SYS_gettid);
+    rt->stack = pMetadata->stack;
+    rt->stack_size = pMetadata->stack_size;
 
-    add_memory_region(&region_info);
+    reap_retired_threads();
+    add_retired_thread(rt);
 
 //    fprintf(stderr, "..................   release_shadow_stack(): pid = %d, tid = %ld ...................... \n",
 //                               getpid(),  syscall(SYS_gettid));
@@ -387,14 +1049,157 @@ static int release_shadow_stack(void){
     return 0;
 }
 
-static void * do_start_routine(void *arg){
-    // now we are in the new thread context.
-    init_shadow_stack();
+static struct ShadowPrefault *find_shadow_prefault(void *start_routine, int add){
+    unsigned long h = (((unsigned long) start_routine) >> 4) % SHADOW_PREFAULT_SIZE;
+    for(long i = 0; i < SHADOW_PREFAULT_SIZE; i++){
+        struct ShadowPrefault *sp = &shadow_prefault[(h + i) % SHADOW_PREFAULT_SIZE];
+        void *key = *(void * volatile *) &sp->start_routine;
+        if(key == NULL){
+            if(!add){
+                return NULL;
+            }
+            key = __sync_val_compare_and_swap(&sp->start_routine, NULL, start_routine);
+            if(key == NULL){
+                return sp;
+            }
+        }
+        if(key == start_routine){
+            return sp;
+        }
+    }
+    return NULL;
+}
+
+static void learn_shadow_depth(void *start_routine, long depth){
+    struct ShadowPrefault *sp = find_shadow_prefault(start_routine, 1);
+    if(!sp){
+        return;
+    }
+    long old = sp->depth;
+    while(depth > old){
+        long cur = __sync_val_compare_and_swap(&sp->depth, old, depth);
+        if(cur == old){
+            break;
+        }
+        old = cur;
+    }
+}
+
+static long get_shadow_depth(void *start_routine){
+    struct ShadowPrefault *sp = find_shadow_prefault(start_routine, 0);
+    return sp ? sp->depth : 0;
+}
+
+/*
+    Fault in the top @size bytes of the shadow stack, which hold no data yet but the frames of this function.
+    Without MADV_POPULATE_WRITE, each page is touched by adding 0 to it.
+ */
+static void prefault_shadow_stack(struct gs_rsp_metadata *pMetadata, long size){
+    if(size > pMetadata->call_stack_size){
+        size = pMetadata->call_stack_size;
+    }
+    char *top = ((char *) pMetadata->shadow_stack) + INIT_SHADOW_STACK_OFFSET;
+    if(madvise(top - size, size, MADV_POPULATE_WRITE) != 0){
+        for(char *p = top - size; p < top; p += PAGE_SIZE){
+            __sync_fetch_and_add((long *) p, 0);
+        }
+    }
+    pMetadata->prefault_size = size;
+}
+
+struct ModuleBase{
+    const char *module;
+    unsigned long base;
+};
+
+static const char *get_module_name(const char *path){
+    const char *module = strrchr(path, '/');
+    return module ? module + 1 : path;
+}
+
+static int find_module_base(struct dl_phdr_info *info, size_t size, void *data){
+    (void) size;
+    struct ModuleBase *mb = (struct ModuleBase *) data;
+    // the main program has no name here, while dladdr() reports argv[0]
+    const char *path = info->dlpi_name && info->dlpi_name[0] ? info->dlpi_name : program_invocation_name;
+    if(!strcmp(get_module_name(path), mb->module)){
+        mb->base = info->dlpi_addr;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Load the depths learned by earlier runs, one "<module> <offset> <depth>" per line.
+    The start routines in modules not loaded yet are dropped.
+ */
+static void load_shadow_prefault(void){
+    char *path = getenv(SPA_SHADOW_PREFAULT_PATH_ENV);
+    if(!path){
+        return;
+    }
+    FILE *f = fopen(path, "r");
+    if(!f){
+        return;
+    }
+    char *line = NULL;
+    size_t n = 0;
+    char module[PATH_MAX];
+    unsigned long offset;
+    long depth;
+    while(getline(&line, &n, f) > 0){
+        if(sscanf(line, "%4095s %lx %ld", module, &offset, &depth) != 3){
+            continue;
+        }
+        struct ModuleBase mb = {module, 0};
+        if(dl_iterate_phdr(find_module_base, &mb)){
+            learn_shadow_depth((void *) (mb.base + offset), depth);
+        }
+    }
+    free(line);
+    fclose(f);
+}
 
+static void __attribute__((destructor)) save_shadow_prefault(void){
+    char *path = getenv(SPA_SHADOW_PREFAULT_PATH_ENV);
+    if(!path){
+        return;
+    }
+    FILE *f = fopen(path, "w");
+    if(!f){
+        fprintf(stderr, "Unable to open %s\n", path);
+        return;
+    }
+    for(long i = 0; i < SHADOW_PREFAULT_SIZE; i++){
+        struct ShadowPrefault *sp = &shadow_prefault[i];
+        Dl_info info;
+        struct link_map *lm = NULL;
+        if(!sp->start_routine || !sp->depth
+                || !dladdr1(sp->start_routine, &info, (void **) &lm, RTLD_DL_LINKMAP) || !lm || !info.dli_fname){
+            continue;
+        }
+        fprintf(f, "%s %lx %ld\n", get_module_name(info.dli_fname),
+                ((unsigned long) sp->start_routine) - lm->l_addr, sp->depth);
+    }
+    fclose(f);
+}
+
+static void * do_start_routine(void *arg){
     // copy to local variables, then release the heap object
     struct ArgInfo * pArg = (struct ArgInfo *)arg;
     struct ArgInfo argInfo = *pArg;
 
+    // now we are in the new thread context.
+    init_shadow_stack(argInfo.call_stack_size, argInfo.window, argInfo.window_size);
+    if(gs_rsp_cur_metadata){
+        gs_rsp_cur_metadata->start_routine = (void *) argInfo.start_routine;
+        gs_rsp_cur_metadata->stack = argInfo.stack;
+        gs_rsp_cur_metadata->stack_size = argInfo.stack_size;
+        if(argInfo.prefault_size){
+            prefault_shadow_stack(gs_rsp_cur_metadata, argInfo.prefault_size);
+        }
+    }
+
     free(pArg);
 
     pthread_setspecific(thread_cleanup_key, (void*) 1);
@@ -415,20 +1220,153 @@ static void * do_start_routine(void *arg){
     #2  0x00007ffff79b8700 in start_thread (arg=0x7ffff57ff700) at pthread_create.c:476
     #3  0x00007ffff6b9e71f in clone () at ../sysdeps/unix/sysv/linux/x86_64/clone.S:95
  */
+static int cmp_stack_bound(const void *a, const void *b){
+    const struct StackBound *x = (const struct StackBound *) a;
+    const struct StackBound *y = (const struct StackBound *) b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// load the output of spa-stack-depth, one "<module> <offset> <bound> <function>" per line
+static void load_stack_bounds(void){
+    char *path = getenv(SPA_STACK_BOUNDS_PATH_ENV);
+    if(!path){
+        return;
+    }
+    FILE *f = fopen(path, "r");
+    if(!f){
+        fprintf(stderr, "Unable to open %s\n", path);
+        return;
+    }
+    long cap = 0;
+    char *line = NULL;
+    size_t n = 0;
+    char module[PATH_MAX];
+    struct StackBound sb;
+    while(getline(&line, &n, f) > 0){
+        if(sscanf(line, "%4095s %lx %ld", module, &sb.offset, &sb.bound) != 3){
+            continue;
+        }
+        if(stack_bounds_cnt == cap){
+            cap = cap ? 2 * cap : 1024;
+            stack_bounds = (struct StackBound *) realloc(stack_bounds, cap * sizeof(struct StackBound));
+            if(!stack_bounds){
+                stack_bounds_cnt = 0;
+                break;
+            }
+        }
+        sb.module = strdup(module);
+        stack_bounds[stack_bounds_cnt++] = sb;
+    }
+    free(line);
+    fclose(f);
+    qsort(stack_bounds, stack_bounds_cnt, sizeof(struct StackBound), cmp_stack_bound);
+}
+
+// the size of the call stack needed by @start_routine, 0 if unknown or unbounded
+static long get_call_stack_size(void *(*start_routine) (void *)){
+    Dl_info info;
+    struct link_map *lm = NULL;
+    if(!stack_bounds_cnt || !dladdr1((void *) start_routine, &info, (void **) &lm, RTLD_DL_LINKMAP)
+            || !lm || !info.dli_fname){
+        return 0;
+    }
+    const char *module = strrchr(info.dli_fname, '/');
+    module = module ? module + 1 : info.dli_fname;
+
+    struct StackBound key;
+    key.offset = ((unsigned long) start_routine) - lm->l_addr;
+    struct StackBound *sb = (struct StackBound *) bsearch(&key, stack_bounds, stack_bounds_cnt,
+                                                          sizeof(struct StackBound), cmp_stack_bound);
+    if(!sb){
+        return 0;
+    }
+    while(sb > stack_bounds && sb[-1].offset == key.offset){
+        sb--;
+    }
+    for(; sb < stack_bounds + stack_bounds_cnt && sb->offset == key.offset; sb++){
+        if(!strcmp(sb->module, module)){
+            long size = (sb->bound + SPA_STACK_DEPTH_SLACK + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+            if(size < PTHREAD_STACK_MIN){
+                size = PTHREAD_STACK_MIN;
+            }
+            return size < DEF_BUDDY_CALL_STACK_SIZE ? size : 0;
+        }
+    }
+    return 0;
+}
+
 typedef int (* PTHREAD_CREATE_FUNC)(pthread_t *thread, const pthread_attr_t *attr,
                           void *(*start_routine) (void *), void *arg);
+typedef int (* PTHREAD_JOIN_FUNC)(pthread_t thread, void **retval);
+typedef int (* PTHREAD_TIMEDJOIN_FUNC)(pthread_t thread, void **retval, const struct timespec *abstime);
+typedef int (* PTHREAD_DETACH_FUNC)(pthread_t thread);
+typedef int (* PTHREAD_GETATTR_NP_FUNC)(pthread_t thread, pthread_attr_t *attr);
+
+#if defined(SPA_STATIC_RT)
+/*
+    libgsrsp.a is linked with -Wl,--wrap=pthread_create,
+    so the calls to pthread_create() are bound to __wrap_pthread_create() by the linker,
+    and the one in libc is __real_pthread_create().
+ */
+int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                          void *(*start_routine) (void *), void *arg);
+int __real_pthread_join(pthread_t thread, void **retval);
+int __real_pthread_tryjoin_np(pthread_t thread, void **retval);
+int __real_pthread_timedjoin_np(pthread_t thread, void **retval, const struct timespec *abstime);
+int __real_pthread_detach(pthread_t thread);
+int __real_pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
+#define  _pthread_create   __real_pthread_create
+#define  _pthread_join   __real_pthread_join
+#define  _pthread_tryjoin_np   __real_pthread_tryjoin_np
+#define  _pthread_timedjoin_np   __real_pthread_timedjoin_np
+#define  _pthread_detach   __real_pthread_detach
+#define  _pthread_getattr_np   __real_pthread_getattr_np
+#define  SPA_PTHREAD_CREATE   __wrap_pthread_create
+#define  SPA_PTHREAD_JOIN   __wrap_pthread_join
+#define  SPA_PTHREAD_TRYJOIN_NP   __wrap_pthread_tryjoin_np
+#define  SPA_PTHREAD_TIMEDJOIN_NP   __wrap_pthread_timedjoin_np
+#define  SPA_PTHREAD_DETACH   __wrap_pthread_detach
+#define  SPA_PTHREAD_GETATTR_NP   __wrap_pthread_getattr_np
+#else
 static PTHREAD_CREATE_FUNC _pthread_create;
+static PTHREAD_JOIN_FUNC _pthread_join;
+static PTHREAD_JOIN_FUNC _pthread_tryjoin_np;
+static PTHREAD_TIMEDJOIN_FUNC _pthread_timedjoin_np;
+static PTHREAD_DETACH_FUNC _pthread_detach;
+static PTHREAD_GETATTR_NP_FUNC _pthread_getattr_np;
+#define  SPA_PTHREAD_CREATE   pthread_create
+#define  SPA_PTHREAD_JOIN   pthread_join
+#define  SPA_PTHREAD_TRYJOIN_NP   pthread_tryjoin_np
+#define  SPA_PTHREAD_TIMEDJOIN_NP   pthread_timedjoin_np
+#define  SPA_PTHREAD_DETACH   pthread_detach
+#define  SPA_PTHREAD_GETATTR_NP   pthread_getattr_np
+#endif
 
-int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+static pthread_once_t first_thread_once = PTHREAD_ONCE_INIT;
+
+static void init_first_thread(void){
+#if !defined(SPA_STATIC_RT)
+    _pthread_create = (PTHREAD_CREATE_FUNC) dlsym(RTLD_NEXT, "pthread_create");
+    _pthread_join = (PTHREAD_JOIN_FUNC) dlsym(RTLD_NEXT, "pthread_join");
+    _pthread_tryjoin_np = (PTHREAD_JOIN_FUNC) dlsym(RTLD_NEXT, "pthread_tryjoin_np");
+    _pthread_timedjoin_np = (PTHREAD_TIMEDJOIN_FUNC) dlsym(RTLD_NEXT, "pthread_timedjoin_np");
+    _pthread_detach = (PTHREAD_DETACH_FUNC) dlsym(RTLD_NEXT, "pthread_detach");
+    _pthread_getattr_np = (PTHREAD_GETATTR_NP_FUNC) dlsym(RTLD_NEXT, "pthread_getattr_np");
+#endif
+    load_stack_bounds();
+    load_shadow_prefault();
+    if(rerand_helper){
+        start_rerand_helper();
+    }
+}
+
+int SPA_PTHREAD_CREATE(pthread_t *thread, const pthread_attr_t *attr,
                           void *(*start_routine) (void *), void *arg){
     size_t stacksize = 0;
-    // FIXME: race condition
-    if(!_pthread_create){
-        _pthread_create = (PTHREAD_CREATE_FUNC) dlsym(RTLD_NEXT, "pthread_create");
 
-        // create a thread for
-        _pthread_create(&cleaner_tid, NULL, release_memory_region, NULL);
-    }
+    pthread_once(&first_thread_once, init_first_thread);
+    reap_retired_threads();
+
     pthread_attr_t threadAttr;
     if(pthread_attr_init(&threadAttr) == -1){
         fprintf(stderr, "error in pthread_attr_init()\n");
@@ -437,17 +1375,130 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
     stacksize = DEF_BUDDY_CALL_STACK_SIZE;
 
     if(!attr){
+        // no stack size is requested by the caller, so the static bound is used if there is one.
+        long size = get_call_stack_size(start_routine);
+        if(size){
+            stacksize = size;
+        }
+        if(pthread_attr_setstacksize(&threadAttr, stacksize) != 0){
+            fprintf(stderr, "error in pthread_attr_setstacksize()\n");
+        }
         attr = &threadAttr;
-    }
-    if(pthread_attr_setstacksize(( pthread_attr_t *)attr, stacksize) != 0){
-        fprintf(stderr, "error in pthread_attr_setstacksize()\n");
+    }else{
+        // the size requested by the caller is kept if the shadow stack can cover it,
+        // otherwise a copy is changed, as the caller's attr might be used for other threads.
+        pthread_attr_getstacksize(attr, &stacksize);
+        if(stacksize > DEF_BUDDY_CALL_STACK_SIZE){
+            if(spa_copy_thread_attr(&threadAttr, attr) == 0
+                    && pthread_attr_setstacksize(&threadAttr, DEF_BUDDY_CALL_STACK_SIZE) == 0){
+                attr = &threadAttr;
+            }
+            // its own stack is covered only up to DEF_BUDDY_CALL_STACK_SIZE
+            stacksize = DEF_BUDDY_CALL_STACK_SIZE;
+        }
+        stacksize = (stacksize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     }
 
     struct ArgInfo * pArgInfo = (struct ArgInfo *) malloc(sizeof(struct ArgInfo));
     pArgInfo->start_routine= start_routine;
     pArgInfo->arg = arg;
+    pArgInfo->call_stack_size = stacksize;
+    pArgInfo->prefault_size = get_shadow_depth((void *) start_routine);
+    pArgInfo->stack = NULL;
+    pArgInfo->window = NULL;
 
-    return _pthread_create(thread, attr, &do_start_routine, pArgInfo);
+    /*
+        Unless the caller has its own stack, the call stack is taken from the slab together with
+        a shadow stack of the pool, and both are retired together.
+        If glibc refuses the stack (e.g., too small for the static TLS), glibc allocates one as before.
+     */
+    int ret = -1;
+    pthread_attr_t stackAttr;
+    if(pthread_attr_init(&stackAttr) == 0){
+        if(spa_copy_thread_attr(&stackAttr, attr) == 0){
+            pArgInfo->stack = get_thread_stack(stacksize, &pArgInfo->window, &pArgInfo->window_size);
+        }
+        if(pArgInfo->stack){
+            int detached = PTHREAD_CREATE_JOINABLE;
+            pthread_attr_getdetachstate(&stackAttr, &detached);
+            get_thread_stack_info(pArgInfo->stack, stacksize)->released = (detached == PTHREAD_CREATE_DETACHED);
+            pArgInfo->stack_size = stacksize;
+            if(pthread_attr_setstack(&stackAttr, pArgInfo->stack, stacksize) == 0){
+                ret = _pthread_create(thread, &stackAttr, &do_start_routine, pArgInfo);
+            }
+            if(ret != 0){
+                if(pArgInfo->window){
+                    retire_shadow_window(pArgInfo->window, pArgInfo->window_size, pArgInfo->stack, stacksize);
+                }else{
+                    put_thread_stack(pArgInfo->stack, stacksize);
+                }
+                pArgInfo->stack = NULL;
+                pArgInfo->window = NULL;
+            }
+        }else if(pArgInfo->window){
+            // the window is left to do_init_shadow_stack()
+            retire_shadow_window(pArgInfo->window, pArgInfo->window_size, NULL, 0);
+            pArgInfo->window = NULL;
+        }
+        pthread_attr_destroy(&stackAttr);
+    }
+    if(ret != 0){
+        ret = _pthread_create(thread, attr, &do_start_routine, pArgInfo);
+    }
+    pthread_attr_destroy(&threadAttr);
+    return ret;
+}
+
+int SPA_PTHREAD_JOIN(pthread_t thread, void **retval){
+    pthread_once(&first_thread_once, init_first_thread);
+    int ret = _pthread_join(thread, retval);
+    if(ret == 0){
+        release_thread_stack(thread);
+    }
+    return ret;
+}
+
+int SPA_PTHREAD_TRYJOIN_NP(pthread_t thread, void **retval){
+    pthread_once(&first_thread_once, init_first_thread);
+    int ret = _pthread_tryjoin_np(thread, retval);
+    if(ret == 0){
+        release_thread_stack(thread);
+    }
+    return ret;
+}
+
+int SPA_PTHREAD_TIMEDJOIN_NP(pthread_t thread, void **retval, const struct timespec *abstime){
+    pthread_once(&first_thread_once, init_first_thread);
+    int ret = _pthread_timedjoin_np(thread, retval, abstime);
+    if(ret == 0){
+        release_thread_stack(thread);
+    }
+    return ret;
+}
+
+int SPA_PTHREAD_DETACH(pthread_t thread){
+    pthread_once(&first_thread_once, init_first_thread);
+    int ret = _pthread_detach(thread);
+    if(ret == 0){
+        release_thread_stack(thread);
+    }
+    return ret;
+}
+
+/*
+    glibc reports no guard for a stack given by pthread_attr_setstack(),
+    and some runtimes, e.g. Rust's std, refuse to run a thread without one.
+    Below a stack from the stack slab, the rest of its slot is PROT_NONE.
+ */
+int SPA_PTHREAD_GETATTR_NP(pthread_t thread, pthread_attr_t *attr){
+    pthread_once(&first_thread_once, init_first_thread);
+    int ret = _pthread_getattr_np(thread, attr);
+    void *stackaddr;
+    size_t size;
+    if(ret == 0 && in_stack_slots((void *) thread) && pthread_attr_getstack(attr, &stackaddr, &size) == 0){
+        pthread_attr_setguardsize(attr, ((unsigned long) stackaddr) - get_stack_slot(stackaddr));
+    }
+    return ret;
 }
 
 
@@ -466,6 +1517,10 @@ void pthread_exit(void *retval){
 #endif
 
 int init_main_shadow_stack(void){
+    // called at the entry of the customized malloc(), free(), ..., so nothing but a TLS load once inited
+    if(gs_rsp_flash_stack_inited){
+        return 0;
+    }
     /*
         We should not call dlsym() here.
         (gdb) bt
@@ -491,7 +1546,7 @@ int init_main_shadow_stack(void){
 //        _pthread_exit = (PTHREAD_EXIT_FUNC)dlsym(RTLD_NEXT, "pthread_exit");
 //    }
 
-    init_shadow_stack();
+    init_shadow_stack(spa_main_call_stack_size(DEF_BUDDY_CALL_STACK_SIZE), NULL, 0);
 
     return 0;
 }
@@ -506,11 +1561,314 @@ long gs_rsp_allow_system_call_during_shuffling(void){
     }else{
         struct gs_rsp_metadata *pMetadata = get_gs_rsp_metadata_by_rsp();
 
-        return pMetadata->is_randomizing;
+        return pMetadata ? pMetadata->is_randomizing : 0;
+    }
+}
+
+
+
+/*
+    A deep recursion leaves its shadow pages resident after it returns.
+    The pages below the shadow of the current frame are dead, so they are discarded
+    once at least shadow_trim_threshold bytes of them are resident.
+    mincore() tells how deep the thread has been (its high-water mark) since the last trim.
+    One page is left below the current frame for the callees of the caller,
+    and the pages prefaulted for its start routine are kept.
+    Huge pages are only discarded as a whole, not split.
+ */
+/*
+    Return the index of the deepest resident page of the shadow stack in [window, end), or -1,
+    and count the resident pages in @resident.
+    pMetadata->hwm is updated.
+ */
+static long find_deepest_shadow_page(struct gs_rsp_metadata *pMetadata, char *window, char *end, long *resident){
+    unsigned char vec[DEF_BUDDY_CALL_STACK_SIZE / PAGE_SIZE];
+    long pages = (end - window) / PAGE_SIZE;
+    long deepest = -1;
+
+    *resident = 0;
+    if(pages <= 0 || mincore(window, end - window, vec) != 0){
+        return -1;
+    }
+    for(long i = 0; i < pages; i++){
+        if(vec[i] & 1){
+            if(deepest < 0){
+                deepest = i;
+            }
+            (*resident)++;
+        }
+    }
+    if(deepest >= 0){
+        long depth = ((char *) pMetadata->shadow_stack) + INIT_SHADOW_STACK_OFFSET - (window + deepest * PAGE_SIZE);
+        if(depth > pMetadata->hwm){
+            pMetadata->hwm = depth;
+        }
+    }
+    return deepest;
+}
+
+static void trim_shadow_stack(struct gs_rsp_metadata *pMetadata){
+    long resident;
+
+    if(shadow_trim_threshold <= 0){
+        return;
+    }
+    char *window = ((char *) pMetadata->shadow_stack) + SHADOW_WINDOW_OFFSET(pMetadata->call_stack_size);
+    char *live = (char *) (((SPA_GET_RSP() + pMetadata->diff - SPA_USER_SPACE_SIZE) & ~(PAGE_SIZE - 1)) - PAGE_SIZE);
+    char *kept = ((char *) pMetadata->shadow_stack) + INIT_SHADOW_STACK_OFFSET - pMetadata->prefault_size;
+    if(live > kept){
+        live = kept;
+    }
+    if(shadow_hugepage){
+        live = (char *) (((unsigned long) live) & ~(SHADOW_HUGE_PAGE_SIZE - 1));
+    }
+    if(live - window < shadow_trim_threshold){
+        return;
+    }
+    long pages = (live - window) / PAGE_SIZE;
+    long deepest = find_deepest_shadow_page(pMetadata, window, live, &resident);
+    if(deepest < 0 || resident * PAGE_SIZE < shadow_trim_threshold){
+        return;
+    }
+    if(shadow_hugepage){
+        deepest &= ~(SHADOW_HUGE_PAGE_SIZE / PAGE_SIZE - 1);
+    }
+    if(madvise(window + deepest * PAGE_SIZE, (pages - deepest) * PAGE_SIZE, MADV_DONTNEED) == 0){
+        __sync_fetch_and_add(&gsrsp_total_trimmed_pages, resident);
+    }
+}
+
+/*
+    Called by the application when it is idle, e.g. before blocking in epoll_wait(),
+    so that the shadow pages of a finished deep recursion are returned without waiting for
+    the next rerandomization.
+ */
+void gs_rsp_trim_shadow_stack(void){
+    if(!gs_rsp_flash_stack_inited){
+        return;
+    }
+    struct gs_rsp_metadata *pMetadata = get_gs_rsp_metadata_by_rsp();
+    if(pMetadata == NULL || pMetadata->state != FLASH_STACK_INITED || pMetadata->is_randomizing){
+        return;
+    }
+    pMetadata->is_randomizing = 1;
+    trim_shadow_stack(pMetadata);
+    pMetadata->is_randomizing = 0;
+}
+
+static void put_retired_window(void *addr, unsigned long size){
+    put_shadow_window(addr, size, 0);
+}
+static void release_retired_windows(unsigned long size){
+    spa_release_retired_shadow_stacks(&retired_windows, size, put_retired_window);
+}
+
+static void fill_rerand_queue(struct RerandQueue *q){
+    long window_offset = SHADOW_WINDOW_OFFSET(q->call_stack_size);
+    long window_size = SHADOW_WINDOW_SIZE(q->call_stack_size);
+
+    while(q->tail - q->head < RERAND_QUEUE_SIZE){
+        char *slot = (char *) get_memory_below(window_offset, window_size, 1, q->rsp);
+        if(slot == MAP_FAILED){
+            return;
+        }
+        advise_shadow_window(slot + window_offset, window_size);
+        // prefault on the node of the thread rather than on that of the helper
+        long node = q->numa_node;
+        if(node >= 0){
+            bind_shadow_window(slot + window_offset, window_size, node, 0);
+        }
+        // mremap() would replace the pages anyway
+        if(rerand_copy){
+            long depth = q->depth < q->call_stack_size ? q->depth : q->call_stack_size;
+            madvise(slot + INIT_SHADOW_STACK_OFFSET - depth, depth, MADV_POPULATE_WRITE);
+            madvise(slot + METADATA_OFFSET_ON_SHADOW_STACK, PAGE_SIZE, MADV_POPULATE_WRITE);
+        }
+        q->slots[q->tail % RERAND_QUEUE_SIZE] = slot;
+        __sync_synchronize();
+        q->tail++;
+    }
+}
+
+/*
+    The helper thread does the mmap()/madvise() calls of rerandomization ahead of time,
+    so that gs_rsp_runtime_rerandomize() is left with the copy (or mremap()) and set_gs_base().
+    It runs none of the instrumented code, so it needs no shadow stack of its own.
+ */
+static void *rerand_helper_main(void *arg){
+    (void) arg;
+    for(;;){
+        int wakeups = rerand_helper_futex;
+        pthread_mutex_lock(&rerand_queues_lock);
+        for(struct RerandQueue *q = rerand_queues; q; q = q->next){
+            fill_rerand_queue(q);
+        }
+        pthread_mutex_unlock(&rerand_queues_lock);
+
+        struct timespec ts = {0, RERAND_HELPER_INTERVAL_MS * 1000000L};
+        syscall(SYS_futex, &rerand_helper_futex, FUTEX_WAIT_PRIVATE, wakeups, &ts, NULL, 0);
+    }
+    return NULL;
+}
+
+static void wake_rerand_helper(void){
+    __sync_fetch_and_add(&rerand_helper_futex, 1);
+    syscall(SYS_futex, &rerand_helper_futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// the helper thread of the parent is not in the child, which falls back to preparing its own slots
+static void rerand_helper_atfork_child(void){
+    pthread_mutex_init(&rerand_queues_lock, NULL);
+    rerand_helper_running = 0;
+    rerand_queues = NULL;
+    if(rerand_queue.call_stack_size){
+        rerand_queue.next = NULL;
+        rerand_queues = &rerand_queue;
+    }
+}
+
+// called with the first pthread_create(), when the calls to _pthread_create() are resolved
+static void start_rerand_helper(void){
+    pthread_attr_t attr;
+    pthread_t helper;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + (64L << 10));
+    if(_pthread_create(&helper, &attr, rerand_helper_main, NULL) == 0){
+        rerand_helper_running = 1;
+        pthread_atfork(NULL, NULL, rerand_helper_atfork_child);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+    Return a slot prepared by the helper thread for the shadow stack of this thread,
+    or MAP_FAILED if there is none ready.
+ */
+static char *take_rerand_slot(struct gs_rsp_metadata *pMetadata){
+    struct RerandQueue *q = &rerand_queue;
+
+    if(!q->call_stack_size){
+        if(!rerand_helper_running){
+            return MAP_FAILED;
+        }
+        q->call_stack_size = pMetadata->call_stack_size;
+        q->rsp = SPA_GET_RSP();
+        q->depth = pMetadata->prefault_size;
+        q->numa_node = pMetadata->numa_node;
+        pthread_mutex_lock(&rerand_queues_lock);
+        q->next = rerand_queues;
+        rerand_queues = q;
+        pthread_mutex_unlock(&rerand_queues_lock);
+        wake_rerand_helper();
+        return MAP_FAILED;
+    }
+    if(q->head == q->tail){
+        if(rerand_helper_running){
+            wake_rerand_helper();
+        }
+        return MAP_FAILED;
+    }
+    char *slot = q->slots[q->head % RERAND_QUEUE_SIZE];
+    __sync_synchronize();
+    q->head++;
+    return slot;
+}
+
+// called by release_shadow_stack(), as the TLS of this thread is going away
+static void remove_rerand_queue(void){
+    struct RerandQueue *q = &rerand_queue;
+
+    if(!q->call_stack_size){
+        return;
+    }
+    pthread_mutex_lock(&rerand_queues_lock);
+    for(struct RerandQueue **pp = &rerand_queues; *pp; pp = &(*pp)->next){
+        if(*pp == q){
+            *pp = q->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rerand_queues_lock);
+    while(q->head != q->tail){
+        put_shadow_window((char *) q->slots[q->head % RERAND_QUEUE_SIZE] + SHADOW_WINDOW_OFFSET(q->call_stack_size),
+                          SHADOW_WINDOW_SIZE(q->call_stack_size), 0);
+        q->head++;
     }
+    q->call_stack_size = 0;
 }
 
+/*
+    Move the shadow stack by copying its live part into a new slot (see spa_copy_shadow_stack()).
+    The live part is from the shadow of the current frame up to the highest resident page above
+    INIT_SHADOW_STACK_OFFSET (the frames above the initial %rsp), plus the page of the metadata.
+    The old window is released later, together with SPA_RETIRE_BATCH - 1 others.
+    Return the metadata in the new slot, or NULL if the shadow stack stays where it is.
+ */
+static struct gs_rsp_metadata *copy_shadow_stack(struct gs_rsp_metadata *pMetadata){
+    long window_offset = SHADOW_WINDOW_OFFSET(pMetadata->call_stack_size);
+    long window_size = SHADOW_WINDOW_SIZE(pMetadata->call_stack_size);
+    char *old_shadow_stack = (char *) pMetadata->shadow_stack;
+    char *new_shadow_stack = take_rerand_slot(pMetadata);
+    // the helper has bound a queued slot to rerand_queue.numa_node, a new one is first touched below
+    long slot_node = new_shadow_stack == MAP_FAILED ? -1 : rerand_queue.numa_node;
+
+    if(new_shadow_stack == MAP_FAILED){
+        new_shadow_stack = (char *) get_memory_at_random(window_offset, window_size, 0);
+        if(new_shadow_stack == MAP_FAILED){
+            return NULL;
+        }
+        advise_shadow_window(new_shadow_stack + window_offset, window_size);
+    }
+    long delta = new_shadow_stack - old_shadow_stack;
+    long diff = pMetadata->diff + delta;
+    if(diff < 0 || diff > MAX_GS_BASE_ADDR){
+        put_shadow_window(new_shadow_stack + window_offset, window_size, 0);
+        return NULL;
+    }
 
+    // before the pages are touched, so that no page has to be moved afterwards
+    long numa_node = pMetadata->numa_node;
+    if(shadow_numa != SHADOW_NUMA_NONE && shadow_numa_max_node > 0){
+        long node = get_numa_node();
+        if(node >= 0 && slot_node >= 0 && slot_node != node
+                && bind_shadow_window(new_shadow_stack + window_offset, window_size, node, 0) == 0){
+            // the pages the helper has faulted in on the old node
+            madvise(new_shadow_stack + window_offset, window_size, MADV_DONTNEED);
+        }
+        if(node >= 0){
+            numa_node = node;
+        }
+    }
+
+    char *from = (char *) ((SPA_GET_RSP() + pMetadata->diff - SPA_USER_SPACE_SIZE) & ~(PAGE_SIZE - 1));
+    if(from < old_shadow_stack + window_offset){
+        from = old_shadow_stack + window_offset;
+    }
+    char *to = spa_resident_end(old_shadow_stack + INIT_SHADOW_STACK_OFFSET,
+                                old_shadow_stack + METADATA_OFFSET_ON_SHADOW_STACK);
+    rerand_queue.depth = to - from;
+    spa_copy_shadow_stack(from, to, delta);
+    // the metadata, followed by the RetiredThread
+    memcpy(old_shadow_stack + METADATA_OFFSET_ON_SHADOW_STACK + delta,
+           old_shadow_stack + METADATA_OFFSET_ON_SHADOW_STACK, PAGE_SIZE);
+
+    struct gs_rsp_metadata *new_metadata = get_gs_rsp_metadata_by_shadow_stack((long) new_shadow_stack);
+    new_metadata->shadow_stack = new_shadow_stack;
+    new_metadata->diff = diff;
+    new_metadata->numa_node = numa_node;
+    gs_rsp_cur_metadata = new_metadata;
+    if(set_gs_base(diff) < 0){
+        gs_rsp_cur_metadata = pMetadata;
+        put_shadow_window(new_shadow_stack + window_offset, window_size, 0);
+        return NULL;
+    }
+    rerand_queue.numa_node = numa_node;
+
+    spa_retire_shadow_stack(&retired_windows, old_shadow_stack + window_offset, window_size, put_retired_window);
+    return new_metadata;
+}
 
 void gs_rsp_runtime_rerandomize(void){
     unsigned long from = __rdtsc();
@@ -543,8 +1901,25 @@ void gs_rsp_runtime_rerandomize(void){
 
     pMetadata->cpu_cycles = cur_clocks;
 
-    void * new_shadow_stack =
-                (long *) get_memory_at_random(REAL_SHADOW_STACK_SIZE, 0);
+    // fewer pages to move
+    trim_shadow_stack(pMetadata);
+
+    if(rerand_copy){
+        struct gs_rsp_metadata *new_metadata = copy_shadow_stack(pMetadata);
+        if(new_metadata){
+            pMetadata = new_metadata;
+        }else{
+            __sync_fetch_and_add(&gsrsp_total_fail_rand_cnt, 1);
+        }
+        goto rand_exit;
+    }
+
+    long window_offset = SHADOW_WINDOW_OFFSET(pMetadata->call_stack_size);
+    long window_size = SHADOW_WINDOW_SIZE(pMetadata->call_stack_size);
+    void * new_shadow_stack = take_rerand_slot(pMetadata);
+    if(new_shadow_stack == MAP_FAILED){
+        new_shadow_stack = get_memory_at_random(window_offset, window_size, 0);
+    }
 
 
     if(new_shadow_stack != MAP_FAILED){
@@ -553,7 +1928,7 @@ void gs_rsp_runtime_rerandomize(void){
         long diff = pMetadata->diff + delta;
 
         if(diff < 0 || diff > MAX_GS_BASE_ADDR){
-            munmap(new_shadow_stack, REAL_SHADOW_STACK_SIZE);
+            put_shadow_window(((char *) new_shadow_stack) + window_offset, window_size, 0);
             //return;
             goto rand_exit;
         }
@@ -569,6 +1944,7 @@ void gs_rsp_runtime_rerandomize(void){
                 long state;             //
                 long diff;              // Y
                 long relaxing;          //
+                long call_stack_size;   //
             };
          */
         pMetadata->shadow_stack = new_shadow_stack;
@@ -578,39 +1954,48 @@ void gs_rsp_runtime_rerandomize(void){
 
 
         // To be optimized, old size can be shrinked ?
-        void *shadow_stack = mremap(old_shadow_stack,
-                                     REAL_SHADOW_STACK_SIZE,
-                                     REAL_SHADOW_STACK_SIZE,
+        void *shadow_stack = mremap(((char *) old_shadow_stack) + window_offset,
+                                     window_size,
+                                     window_size,
                                      MREMAP_MAYMOVE | MREMAP_FIXED,
-                                     new_shadow_stack);
+                                     ((char *) new_shadow_stack) + window_offset);
 
         if(shadow_stack == MAP_FAILED){
             //fprintf(stderr, "\n ..........  tid = %ld:  mremap() failed ...... \n\n", syscall(SYS_gettid));
             __sync_fetch_and_add(&gsrsp_total_fail_rand_cnt, 1);
             pMetadata->shadow_stack = old_shadow_stack;
             pMetadata->diff -= delta;
-            munmap(new_shadow_stack, REAL_SHADOW_STACK_SIZE);
+            put_shadow_window(((char *) new_shadow_stack) + window_offset, window_size, 0);
             //return;
             goto rand_exit;
         }
+        // the metadata has been moved together with the shadow stack
+        gs_rsp_cur_metadata = get_gs_rsp_metadata_by_shadow_stack((long) new_shadow_stack);
 
-        int r = arch_prctl(ARCH_SET_GS, diff);
+        int r = set_gs_base(diff);
         if(r < 0){
             //fprintf(stderr, "\n ..........  tid = %ld:  mremap() failed ...... \n\n", syscall(SYS_gettid));
             __sync_fetch_and_add(&gsrsp_total_fail_rand_cnt, 1);
+            gs_rsp_cur_metadata = pMetadata;
             pMetadata->shadow_stack = old_shadow_stack;
             pMetadata->diff -= delta;
-            munmap(new_shadow_stack, REAL_SHADOW_STACK_SIZE);
+            put_shadow_window(((char *) new_shadow_stack) + window_offset, window_size, 0);
             //return;
             goto rand_exit;
         }
 
+        put_shadow_window(((char *) old_shadow_stack) + window_offset, window_size, 1);
+
 //        fprintf(stderr, "tid = %ld, old_shadow_stack = %p, new_stack_stack = %p, shadow_stack = %p\n",
 //                syscall(SYS_gettid), old_shadow_stack, new_shadow_stack, shadow_stack);
 
         //pMetadata = (struct gs_rsp_metadata *) (((long) pMetadata) + delta);
 
-        pMetadata = get_gs_rsp_metadata_by_shadow_stack((long) shadow_stack);
+        pMetadata = get_gs_rsp_metadata_by_shadow_stack((long) new_shadow_stack);
+
+        if(shadow_numa == SHADOW_NUMA_FOLLOW && shadow_numa_max_node > 0){
+            place_shadow_window(pMetadata, 1);
+        }
 
 #endif
     }
@@ -664,7 +2049,30 @@ static void thread_cleanup_handler(void* _iter) {
 
 
 //static int __attribute__((constructor(101))) do_gs_rsp_init_main_shadow_stack(void){
-static int __attribute__((constructor(101))) do_init_main_shadow_stack(void){
+// glibc passes (argc, argv, envp) to constructors
+static int __attribute__((constructor(101))) do_init_main_shadow_stack(int argc, char **argv, char **envp){
+    (void) argc;
+    (void) argv;
+    gs_rsp_envp = envp;
+    detect_fsgsbase();
+
+    char *env = gs_rsp_getenv(SPA_SHADOW_TRIM_KB_ENV);
+    if(env){
+        shadow_trim_threshold = atol(env) << 10;
+    }
+    env = gs_rsp_getenv(SPA_SHADOW_HUGEPAGE_ENV);
+    shadow_hugepage = env && atoi(env);
+    env = gs_rsp_getenv(SPA_SHADOW_NUMA_ENV);
+    if(env){
+        shadow_numa = atoi(env);
+    }
+    if(shadow_numa != SHADOW_NUMA_NONE){
+        detect_numa_nodes();
+    }
+    env = gs_rsp_getenv(SPA_RERAND_COPY_ENV);
+    rerand_copy = env && atoi(env);
+    env = gs_rsp_getenv(SPA_RERAND_HELPER_ENV);
+    rerand_helper = env && atoi(env);
 
 //    fprintf(stderr, "tid = %ld, do_init_main_shadow_stack():  %s, %d\n",
 //                syscall(SYS_gettid), __FILE__, __LINE__);
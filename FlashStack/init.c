@@ -117,12 +117,14 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 //    }
 //#endif
 
-    if(!attr){
+    // The buddy stack needs exactly BUDDY_STACK_SIZE, set in a copy of the caller's attr.
+    // A thread with its own stack is left as it is.
+    if(!attr || spa_copy_thread_attr(&threadAttr, attr) == 0){
+        if(pthread_attr_setstacksize(&threadAttr, stacksize) != 0){
+            fprintf(stderr, "error in pthread_attr_setstacksize()\n");
+        }
         attr = &threadAttr;
     }
-    if(pthread_attr_setstacksize(( pthread_attr_t *)attr, stacksize) != 0){
-        fprintf(stderr, "error in pthread_attr_setstacksize()\n");
-    }
     //pthread_attr_getstacksize(attr, &stacksize);
 //    SPA_DEBUG_OUTPUT(printf("pthread_create() is hijacked. BUDDY_STACK_SIZE = 0x%lx, pid = %ld \n",
 //                            stacksize, syscall(SYS_gettid)));
@@ -132,7 +134,9 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
     pArgInfo->start_routine= start_routine;
     pArgInfo->arg = arg;
 
-    return _pthread_create(thread, attr, &do_start_routine, pArgInfo);
+    int ret = _pthread_create(thread, attr, &do_start_routine, pArgInfo);
+    pthread_attr_destroy(&threadAttr);
+    return ret;
 }
 
 
@@ -103,6 +103,12 @@
     gs_rsp_runtime_rerandomize(); \
 }while(0)
 
+#elif defined(USE_SPA_COMPACT_SHADOW_STACK)
+
+#define DO_RANDOMIZATION()  do{ \
+    compact_runtime_rerandomize(); \
+}while(0)
+
 #else
 
 #define DO_RANDOMIZATION()  do{ \
@@ -0,0 +1,139 @@
+/*****************************************************************
+            Generating spa_modes_gen.h
+
+   The prologue of each mode in spa_modes.h is assembled by GNU as,
+   and its length and first 8 bytes (the magic number checked before
+   an indirect call) are written to spa_modes_gen.h for afl-as.
+   The bytes of the prologue and epilogue are also written for spa-rewrite.
+
+   Usage:
+
+        spa-gen-modes  /path/to/spa_modes_gen.h
+
+   AFL_AS can be used to specify the assembler (default: /usr/bin/as).
+
+******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "spa_modes.h"
+#include "spa_elf.h"
+
+// an assembled prologue or epilogue
+struct spa_code{
+    int len;
+    int first_reloc;        // the offset of the first byte only known after linking, len if none
+    unsigned char bytes[SPA_MAX_MODE_CODE_LEN];
+};
+
+// assemble @code (NULL for none), return -1 on error
+static int assemble_code(const char *code, const char *as_path, struct spa_code *out){
+    char s_path[] = "/tmp/spa-gen-modes-XXXXXX.s";
+    char o_path[sizeof(s_path)];
+    char cmd[3 * PATH_MAX];
+    struct spa_elf_file elf;
+    int ret = -1;
+
+    memset(out, 0, sizeof(*out));
+    if(!code){
+        return 0;
+    }
+    int fd = mkstemps(s_path, 2);
+    if(fd < 0){
+        return -1;
+    }
+    FILE *f = fdopen(fd, "w");
+    fprintf(f, "\t.text\n%s", code);
+    fclose(f);
+
+    strcpy(o_path, s_path);
+    o_path[strlen(o_path) - 1] = 'o';
+    snprintf(cmd, sizeof(cmd), "%s --64 -o %s %s", as_path, o_path, s_path);
+    if(system(cmd) != 0 || spa_elf_open(&elf, o_path, 0) < 0){
+        goto out;
+    }
+    Elf64_Shdr *text = spa_elf_find_section(&elf, ".text");
+    unsigned char *bytes = text ? spa_elf_section_data(&elf, text) : NULL;
+    if(bytes && text->sh_size <= sizeof(out->bytes)){
+        out->len = text->sh_size;
+        out->first_reloc = out->len;
+        memcpy(out->bytes, bytes, out->len);
+        // the bytes are only known after linking
+        Elf64_Shdr *rela = spa_elf_find_section(&elf, ".rela.text");
+        Elf64_Rela *relocs = rela ? (Elf64_Rela *) spa_elf_section_data(&elf, rela) : NULL;
+        for(size_t i = 0; relocs && i < rela->sh_size / sizeof(Elf64_Rela); i++){
+            if(relocs[i].r_offset < (unsigned long) out->first_reloc){
+                out->first_reloc = relocs[i].r_offset;
+            }
+        }
+        ret = 0;
+    }
+    spa_elf_close(&elf);
+out:
+    unlink(s_path);
+    unlink(o_path);
+    return ret;
+}
+
+// a string literal, or NULL if @code needs relocation
+static void print_code(FILE *outf, struct spa_code *code){
+    if(!code->len || code->first_reloc < code->len){
+        fprintf(outf, "NULL");
+        return;
+    }
+    fprintf(outf, "\"");
+    for(int i = 0; i < code->len; i++){
+        fprintf(outf, "\\x%02x", code->bytes[i]);
+    }
+    fprintf(outf, "\"");
+}
+
+int main(int argc, char **argv){
+    char *as_path = getenv("AFL_AS");
+
+    if(argc < 2){
+        fprintf(stderr, "\nUsage: %s /path/to/spa_modes_gen.h\n\n", argv[0]);
+        exit(1);
+    }
+    if(!as_path){
+        as_path = "/usr/bin/as";
+    }
+
+    FILE *outf = fopen(argv[1], "w");
+    if(!outf){
+        SPA_ERROR("Unable to write %s", argv[1]);
+    }
+    fprintf(outf, "// Generated by spa-gen-modes from spa_modes.h, do not edit.\n\n");
+    fprintf(outf, "#ifndef SPA_MODES_GEN_H\n#define SPA_MODES_GEN_H\n\n");
+    fprintf(outf, "#include \"spa_modes.h\"\n\n");
+    fprintf(outf, "static const struct spa_mode_layout spa_mode_layouts[] = {\n");
+    for(int i = 0; i < SPA_MODE_CNT; i++){
+        struct spa_code prologue, epilogue;
+        if(assemble_code(spa_modes[i].prologue, as_path, &prologue) < 0
+                || assemble_code(spa_modes[i].epilogue, as_path, &epilogue) < 0){
+            fclose(outf);
+            unlink(argv[1]);
+            SPA_ERROR("failed to assemble the prologue/epilogue of %s", spa_modes[i].name);
+        }
+        // the first 8 bytes of the prologue are the magic number checked before an indirect call
+        unsigned long magic = 0;
+        if(prologue.first_reloc >= (int) sizeof(magic)){
+            memcpy(&magic, prologue.bytes, sizeof(magic));
+        }
+        fprintf(outf, "    {\"%s\", %d, 0x%016lxL,\n        ", spa_modes[i].name, prologue.len, magic);
+        print_code(outf, &prologue);
+        fprintf(outf, ",\n        %d, ", epilogue.len);
+        print_code(outf, &epilogue);
+        fprintf(outf, "},\n");
+    }
+    fprintf(outf, "};\n\n");
+    fprintf(outf, "_Static_assert(sizeof(spa_mode_layouts) / sizeof(spa_mode_layouts[0]) == SPA_MODE_CNT,\n"
+                  "               \"spa_modes_gen.h is out of date\");\n\n");
+    fprintf(outf, "#endif // SPA_MODES_GEN_H\n");
+    fclose(outf);
+    return 0;
+}
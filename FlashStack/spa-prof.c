@@ -0,0 +1,592 @@
+/*****************************************************************
+            Cycles spent in FlashStack
+
+   When __SPA_EMIT_RANGES is set during building, afl-as records the
+   address range of every prologue, epilogue and call-site sequence
+   in the non-allocated section .spa.ranges (see spa.h).
+
+   This tool runs a command, samples its cycles with perf_event_open()
+   (including its threads and child processes), and reports per DSO
+   and per function the fraction of samples inside these ranges.
+   The samples in a FlashStack runtime library (libgsrsp.so, ...)
+   are all counted as FlashStack.
+
+   Usage:
+
+        spa-prof  [-F freq] [-n top] [-o report]  --  command [args...]
+
+   A DSO without .spa.ranges is reported with 0% in FlashStack.
+
+******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <libgen.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "spa.h"
+#include "spa_elf.h"
+
+#define  DEF_SAMPLE_FREQ        4000
+#define  DEF_TOP_FUNCS          30
+// 2^n data pages of the ring buffer
+#define  RING_BUFFER_PAGES      64
+#define  POLL_INTERVAL_IN_US    50000
+// defined in rt_lib.c, so it is in every FlashStack runtime library
+#define  SPA_RUNTIME_SYMBOL     "buddy_init_rt_lib_hooker"
+
+struct FuncInfo{
+    unsigned long start;
+    unsigned long size;
+    const char *name;
+    long samples;
+    long spa_samples;
+};
+
+struct DsoInfo{
+    char *path;
+    int is_runtime;
+    struct spa_elf_file elf;
+    int elf_ok;
+    // sorted by start
+    struct FuncInfo *funcs;
+    long func_cnt;
+    long func_cap;
+    // sorted [start, end) pairs of SPA_RANGES_SECTION
+    unsigned long *ranges;
+    long range_cnt;
+    long samples;
+    long spa_samples;
+};
+
+struct MapInfo{
+    int pid;
+    unsigned long start;
+    unsigned long len;
+    unsigned long pgoff;
+    struct DsoInfo *dso;
+};
+
+static struct DsoInfo **dsos;
+static long dso_cnt, dso_cap;
+
+static struct MapInfo *maps;
+static long map_cnt, map_cap;
+
+static long total_samples, total_spa_samples, unmapped_samples, lost_samples;
+
+static void *grow_array(void *arr, long *cap, long elem_size){
+    *cap = *cap ? 2 * *cap : 256;
+    arr = realloc(arr, *cap * elem_size);
+    if(!arr){
+        SPA_ERROR("out of memory");
+    }
+    return arr;
+}
+
+static int collect_func(Elf64_Sym *sym, const char *name, void *arg){
+    struct DsoInfo *dso = (struct DsoInfo *) arg;
+    if(ELF64_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_shndx == SHN_UNDEF || !sym->st_value){
+        return 0;
+    }
+    if(!strcmp(name, SPA_RUNTIME_SYMBOL)){
+        dso->is_runtime = 1;
+    }
+    if(dso->func_cnt == dso->func_cap){
+        dso->funcs = grow_array(dso->funcs, &dso->func_cap, sizeof(struct FuncInfo));
+    }
+    struct FuncInfo *f = &dso->funcs[dso->func_cnt++];
+    memset(f, 0, sizeof(*f));
+    f->start = sym->st_value;
+    f->size = sym->st_size;
+    f->name = name;
+    return 0;
+}
+
+static int cmp_func(const void *a, const void *b){
+    const struct FuncInfo *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int cmp_range(const void *a, const void *b){
+    const unsigned long *x = a, *y = b;
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+static struct DsoInfo *get_dso(const char *path){
+    for(long i = 0; i < dso_cnt; i++){
+        if(!strcmp(dsos[i]->path, path)){
+            return dsos[i];
+        }
+    }
+    if(dso_cnt == dso_cap){
+        dsos = grow_array(dsos, &dso_cap, sizeof(struct DsoInfo *));
+    }
+    struct DsoInfo *dso = calloc(1, sizeof(struct DsoInfo));
+    if(!dso){
+        SPA_ERROR("out of memory");
+    }
+    dso->path = strdup(path);
+    dsos[dso_cnt++] = dso;
+
+    if(spa_elf_open(&dso->elf, path, 0) < 0){
+        return dso;
+    }
+    dso->elf_ok = 1;
+    spa_elf_for_each_symbol(&dso->elf, spa_elf_find_symtab(&dso->elf), collect_func, dso);
+    qsort(dso->funcs, dso->func_cnt, sizeof(struct FuncInfo), cmp_func);
+
+    Elf64_Shdr *sec = spa_elf_find_section(&dso->elf, SPA_RANGES_SECTION);
+    unsigned long *data = sec ? (unsigned long *) spa_elf_section_data(&dso->elf, sec) : NULL;
+    if(data){
+        dso->range_cnt = sec->sh_size / (2 * sizeof(unsigned long));
+        dso->ranges = malloc(sec->sh_size);
+        if(!dso->ranges){
+            SPA_ERROR("out of memory");
+        }
+        memcpy(dso->ranges, data, dso->range_cnt * 2 * sizeof(unsigned long));
+        qsort(dso->ranges, dso->range_cnt, 2 * sizeof(unsigned long), cmp_range);
+        // an instrumented executable linked with the static runtime (__SPA_STATIC_RT)
+        dso->is_runtime = 0;
+    }
+    return dso;
+}
+
+static struct FuncInfo *find_func(struct DsoInfo *dso, unsigned long vaddr){
+    long lo = 0, hi = dso->func_cnt - 1;
+    struct FuncInfo *found = NULL;
+    while(lo <= hi){
+        long mid = (lo + hi) / 2;
+        if(dso->funcs[mid].start <= vaddr){
+            found = &dso->funcs[mid];
+            lo = mid + 1;
+        }else{
+            hi = mid - 1;
+        }
+    }
+    if(found && vaddr < found->start + found->size){
+        return found;
+    }
+    return NULL;
+}
+
+static int in_spa_range(struct DsoInfo *dso, unsigned long vaddr){
+    long lo = 0, hi = dso->range_cnt - 1;
+    while(lo <= hi){
+        long mid = (lo + hi) / 2;
+        unsigned long *r = &dso->ranges[2 * mid];
+        if(vaddr < r[0]){
+            hi = mid - 1;
+        }else if(vaddr >= r[1]){
+            lo = mid + 1;
+        }else{
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void add_map(int pid, unsigned long start, unsigned long len, unsigned long pgoff, const char *path){
+    if(path[0] != '/'){ // [vdso], [heap], anonymous memory of a JIT, ...
+        return;
+    }
+    if(map_cnt == map_cap){
+        maps = grow_array(maps, &map_cap, sizeof(struct MapInfo));
+    }
+    struct MapInfo *m = &maps[map_cnt++];
+    m->pid = pid;
+    m->start = start;
+    m->len = len;
+    m->pgoff = pgoff;
+    m->dso = get_dso(path);
+}
+
+static void remove_maps(int pid){
+    long k = 0;
+    for(long i = 0; i < map_cnt; i++){
+        if(maps[i].pid != pid){
+            maps[k++] = maps[i];
+        }
+    }
+    map_cnt = k;
+}
+
+// a forked process inherits the mappings of its parent
+static void copy_maps(int ppid, int pid){
+    long n = map_cnt;
+    for(long i = 0; i < n; i++){
+        if(maps[i].pid == ppid){
+            if(map_cnt == map_cap){
+                maps = grow_array(maps, &map_cap, sizeof(struct MapInfo));
+            }
+            maps[map_cnt] = maps[i];
+            maps[map_cnt].pid = pid;
+            map_cnt++;
+        }
+    }
+}
+
+// the mappings created before sampling started, e.g. by the kernel at exec()
+static void read_proc_maps(int pid){
+    char path[64], line[4096], file[4096];
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    FILE *f = fopen(path, "r");
+    if(!f){
+        return;
+    }
+    remove_maps(pid);
+    while(fgets(line, sizeof(line), f)){
+        unsigned long start, end, pgoff;
+        char perms[8];
+        file[0] = 0;
+        if(sscanf(line, "%lx-%lx %7s %lx %*s %*s %4095s", &start, &end, perms, &pgoff, file) >= 4
+                && perms[2] == 'x'){
+            add_map(pid, start, end - start, pgoff, file);
+        }
+    }
+    fclose(f);
+}
+
+static struct MapInfo *find_map(int pid, unsigned long ip){
+    // the latest mapping wins
+    for(long i = map_cnt - 1; i >= 0; i--){
+        if(maps[i].pid == pid && maps[i].start <= ip && ip < maps[i].start + maps[i].len){
+            return &maps[i];
+        }
+    }
+    return NULL;
+}
+
+static void add_sample(int pid, unsigned long ip){
+    struct MapInfo *m = find_map(pid, ip);
+    if(!m){
+        read_proc_maps(pid);
+        m = find_map(pid, ip);
+    }
+    total_samples++;
+    if(!m){
+        unmapped_samples++;
+        return;
+    }
+    struct DsoInfo *dso = m->dso;
+    unsigned long vaddr;
+    dso->samples++;
+    if(!dso->elf_ok || spa_elf_offset_to_vaddr(&dso->elf, ip - m->start + m->pgoff, &vaddr) < 0){
+        return;
+    }
+    int is_spa = dso->is_runtime || in_spa_range(dso, vaddr);
+    struct FuncInfo *f = find_func(dso, vaddr);
+    if(f){
+        f->samples++;
+        f->spa_samples += is_spa;
+    }
+    dso->spa_samples += is_spa;
+    total_spa_samples += is_spa;
+}
+
+static void handle_record(struct perf_event_header *hdr){
+    switch(hdr->type){
+    case PERF_RECORD_SAMPLE:{
+        // PERF_SAMPLE_IP | PERF_SAMPLE_TID
+        struct { struct perf_event_header hdr; unsigned long ip; unsigned pid, tid; } *r = (void *) hdr;
+        add_sample(r->pid, r->ip);
+        break;
+    }
+    case PERF_RECORD_MMAP:{
+        struct { struct perf_event_header hdr; unsigned pid, tid; unsigned long addr, len, pgoff; char filename[]; }
+                *r = (void *) hdr;
+        add_map(r->pid, r->addr, r->len, r->pgoff, r->filename);
+        break;
+    }
+    case PERF_RECORD_FORK:{
+        struct { struct perf_event_header hdr; unsigned pid, ppid, tid, ptid; } *r = (void *) hdr;
+        if(r->pid != r->ppid){ // not a new thread
+            copy_maps(r->ppid, r->pid);
+        }
+        break;
+    }
+    case PERF_RECORD_COMM:{
+        struct { struct perf_event_header hdr; unsigned pid, tid; } *r = (void *) hdr;
+        if(hdr->misc & PERF_RECORD_MISC_COMM_EXEC){
+            remove_maps(r->pid);
+        }
+        break;
+    }
+    case PERF_RECORD_LOST:{
+        struct { struct perf_event_header hdr; unsigned long id, lost; } *r = (void *) hdr;
+        lost_samples += r->lost;
+        break;
+    }
+    }
+}
+
+/*
+    Inherited events can not be mmap'd per task, so there is one event per CPU.
+    The records of a round are copied out of all the ring buffers first,
+    then the mappings are updated before the samples are attributed,
+    as a sample might be recorded on another CPU than its PERF_RECORD_MMAP.
+ */
+struct RingBuffer{
+    int fd;
+    struct perf_event_mmap_page *meta;
+    unsigned char *data;
+};
+
+static struct RingBuffer *rings;
+static int ring_cnt;
+static unsigned long ring_data_size;
+
+static unsigned char *round_buf;
+static long round_size, round_cap;
+
+static void copy_ring_buffer(struct RingBuffer *rb){
+    unsigned long head = __atomic_load_n(&rb->meta->data_head, __ATOMIC_ACQUIRE);
+    unsigned long tail = rb->meta->data_tail;
+
+    while(tail < head){
+        unsigned long offset = tail % ring_data_size;
+        struct perf_event_header *hdr = (struct perf_event_header *) (rb->data + offset);
+        unsigned long size = hdr->size;
+        while(round_size + size > round_cap){
+            round_buf = grow_array(round_buf, &round_cap, 1);
+        }
+        // a record wrapping around the end of the buffer
+        if(offset + size > ring_data_size){
+            memcpy(round_buf + round_size, rb->data + offset, ring_data_size - offset);
+            memcpy(round_buf + round_size + ring_data_size - offset, rb->data, size - (ring_data_size - offset));
+        }else{
+            memcpy(round_buf + round_size, rb->data + offset, size);
+        }
+        round_size += size;
+        tail += size;
+    }
+    __atomic_store_n(&rb->meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void drain_ring_buffers(void){
+    round_size = 0;
+    for(int i = 0; i < ring_cnt; i++){
+        copy_ring_buffer(&rings[i]);
+    }
+    for(int samples = 0; samples < 2; samples++){
+        for(long off = 0; off < round_size; ){
+            struct perf_event_header *hdr = (struct perf_event_header *) (round_buf + off);
+            if((hdr->type == PERF_RECORD_SAMPLE) == samples){
+                handle_record(hdr);
+            }
+            off += hdr->size;
+        }
+    }
+}
+
+static int open_sampling_event(pid_t pid, int cpu, long freq){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.freq = 1;
+    attr.sample_freq = freq;
+    attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.mmap = 1;
+    attr.comm = 1;
+    attr.comm_exec = 1;
+    attr.task = 1;
+
+    int fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    if(fd < 0){
+        // no PMU, e.g. in a virtual machine
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_CPU_CLOCK;
+        fd = syscall(SYS_perf_event_open, &attr, pid, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+static void open_ring_buffers(pid_t pid, long freq){
+    long page_size = sysconf(_SC_PAGESIZE);
+    int cpu_cnt = sysconf(_SC_NPROCESSORS_CONF);
+    int err = 0;
+
+    ring_data_size = RING_BUFFER_PAGES * page_size;
+    rings = calloc(cpu_cnt, sizeof(struct RingBuffer));
+    if(!rings){
+        SPA_ERROR("out of memory");
+    }
+    for(int cpu = 0; cpu < cpu_cnt; cpu++){
+        int fd = open_sampling_event(pid, cpu, freq);
+        if(fd < 0){ // offline
+            err = errno;
+            continue;
+        }
+        void *ring = mmap(NULL, page_size + ring_data_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(ring == MAP_FAILED){
+            err = errno;
+            close(fd);
+            continue;
+        }
+        rings[ring_cnt].fd = fd;
+        rings[ring_cnt].meta = (struct perf_event_mmap_page *) ring;
+        rings[ring_cnt].data = (unsigned char *) ring + page_size;
+        ring_cnt++;
+    }
+    if(ring_cnt == 0){
+        kill(pid, SIGKILL);
+        SPA_ERROR("perf_event_open(): %s. Is /proc/sys/kernel/perf_event_paranoid <= 2 ?", strerror(err));
+    }
+}
+
+static int cmp_dso(const void *a, const void *b){
+    const struct DsoInfo *x = *(struct DsoInfo **) a, *y = *(struct DsoInfo **) b;
+    return x->samples < y->samples ? 1 : x->samples > y->samples ? -1 : 0;
+}
+
+struct FuncRef{
+    struct FuncInfo *func;
+    struct DsoInfo *dso;
+};
+
+static int cmp_func_ref(const void *a, const void *b){
+    const struct FuncInfo *x = ((struct FuncRef *) a)->func, *y = ((struct FuncRef *) b)->func;
+    if(x->spa_samples != y->spa_samples){
+        return x->spa_samples < y->spa_samples ? 1 : -1;
+    }
+    return x->samples < y->samples ? 1 : x->samples > y->samples ? -1 : 0;
+}
+
+static double percent(long part, long total){
+    return total ? 100.0 * part / total : 0.0;
+}
+
+static void report(FILE *outf, int top){
+    fprintf(outf, "###SPA### %ld samples, %ld (%.2f%%) in FlashStack, %ld lost, %ld not in any DSO\n\n",
+            total_samples, total_spa_samples, percent(total_spa_samples, total_samples),
+            lost_samples, unmapped_samples);
+
+    qsort(dsos, dso_cnt, sizeof(struct DsoInfo *), cmp_dso);
+    fprintf(outf, "%10s %10s %8s  %s\n", "samples", "FlashStack", "%", "DSO");
+    long ref_cnt = 0;
+    for(long i = 0; i < dso_cnt; i++){
+        struct DsoInfo *dso = dsos[i];
+        if(!dso->samples){
+            continue;
+        }
+        fprintf(outf, "%10ld %10ld %7.2f%%  %s%s%s\n", dso->samples, dso->spa_samples,
+                percent(dso->spa_samples, dso->samples), dso->path,
+                dso->is_runtime ? " (runtime)" : "", dso->range_cnt ? "" : " (no " SPA_RANGES_SECTION ")");
+        for(long k = 0; k < dso->func_cnt; k++){
+            ref_cnt += dso->funcs[k].samples != 0;
+        }
+    }
+
+    struct FuncRef *refs = malloc((ref_cnt + 1) * sizeof(struct FuncRef));
+    long n = 0;
+    for(long i = 0; i < dso_cnt; i++){
+        for(long k = 0; k < dsos[i]->func_cnt; k++){
+            if(dsos[i]->funcs[k].samples){
+                refs[n].func = &dsos[i]->funcs[k];
+                refs[n].dso = dsos[i];
+                n++;
+            }
+        }
+    }
+    qsort(refs, n, sizeof(struct FuncRef), cmp_func_ref);
+    fprintf(outf, "\n%10s %10s %8s  %s\n", "samples", "FlashStack", "%", "function");
+    for(long k = 0; k < n && k < top; k++){
+        struct FuncInfo *f = refs[k].func;
+        char *path = strdup(refs[k].dso->path);
+        fprintf(outf, "%10ld %10ld %7.2f%%  %s (%s)\n", f->samples, f->spa_samples,
+                percent(f->spa_samples, f->samples), f->name, basename(path));
+        free(path);
+    }
+    free(refs);
+}
+
+int main(int argc, char **argv){
+    long freq = DEF_SAMPLE_FREQ;
+    int top = DEF_TOP_FUNCS;
+    char *out_path = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "+F:n:o:")) > 0){
+        switch(opt){
+        case 'F':
+            freq = atol(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if(optind >= argc || freq <= 0){
+        fprintf(stderr, "\nUsage: %s [-F freq] [-n top] [-o report] -- command [args...]\n\n"
+                        "Build the target with %s=1 first.\n\n", argv[0], SPA_EMIT_RANGES_ENV);
+        exit(1);
+    }
+
+    // the child waits until the event is ready, then enable_on_exec starts sampling
+    int go[2];
+    if(pipe(go) < 0){
+        SPA_ERROR("pipe().");
+    }
+    pid_t pid = fork();
+    if(pid < 0){
+        SPA_ERROR("fork().");
+    }
+    if(pid == 0){
+        char c;
+        close(go[1]);
+        if(read(go[0], &c, 1) != 1){
+            _exit(127);
+        }
+        execvp(argv[optind], argv + optind);
+        fprintf(stderr, "error: unable to execute %s\n", argv[optind]);
+        _exit(127);
+    }
+    close(go[0]);
+
+    open_ring_buffers(pid, freq);
+
+    if(write(go[1], "x", 1) != 1){
+        SPA_ERROR("write().");
+    }
+    close(go[1]);
+
+    // the samples are not reported for the signals sent to the target via the terminal
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    int status = 0;
+    while(waitpid(pid, &status, WNOHANG) != pid){
+        usleep(POLL_INTERVAL_IN_US);
+        drain_ring_buffers();
+    }
+    drain_ring_buffers();
+
+    FILE *outf = stderr;
+    if(out_path && !(outf = fopen(out_path, "w"))){
+        SPA_ERROR("Unable to write %s", out_path);
+    }
+    report(outf, top);
+    if(outf != stderr){
+        fclose(outf);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
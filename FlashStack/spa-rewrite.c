@@ -0,0 +1,975 @@
+/*****************************************************************
+            Instrumenting prebuilt binaries
+
+   spa-rewrite inserts the prologue and epilogue of a mode in
+   spa_modes.h into an uninstrumented x86-64 executable or shared
+   object, so that third-party binaries can be protected without
+   being rebuilt from source.
+
+   The functions are found by their FDEs in .eh_frame, and named by
+   the symbol table if there is one. In every function,
+
+     (1) the instructions covering the first 5 bytes (after endbr64)
+         are replaced by a jmp to a trampoline, which runs the prologue
+         and the displaced instructions, then jumps back;
+
+     (2) every ret and the instructions just before it are replaced
+         in the same way by a trampoline, which runs the displaced
+         instructions and then the epilogue.
+
+   Only the first 5 bytes of such a sequence are overwritten, so a
+   function is left alone if a branch target (direct branches, jump
+   tables and relative relocations) is found inside them, or if the
+   displaced instructions contain a branch. A ret left alone is just
+   not checked. The trampolines are put in a new PT_LOAD segment, in
+   place of a PT_NOTE program header.
+
+   Usage:
+
+        spa-rewrite  [-m mode] [-v]  input  output
+
+   The mode defaults to __SPA_MODE. The runtime library of the mode is
+   not linked into the output, so it has to be preloaded, e.g.,
+
+        LD_PRELOAD=/path/to/libgsrsp.so  ./output
+
+   libgsrsp.so is linked with -z initfirst, so that it is initialized
+   before the constructors of a rewritten shared object run.
+
+******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <gnu/lib-names.h>
+
+#include "spa.h"
+#include "spa_elf.h"
+#include "spa_x86.h"
+#include "spa_modes_gen.h"
+
+#define  SPA_JMP_LEN            5
+#define  SPA_PAGE_SIZE          0x1000UL
+// the entries of a jump table are read until one is out of the function
+#define  MAX_JUMP_TABLE_SIZE    4096
+
+enum{
+    SKIP_NONE = 0,
+    SKIP_NOT_ENTRY,             // a cold part, _start, or a signal frame
+    SKIP_NAME,                  // see skipped_funcs[]
+    SKIP_INSTRUMENTED,
+    SKIP_UNDECODABLE,
+    SKIP_SHORT,                 // a branch in the first 5 bytes
+    SKIP_TARGET,                // a branch target in the first 5 bytes
+    SKIP_OUT_OF_RANGE,
+    SKIP_CNT,
+};
+
+static const char *skip_reasons[SKIP_CNT] = {
+    "", "not a function entry", "skipped by name", "already instrumented",
+    "undecodable", "too short", "branch target in the first 5 bytes", "out of the rel32 range",
+};
+
+/*
+    They might run before the runtime library is initialized,
+    or they are not called as functions.
+ */
+static const char *skipped_funcs[] = {
+    "_start",
+    "_init",
+    "_fini",
+    "__libc_csu_init",
+    "__libc_csu_fini",
+    "frame_dummy",
+    "register_tm_clones",
+    "deregister_tm_clones",
+    "__do_global_dtors_aux",
+    // customized_libc_funcs in afl-as.c
+    "malloc",
+    "free",
+    "malloc_usable_size",
+    "pvalloc",
+    "valloc",
+    "calloc",
+    "realloc",
+    "aligned_alloc",
+    "memalign",
+    "posix_memalign",
+};
+
+// the runtime library calls them before %gs is set
+static const char *runtime_deps[] = {
+    LIBC_SO,
+    LIBPTHREAD_SO,
+    LIBDL_SO,
+    LD_SO,
+};
+
+struct FuncInfo{
+    unsigned long start;
+    unsigned long end;
+    const char *name;
+    int not_entry;
+    int skip;
+};
+
+struct InsnInfo{
+    unsigned long vaddr;
+    struct spa_x86_insn insn;
+};
+
+// overwritten by a jmp to @tramp, and int3 up to @len
+struct Patch{
+    unsigned long vaddr;
+    unsigned long tramp;
+    int len;
+};
+
+static struct spa_elf_file elf;
+static Elf64_Phdr *phdrs;
+static const struct spa_mode *mode;
+static const struct spa_mode_layout *layout;
+static int verbose;
+
+// sorted by start
+static struct FuncInfo *funcs;
+static long func_cnt, func_cap;
+
+// sorted, the possible targets of jumps
+static unsigned long *targets;
+static long target_cnt, target_cap;
+
+static struct InsnInfo *insns;
+static long insn_cnt, insn_cap;
+
+static struct Patch *patches;
+static long patch_cnt, patch_cap;
+
+// the new segment
+static unsigned char *tramp;
+static long tramp_len, tramp_cap;
+static unsigned long tramp_vaddr;
+
+static long func_skipped[SKIP_CNT];
+static long ret_cnt, ret_skipped;
+
+static void *grow_array(void *arr, long *cap, long elem_size){
+    *cap = *cap ? 2 * *cap : 256;
+    arr = realloc(arr, *cap * elem_size);
+    if(!arr){
+        SPA_ERROR("out of memory");
+    }
+    return arr;
+}
+
+// the file contents at @vaddr in a PT_LOAD segment (executable only if @exec), NULL if none
+static unsigned char *image_at(unsigned long vaddr, int exec, unsigned long *avail){
+    for(int i = 0; i < elf.ehdr->e_phnum; i++){
+        Elf64_Phdr *ph = &phdrs[i];
+        if(ph->p_type == PT_LOAD && (!exec || (ph->p_flags & PF_X))
+                && ph->p_vaddr <= vaddr && vaddr < ph->p_vaddr + ph->p_filesz
+                && ph->p_offset + ph->p_filesz <= elf.size){
+            *avail = ph->p_vaddr + ph->p_filesz - vaddr;
+            return elf.img + ph->p_offset + (vaddr - ph->p_vaddr);
+        }
+    }
+    return NULL;
+}
+
+static struct FuncInfo *find_func(unsigned long vaddr){
+    long lo = 0, hi = func_cnt - 1;
+    struct FuncInfo *found = NULL;
+    while(lo <= hi){
+        long mid = (lo + hi) / 2;
+        if(funcs[mid].start <= vaddr){
+            found = &funcs[mid];
+            lo = mid + 1;
+        }else{
+            hi = mid - 1;
+        }
+    }
+    if(found && vaddr < found->end){
+        return found;
+    }
+    return NULL;
+}
+
+static void add_target(unsigned long vaddr){
+    if(target_cnt == target_cap){
+        targets = grow_array(targets, &target_cap, sizeof(unsigned long));
+    }
+    targets[target_cnt++] = vaddr;
+}
+
+// whether a branch target is in (lo, hi)
+static int has_target_inside(unsigned long lo, unsigned long hi){
+    long l = 0, h = target_cnt - 1;
+    while(l <= h){
+        long mid = (l + h) / 2;
+        if(targets[mid] <= lo){
+            l = mid + 1;
+        }else if(targets[mid] >= hi){
+            h = mid - 1;
+        }else{
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int cmp_ulong(const void *a, const void *b){
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_func(const void *a, const void *b){
+    return cmp_ulong(&((const struct FuncInfo *) a)->start, &((const struct FuncInfo *) b)->start);
+}
+
+/************************************ .eh_frame ************************************/
+
+static unsigned long read_uleb(const unsigned char **p, const unsigned char *end){
+    unsigned long val = 0;
+    int shift = 0;
+    while(*p < end){
+        unsigned char b = *(*p)++;
+        if(shift < 64){
+            val |= (unsigned long) (b & 0x7f) << shift;
+        }
+        shift += 7;
+        if(!(b & 0x80)){
+            break;
+        }
+    }
+    return val;
+}
+
+static long read_sleb(const unsigned char **p, const unsigned char *end){
+    long val = 0;
+    int shift = 0;
+    unsigned char b = 0;
+    while(*p < end){
+        b = *(*p)++;
+        if(shift < 64){
+            val |= (long) (b & 0x7f) << shift;
+        }
+        shift += 7;
+        if(!(b & 0x80)){
+            break;
+        }
+    }
+    if(shift < 64 && (b & 0x40)){
+        val |= -(1L << shift);
+    }
+    return val;
+}
+
+// a pointer encoded by @enc (DW_EH_PE_*) at *@p, whose link-time address is @vaddr
+static int read_encoded(const unsigned char **p, const unsigned char *end, int enc,
+                        unsigned long vaddr, unsigned long *val){
+    const unsigned char *q = *p;
+    long v;
+    int size;
+
+    if(enc == 0xff){
+        return -1;
+    }
+    switch(enc & 0x0f){
+    case 0x00: case 0x04: case 0x0c:
+        size = 8;
+        break;
+    case 0x03: case 0x0b:
+        size = 4;
+        break;
+    case 0x02: case 0x0a:
+        size = 2;
+        break;
+    default:
+        return -1;
+    }
+    if(q + size > end){
+        return -1;
+    }
+    if(size == 8){
+        memcpy(&v, q, 8);
+    }else if(size == 4){
+        int x;
+        memcpy(&x, q, 4);
+        v = (enc & 0x08) ? (long) x : (long) (unsigned) x;
+    }else{
+        short x;
+        memcpy(&x, q, 2);
+        v = (enc & 0x08) ? (long) x : (long) (unsigned short) x;
+    }
+    switch(enc & 0x70){
+    case 0x00:
+        break;
+    case 0x10:
+        v += vaddr;
+        break;
+    default:
+        return -1;
+    }
+    *p = q + size;
+    *val = v;
+    return 0;
+}
+
+/*
+    Run the call frame instructions until the first DW_CFA_advance_loc,
+    return -1 if they define the CFA other than %rsp + @cfa_off, or the return address is undefined.
+ */
+static int check_initial_cfa(const unsigned char *p, const unsigned char *end, long cfa_off){
+    while(p < end){
+        unsigned char op = *p++;
+        unsigned long reg, off;
+        switch(op & 0xc0){
+        case 0x40:              // DW_CFA_advance_loc
+            return 0;
+        case 0x80:              // DW_CFA_offset
+            read_uleb(&p, end);
+            continue;
+        case 0xc0:              // DW_CFA_restore
+            continue;
+        }
+        switch(op){
+        case 0x00:              // DW_CFA_nop
+            break;
+        case 0x02: case 0x03: case 0x04:
+            return 0;
+        case 0x0c:              // DW_CFA_def_cfa
+            reg = read_uleb(&p, end);
+            off = read_uleb(&p, end);
+            if(reg != 7 || off != (unsigned long) cfa_off){
+                return -1;
+            }
+            break;
+        case 0x05: case 0x09:   // DW_CFA_offset_extended, DW_CFA_register
+            read_uleb(&p, end);
+            read_uleb(&p, end);
+            break;
+        case 0x11:              // DW_CFA_offset_extended_sf
+            read_uleb(&p, end);
+            read_sleb(&p, end);
+            break;
+        case 0x06: case 0x08:   // DW_CFA_restore_extended, DW_CFA_same_value
+            read_uleb(&p, end);
+            break;
+        case 0x07:              // DW_CFA_undefined
+            if(read_uleb(&p, end) == 16){
+                return -1;
+            }
+            break;
+        default:
+            // DW_CFA_def_cfa_offset, DW_CFA_def_cfa_register, DW_CFA_def_cfa_expression, ...
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct CieInfo{
+    int fde_enc;
+    int has_aug_data;
+    int ok;                     // the CFA is %rsp + 8, and it is not a signal frame
+};
+
+static int parse_cie(const unsigned char *p, const unsigned char *end, struct CieInfo *cie){
+    memset(cie, 0, sizeof(*cie));
+    if(p >= end){
+        return -1;
+    }
+    int version = *p++;
+    const char *aug = (const char *) p;
+    while(p < end && *p){
+        p++;
+    }
+    if(p++ >= end){
+        return -1;
+    }
+    if(strchr(aug, 'e')){
+        // the old "eh" augmentation
+        return -1;
+    }
+    read_uleb(&p, end);         // code alignment
+    read_sleb(&p, end);         // data alignment
+    if(version == 1){
+        p++;
+    }else{
+        read_uleb(&p, end);
+    }
+    const unsigned char *insns = p;
+    int signal_frame = 0;
+    if(aug[0] == 'z'){
+        unsigned long len = read_uleb(&p, end);
+        insns = p + len;
+        cie->has_aug_data = 1;
+        for(const char *a = aug + 1; *a && p < insns; a++){
+            unsigned long tmp;
+            switch(*a){
+            case 'R':
+                cie->fde_enc = *p++;
+                break;
+            case 'L':
+                p++;
+                break;
+            case 'P':{
+                // only skipped, the personality routine is not needed
+                int enc = *p++;
+                if(read_encoded(&p, insns, enc & 0x0f, 0, &tmp) < 0){
+                    return -1;
+                }
+                break;
+            }
+            case 'S':
+                signal_frame = 1;
+                break;
+            default:
+                break;
+            }
+        }
+    }else if(aug[0]){
+        return -1;
+    }
+    cie->ok = !signal_frame && check_initial_cfa(insns, end, 8) == 0;
+    return 0;
+}
+
+static void add_func(unsigned long start, unsigned long size, int not_entry){
+    if(func_cnt == func_cap){
+        funcs = grow_array(funcs, &func_cap, sizeof(struct FuncInfo));
+    }
+    struct FuncInfo *f = &funcs[func_cnt++];
+    memset(f, 0, sizeof(*f));
+    f->start = start;
+    f->end = start + size;
+    f->not_entry = not_entry;
+}
+
+// a function per FDE
+static void collect_funcs_from_eh_frame(void){
+    Elf64_Shdr *sec = spa_elf_find_section(&elf, ".eh_frame");
+    unsigned char *data = sec ? spa_elf_section_data(&elf, sec) : NULL;
+    if(!data){
+        SPA_ERROR("no .eh_frame in %s", elf.path);
+    }
+    unsigned char *p = data, *end = data + sec->sh_size;
+    while(p + 4 <= end){
+        unsigned long len;
+        unsigned int len32;
+        memcpy(&len32, p, 4);
+        p += 4;
+        len = len32;
+        if(len32 == 0xffffffff){
+            if(p + 8 > end){
+                break;
+            }
+            memcpy(&len, p, 8);
+            p += 8;
+        }
+        if(!len){
+            break;
+        }
+        unsigned char *rec_end = p + len;
+        if(rec_end > end || p + 4 > rec_end){
+            break;
+        }
+        unsigned int id;
+        memcpy(&id, p, 4);
+        if(id){
+            // FDE, id is the distance to its CIE
+            unsigned char *cie_rec = p - id;
+            struct CieInfo cie;
+            unsigned int cie_len;
+            if(cie_rec < data || cie_rec + 8 > end){
+                p = rec_end;
+                continue;
+            }
+            memcpy(&cie_len, cie_rec, 4);
+            if(cie_len == 0xffffffff || cie_rec + 4 + cie_len > end
+                    || parse_cie(cie_rec + 8, cie_rec + 4 + cie_len, &cie) < 0){
+                p = rec_end;
+                continue;
+            }
+            const unsigned char *q = p + 4;
+            unsigned long start, size;
+            if(read_encoded(&q, rec_end, cie.fde_enc, sec->sh_addr + (q - data), &start) < 0
+                    || read_encoded(&q, rec_end, cie.fde_enc & 0x0f, 0, &size) < 0){
+                p = rec_end;
+                continue;
+            }
+            if(cie.has_aug_data){
+                unsigned long aug_len = read_uleb(&q, rec_end);
+                q += aug_len;
+            }
+            if(size && start){
+                add_func(start, size, !cie.ok || q > rec_end || check_initial_cfa(q, rec_end, 8) < 0);
+            }
+        }
+        p = rec_end;
+    }
+    qsort(funcs, func_cnt, sizeof(struct FuncInfo), cmp_func);
+}
+
+static int name_func(Elf64_Sym *sym, const char *name, void *arg){
+    if(!strcmp(name, "init_main_shadow_stack")){
+        SPA_ERROR("%s is already linked with a FlashStack runtime library", elf.path);
+    }
+    if(ELF64_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_shndx == SHN_UNDEF || !sym->st_value){
+        return 0;
+    }
+    struct FuncInfo *f = find_func(sym->st_value);
+    if(f && f->start == sym->st_value && (!f->name || ELF64_ST_BIND(sym->st_info) == STB_GLOBAL)){
+        f->name = name;
+    }
+    return 0;
+}
+
+/************************************ branch targets ************************************/
+
+// the entries of a possible jump table at @table, kept only while they are in @f
+static void add_jump_table(unsigned long table, struct FuncInfo *f, int entry_size){
+    unsigned long avail;
+    unsigned char *p = image_at(table, 0, &avail);
+    for(long i = 0; p && i < MAX_JUMP_TABLE_SIZE && (i + 1) * entry_size <= (long) avail; i++){
+        unsigned long target;
+        if(entry_size == 4){
+            int rel;
+            memcpy(&rel, p + i * 4, 4);
+            target = table + (long) rel;
+        }else{
+            memcpy(&target, p + i * 8, 8);
+        }
+        if(target <= f->start || target >= f->end){
+            break;
+        }
+        add_target(target);
+    }
+}
+
+// decode @f into insns[], return -1 if some instruction is not known
+static int decode_func(struct FuncInfo *f){
+    unsigned long avail;
+    unsigned char *code = image_at(f->start, 1, &avail);
+    insn_cnt = 0;
+    if(!code || avail < f->end - f->start){
+        return -1;
+    }
+    unsigned char *end = code + (f->end - f->start);
+    for(unsigned char *p = code; p < end; ){
+        if(insn_cnt == insn_cap){
+            insns = grow_array(insns, &insn_cap, sizeof(struct InsnInfo));
+        }
+        struct InsnInfo *ii = &insns[insn_cnt];
+        if(spa_x86_decode(p, end, &ii->insn) < 0){
+            return -1;
+        }
+        ii->vaddr = f->start + (p - code);
+        insn_cnt++;
+        p += ii->insn.len;
+    }
+    return 0;
+}
+
+static void collect_targets(void){
+    for(long i = 0; i < func_cnt; i++){
+        struct FuncInfo *f = &funcs[i];
+        if(decode_func(f) < 0){
+            f->skip = SKIP_UNDECODABLE;
+            continue;
+        }
+        unsigned long avail;
+        unsigned char *code = image_at(f->start, 1, &avail);
+        for(long k = 0; k < insn_cnt; k++){
+            struct spa_x86_insn *in = &insns[k].insn;
+            unsigned char *p = code + (insns[k].vaddr - f->start);
+            if(in->kind == SPA_X86_JMP || in->kind == SPA_X86_JCC || in->kind == SPA_X86_CALL){
+                add_target(insns[k].vaddr + in->target);
+            }
+            if(in->modrm_off < 0){
+                continue;
+            }
+            int disp;
+            unsigned char modrm = p[in->modrm_off];
+            if(in->rip_rel){
+                // lea table(%rip), %reg;  movslq (%reg, %idx, 4), %idx;  add %reg, %idx;  jmp *%idx
+                memcpy(&disp, p + in->modrm_off + 1, 4);
+                unsigned long addr = insns[k].vaddr + in->len + (long) disp;
+                if(!find_func(addr)){
+                    add_jump_table(addr, f, 4);
+                }
+            }else if((modrm >> 6) == 0 && (modrm & 7) == 4 && (p[in->modrm_off + 1] & 7) == 5
+                        && (p[in->modrm_off + 1] >> 6) == 3){
+                // jmp *table(, %idx, 8) in non-PIC code
+                memcpy(&disp, p + in->modrm_off + 2, 4);
+                add_jump_table((unsigned long) (long) disp, f, 8);
+            }
+        }
+    }
+
+    // code addresses in data, e.g., the labels taken by computed gotos
+    for(int i = 0; elf.shdrs && i < elf.ehdr->e_shnum; i++){
+        Elf64_Shdr *sec = &elf.shdrs[i];
+        Elf64_Rela *relas = sec->sh_type == SHT_RELA ? (Elf64_Rela *) spa_elf_section_data(&elf, sec) : NULL;
+        for(unsigned long k = 0; relas && k < sec->sh_size / sizeof(Elf64_Rela); k++){
+            if(ELF64_R_TYPE(relas[k].r_info) == R_X86_64_RELATIVE){
+                add_target(relas[k].r_addend);
+            }
+        }
+    }
+
+    qsort(targets, target_cnt, sizeof(unsigned long), cmp_ulong);
+}
+
+/************************************ trampolines ************************************/
+
+static void tramp_reserve(long len){
+    while(tramp_len + len > tramp_cap){
+        tramp = grow_array(tramp, &tramp_cap, 1);
+    }
+}
+
+static int fits_rel32(long v){
+    return v == (long) (int) v;
+}
+
+static int emit_jmp(unsigned long to){
+    long rel = (long) (to - (tramp_vaddr + tramp_len + SPA_JMP_LEN));
+    if(!fits_rel32(rel)){
+        return -1;
+    }
+    int rel32 = rel;
+    tramp_reserve(SPA_JMP_LEN);
+    tramp[tramp_len] = 0xe9;
+    memcpy(tramp + tramp_len + 1, &rel32, 4);
+    tramp_len += SPA_JMP_LEN;
+    return 0;
+}
+
+static void emit_bytes(const void *bytes, long len){
+    tramp_reserve(len);
+    memcpy(tramp + tramp_len, bytes, len);
+    tramp_len += len;
+}
+
+// copy insns[first, last) to the trampoline, return -1 if a rip-relative operand is out of range
+static int emit_insns(long first, long last){
+    for(long k = first; k < last; k++){
+        struct InsnInfo *ii = &insns[k];
+        unsigned long avail;
+        unsigned char *code = image_at(ii->vaddr, 1, &avail);
+        unsigned long new_vaddr = tramp_vaddr + tramp_len;
+        emit_bytes(code, ii->insn.len);
+        if(ii->insn.rip_rel){
+            int disp;
+            unsigned char *p = tramp + tramp_len - ii->insn.len + ii->insn.modrm_off + 1;
+            memcpy(&disp, p, 4);
+            long new_disp = (long) disp + (long) (ii->vaddr - new_vaddr);
+            if(!fits_rel32(new_disp)){
+                return -1;
+            }
+            disp = new_disp;
+            memcpy(p, &disp, 4);
+        }
+    }
+    return 0;
+}
+
+static void add_patch(unsigned long vaddr, unsigned long to, int len){
+    if(patch_cnt == patch_cap){
+        patches = grow_array(patches, &patch_cap, sizeof(struct Patch));
+    }
+    patches[patch_cnt].vaddr = vaddr;
+    patches[patch_cnt].tramp = to;
+    patches[patch_cnt].len = len;
+    patch_cnt++;
+}
+
+// the number of bytes from insns[first] to the end of the instruction covering its first 5 bytes
+static int patch_len(long first){
+    unsigned long start = insns[first].vaddr;
+    long k = first;
+    while(insns[k].vaddr + insns[k].insn.len < start + SPA_JMP_LEN){
+        k++;
+    }
+    return insns[k].vaddr + insns[k].insn.len - start;
+}
+
+static int is_skipped_name(const char *name){
+    if(!name){
+        return 0;
+    }
+    if(strstr(name, ".cold")){
+        return 1;
+    }
+    for(unsigned long i = 0; i < sizeof(skipped_funcs) / sizeof(skipped_funcs[0]); i++){
+        if(!strcmp(name, skipped_funcs[i])){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void instrument_rets(struct FuncInfo *f, long body){
+    for(long r = body; r < insn_cnt; r++){
+        if(insns[r].insn.kind != SPA_X86_RET){
+            continue;
+        }
+        ret_cnt++;
+        // the instructions before the ret covering at least 5 bytes
+        long first = r;
+        long len = insns[r].insn.len;
+        while(len < SPA_JMP_LEN && first > body && insns[first - 1].insn.kind == SPA_X86_OTHER){
+            first--;
+            len += insns[first].insn.len;
+        }
+        unsigned long start = insns[first].vaddr;
+        long saved_len = tramp_len;
+        if(len < SPA_JMP_LEN || has_target_inside(start, start + SPA_JMP_LEN)
+                || emit_insns(first, r) < 0){
+            tramp_len = saved_len;
+            ret_skipped++;
+            if(verbose){
+                fprintf(stderr, "  ret at 0x%lx in %s is not instrumented\n",
+                        insns[r].vaddr, f->name ? f->name : "?");
+            }
+            continue;
+        }
+        emit_bytes(layout->epilogue_code, layout->epilogue_len);
+        add_patch(start, tramp_vaddr + saved_len, patch_len(first));
+    }
+}
+
+static void instrument_func(struct FuncInfo *f){
+    if(f->not_entry){
+        f->skip = SKIP_NOT_ENTRY;
+    }else if(is_skipped_name(f->name)){
+        f->skip = SKIP_NAME;
+    }
+    if(f->skip || decode_func(f) < 0){
+        return;
+    }
+
+    long first = 0;
+    unsigned long avail;
+    unsigned char *code = image_at(f->start, 1, &avail);
+    if(insn_cnt > 0 && insns[0].insn.len == 4 && !memcmp(code, "\xf3\x0f\x1e\xfa", 4)){
+        // endbr64 stays at the entry
+        first = 1;
+    }
+    if(first < insn_cnt && f->end - insns[first].vaddr >= (unsigned long) layout->prologue_len
+            && !memcmp(code + (insns[first].vaddr - f->start), layout->prologue_code, layout->prologue_len)){
+        f->skip = SKIP_INSTRUMENTED;
+        return;
+    }
+    long body = first, len = 0;
+    while(len < SPA_JMP_LEN && body < insn_cnt && insns[body].insn.kind == SPA_X86_OTHER){
+        len += insns[body].insn.len;
+        body++;
+    }
+    if(len < SPA_JMP_LEN){
+        f->skip = SKIP_SHORT;
+        return;
+    }
+    unsigned long start = insns[first].vaddr;
+    if(has_target_inside(start, start + SPA_JMP_LEN)){
+        f->skip = SKIP_TARGET;
+        return;
+    }
+    long saved_len = tramp_len;
+    emit_bytes(layout->prologue_code, layout->prologue_len);
+    if(emit_insns(first, body) < 0 || emit_jmp(insns[body - 1].vaddr + insns[body - 1].insn.len) < 0){
+        tramp_len = saved_len;
+        f->skip = SKIP_OUT_OF_RANGE;
+        return;
+    }
+    add_patch(start, tramp_vaddr + saved_len, patch_len(first));
+    instrument_rets(f, body);
+}
+
+/************************************ output ************************************/
+
+// the PT_NOTE to be replaced by the PT_LOAD of the trampolines
+static Elf64_Phdr *find_free_phdr(void){
+    Elf64_Phdr *found = NULL, *prop = NULL;
+    int last_load = -1;
+    for(int i = 0; i < elf.ehdr->e_phnum; i++){
+        if(phdrs[i].p_type == PT_LOAD){
+            last_load = i;
+        }else if(phdrs[i].p_type == PT_GNU_PROPERTY){
+            prop = &phdrs[i];
+        }
+    }
+    // the PT_LOADs are kept in the ascending order of p_vaddr
+    for(int i = last_load + 1; i < elf.ehdr->e_phnum; i++){
+        if(phdrs[i].p_type == PT_NOTE && (!found || !prop || phdrs[i].p_offset != prop->p_offset)){
+            found = &phdrs[i];
+        }
+    }
+    return found;
+}
+
+static void write_output(const char *path, Elf64_Phdr *note){
+    unsigned long file_end = (elf.size + SPA_PAGE_SIZE - 1) & ~(SPA_PAGE_SIZE - 1);
+    unsigned char *img = calloc(file_end + tramp_len, 1);
+    if(!img){
+        SPA_ERROR("out of memory");
+    }
+    memcpy(img, elf.img, elf.size);
+    memcpy(img + file_end, tramp, tramp_len);
+
+    Elf64_Phdr *ph = (Elf64_Phdr *) (img + elf.ehdr->e_phoff) + (note - phdrs);
+    ph->p_type = PT_LOAD;
+    ph->p_flags = PF_R | PF_X;
+    ph->p_offset = file_end;
+    ph->p_vaddr = ph->p_paddr = tramp_vaddr;
+    ph->p_filesz = ph->p_memsz = tramp_len;
+    ph->p_align = SPA_PAGE_SIZE;
+
+    for(long i = 0; i < patch_cnt; i++){
+        unsigned long avail;
+        unsigned char *p = img + (image_at(patches[i].vaddr, 1, &avail) - elf.img);
+        int rel32 = patches[i].tramp - (patches[i].vaddr + SPA_JMP_LEN);
+        p[0] = 0xe9;
+        memcpy(p + 1, &rel32, 4);
+        memset(p + SPA_JMP_LEN, 0xcc, patches[i].len - SPA_JMP_LEN);
+    }
+
+    struct stat st;
+    if(fstat(elf.fd, &st) < 0){
+        SPA_ERROR("fstat(%s).", elf.path);
+    }
+    char *tmp_path = malloc(strlen(path) + 16);
+    sprintf(tmp_path, "%s.spa-rewrite", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+    if(fd < 0){
+        SPA_ERROR("Unable to write %s", tmp_path);
+    }
+    unsigned long done = 0, total = file_end + tramp_len;
+    while(done < total){
+        ssize_t n = write(fd, img + done, total - done);
+        if(n <= 0){
+            unlink(tmp_path);
+            SPA_ERROR("write(%s): %s", tmp_path, strerror(errno));
+        }
+        done += n;
+    }
+    close(fd);
+    if(rename(tmp_path, path) < 0){
+        unlink(tmp_path);
+        SPA_ERROR("Unable to rename %s to %s", tmp_path, path);
+    }
+    free(tmp_path);
+    free(img);
+}
+
+int main(int argc, char **argv){
+    char *mode_name = getenv(SPA_MODE_ENV);
+    int opt;
+
+    while((opt = getopt(argc, argv, "m:v")) > 0){
+        switch(opt){
+        case 'm':
+            mode_name = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if(optind + 2 != argc){
+        fprintf(stderr, "\nUsage: %s [-m mode] [-v] input output\n\n", argv[0]);
+        exit(1);
+    }
+    mode = spa_find_mode(mode_name);
+    if(!mode){
+        SPA_ERROR("Unknown instrumentation mode '%s'", mode_name);
+    }
+    layout = &spa_mode_layouts[mode - spa_modes];
+    if(!layout->prologue_code || !layout->epilogue_code){
+        SPA_ERROR("the prologue/epilogue of %s needs relocation, which is not supported", mode->name);
+    }
+
+    if(spa_elf_open(&elf, argv[optind], 0) < 0){
+        SPA_ERROR("%s is not an x86-64 ELF file", argv[optind]);
+    }
+    if((elf.ehdr->e_type != ET_EXEC && elf.ehdr->e_type != ET_DYN) || !elf.ehdr->e_phoff
+            || elf.ehdr->e_phoff + elf.ehdr->e_phnum * sizeof(Elf64_Phdr) > elf.size){
+        SPA_ERROR("%s is neither an executable nor a shared object", elf.path);
+    }
+    phdrs = (Elf64_Phdr *) (elf.img + elf.ehdr->e_phoff);
+
+    int has_dynamic = 0;
+    unsigned long max_vaddr = 0;
+    for(int i = 0; i < elf.ehdr->e_phnum; i++){
+        if(phdrs[i].p_type == PT_DYNAMIC){
+            unsigned long strtab = 0, soname = 0, avail;
+            has_dynamic = 1;
+            Elf64_Dyn *dyn = (Elf64_Dyn *) (elf.img + phdrs[i].p_offset);
+            for(unsigned long k = 0; k < phdrs[i].p_filesz / sizeof(Elf64_Dyn) && dyn[k].d_tag != DT_NULL; k++){
+                if(dyn[k].d_tag == DT_TEXTREL || (dyn[k].d_tag == DT_FLAGS && (dyn[k].d_un.d_val & DF_TEXTREL))){
+                    SPA_ERROR("%s has relocations in its code", elf.path);
+                }else if(dyn[k].d_tag == DT_STRTAB){
+                    strtab = dyn[k].d_un.d_ptr;
+                }else if(dyn[k].d_tag == DT_SONAME){
+                    soname = dyn[k].d_un.d_val + 1;
+                }
+            }
+            const char *name = soname && strtab ? (const char *) image_at(strtab + soname - 1, 0, &avail) : NULL;
+            for(unsigned long k = 0; name && k < sizeof(runtime_deps) / sizeof(runtime_deps[0]); k++){
+                if(!strcmp(name, runtime_deps[k])){
+                    SPA_ERROR("%s is used by the runtime library before it is initialized", elf.path);
+                }
+            }
+        }
+        if(phdrs[i].p_type == PT_LOAD && phdrs[i].p_vaddr + phdrs[i].p_memsz > max_vaddr){
+            max_vaddr = phdrs[i].p_vaddr + phdrs[i].p_memsz;
+        }
+    }
+    if(!has_dynamic && mode->rt_lib){
+        SPA_ERROR("%s is statically linked, so lib%s.so cannot be preloaded", elf.path, mode->rt_lib);
+    }
+    Elf64_Phdr *note = find_free_phdr();
+    if(!note){
+        SPA_ERROR("no PT_NOTE in %s can be used for the trampolines", elf.path);
+    }
+    tramp_vaddr = (max_vaddr + SPA_PAGE_SIZE - 1) & ~(SPA_PAGE_SIZE - 1);
+
+    collect_funcs_from_eh_frame();
+    spa_elf_for_each_symbol(&elf, spa_elf_find_symtab(&elf), name_func, NULL);
+    collect_targets();
+
+    long instrumented = 0;
+    for(long i = 0; i < func_cnt; i++){
+        instrument_func(&funcs[i]);
+        func_skipped[funcs[i].skip]++;
+        if(!funcs[i].skip){
+            instrumented++;
+        }else if(verbose){
+            fprintf(stderr, "  0x%lx %s: %s\n", funcs[i].start,
+                    funcs[i].name ? funcs[i].name : "?", skip_reasons[funcs[i].skip]);
+        }
+    }
+    if(!instrumented){
+        SPA_ERROR("no function in %s can be instrumented", elf.path);
+    }
+    write_output(argv[optind + 1], note);
+
+    fprintf(stderr, "[+] Instrumented %ld of %ld functions and %ld of %ld rets (%s mode).\n",
+            instrumented, func_cnt, ret_cnt - ret_skipped, ret_cnt, mode->name);
+    for(int i = 1; i < SKIP_CNT; i++){
+        if(func_skipped[i]){
+            fprintf(stderr, "    %ld functions skipped: %s\n", func_skipped[i], skip_reasons[i]);
+        }
+    }
+    if(mode->rt_lib){
+        fprintf(stderr, "[*] Run it with LD_PRELOAD=%s/lib%s.so\n", DEFAULT_BUDDY_STACK_SIZE_LIB_PATH, mode->rt_lib);
+    }
+    spa_elf_close(&elf);
+    return 0;
+}
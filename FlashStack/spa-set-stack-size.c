@@ -0,0 +1,471 @@
+/*****************************************************************
+            Changing the call stack size of buddy-tls binaries
+
+   In the buddy-tls mode, the size of the call stack (x) is encoded in
+   the immediates of every prologue and epilogue (-x and -2x). This tool
+   is the native replacement for code_rewriter.py, which rewrites them
+   in the executables and shared objects of an install tree.
+
+   In the buddy-tls-stk-size modes, -x is kept in the global variable
+   .BUDDY.CALL_STACK_SIZE_MASK (see weak_stack_size.s) instead. It is
+   located by its symbol and patched at the file offset of its section,
+   as the native replacement for data_rewriter.py. The three magic numbers
+   after it are checked before it is written.
+
+   Only the executable sections are scanned, with SSE2 for the first
+   three bytes shared by the prologue and the epilogue. If there is a
+   symbol table, a prologue must be at the start of a function (or right
+   after endbr64) and an epilogue inside a function, otherwise the match
+   is reported and left alone. The files are patched in place, in
+   parallel.
+
+   Usage:
+
+        spa-set-stack-size  [-j jobs] [-v]  orig_kb  new_kb  path...
+
+   e.g., spa-set-stack-size 8192 4096 ./firefox-install
+
+   A path can be a file or a directory. The sizes are in KB, to be
+   consistent with 'ulimit -s'.
+
+******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <emmintrin.h>
+#include <sys/resource.h>
+
+#include "spa.h"
+#include "spa_elf.h"
+#include "spa_modes_gen.h"
+
+#define  SPA_BUDDY_TLS_MODE     "buddy-tls"
+
+struct Pattern{
+    // the code for orig_kb
+    unsigned char bytes[SPA_MAX_MODE_CODE_LEN];
+    int len;
+    // the offsets of the immediates -x and -2x
+    int x_offs[4], x_cnt;
+    int x2_offs[4], x2_cnt;
+};
+
+struct SymRange{
+    unsigned long start;
+    unsigned long end;
+};
+
+struct SymTable{
+    struct SymRange *ranges;
+    long cnt, cap;
+};
+
+struct FileResult{
+    long prologues;
+    long epilogues;
+    long suspicious;
+    // 1 if the global stack size is rewritten, -1 if it is not as expected
+    int mask;
+};
+
+static struct Pattern prologue, epilogue;
+static long orig_size, new_size;
+static int verbose;
+
+static char **files;
+static long file_cnt, file_cap;
+static long next_file;
+static long total_files, total_patched;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *grow_array(void *arr, long *cap, long elem_size){
+    *cap = *cap ? 2 * *cap : 256;
+    arr = realloc(arr, *cap * elem_size);
+    if(!arr){
+        SPA_ERROR("out of memory");
+    }
+    return arr;
+}
+
+static int get_int(const unsigned char *p){
+    int x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static void put_int(unsigned char *p, long v){
+    int x = v;
+    memcpy(p, &x, sizeof(x));
+}
+
+// write the immediates for the call stack size @x at @p
+static void set_size(struct Pattern *pat, unsigned char *p, long x){
+    for(int i = 0; i < pat->x_cnt; i++){
+        put_int(p + pat->x_offs[i], -x);
+    }
+    for(int i = 0; i < pat->x2_cnt; i++){
+        put_int(p + pat->x2_offs[i], -2 * x);
+    }
+}
+
+/*
+    The code of buddy-tls generated by spa-gen-modes is for the default size,
+    so the immediates are where -DEF_BUDDY_CALL_STACK_SIZE and its double are.
+ */
+static void init_pattern(struct Pattern *pat, const char *code, int len){
+    memset(pat, 0, sizeof(*pat));
+    if(!code || len > SPA_MAX_MODE_CODE_LEN || len < 3){
+        SPA_ERROR("the code of %s is not known", SPA_BUDDY_TLS_MODE);
+    }
+    memcpy(pat->bytes, code, len);
+    pat->len = len;
+    for(int i = 0; i + 4 <= len; i++){
+        int v = get_int(pat->bytes + i);
+        if(v == (int) -DEF_BUDDY_CALL_STACK_SIZE && pat->x_cnt < 4){
+            pat->x_offs[pat->x_cnt++] = i;
+            i += 3;
+        }else if(v == (int) (-2 * DEF_BUDDY_CALL_STACK_SIZE) && pat->x2_cnt < 4){
+            pat->x2_offs[pat->x2_cnt++] = i;
+            i += 3;
+        }
+    }
+    if(!pat->x_cnt || !pat->x2_cnt){
+        SPA_ERROR("the immediates are not found in the code of %s", SPA_BUDDY_TLS_MODE);
+    }
+    set_size(pat, pat->bytes, orig_size);
+}
+
+static int cmp_range(const void *a, const void *b){
+    const struct SymRange *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int collect_range(Elf64_Sym *sym, const char *name, void *arg){
+    struct SymTable *tab = arg;
+    if(ELF64_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_shndx == SHN_UNDEF || !sym->st_value){
+        return 0;
+    }
+    if(tab->cnt == tab->cap){
+        tab->ranges = grow_array(tab->ranges, &tab->cap, sizeof(struct SymRange));
+    }
+    tab->ranges[tab->cnt].start = sym->st_value;
+    tab->ranges[tab->cnt].end = sym->st_value + sym->st_size;
+    tab->cnt++;
+    return 0;
+}
+
+// the function containing @vaddr, NULL if none
+static struct SymRange *find_range(struct SymTable *tab, unsigned long vaddr){
+    long lo = 0, hi = tab->cnt - 1, found = -1;
+    while(lo <= hi){
+        long mid = (lo + hi) / 2;
+        if(tab->ranges[mid].start <= vaddr){
+            found = mid;
+            lo = mid + 1;
+        }else{
+            hi = mid - 1;
+        }
+    }
+    // aliases share the same start, but perhaps not the same size
+    for(; found >= 0; found--){
+        if(vaddr < tab->ranges[found].end){
+            return &tab->ranges[found];
+        }
+        if(!found || tab->ranges[found - 1].start != tab->ranges[found].start){
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+    Whether the match at @vaddr is where afl-as puts a prologue/epilogue.
+    Without .symtab, the functions are not known, so every match is taken.
+ */
+static int check_boundary(struct SymTable *tab, struct Pattern *pat, unsigned long vaddr,
+                          const unsigned char *p, const unsigned char *sec_start){
+    if(!tab->cnt){
+        return 1;
+    }
+    struct SymRange *r = find_range(tab, vaddr);
+    if(!r || vaddr + pat->len > r->end){
+        return 0;
+    }
+    if(pat != &prologue){
+        return 1;
+    }
+    return r->start == vaddr
+            || (r->start + 4 == vaddr && p - 4 >= sec_start && !memcmp(p - 4, "\xf3\x0f\x1e\xfa", 4));
+}
+
+// the offsets in [i, i + 16) where both patterns might begin
+static unsigned scan_16_bytes(const unsigned char *code, size_t i, size_t len){
+    unsigned mask = 0;
+    if(i + 16 + 2 <= len){
+        const __m128i b0 = _mm_set1_epi8(prologue.bytes[0]);
+        const __m128i b1 = _mm_set1_epi8(prologue.bytes[1]);
+        const __m128i p2 = _mm_set1_epi8(prologue.bytes[2]);
+        const __m128i e2 = _mm_set1_epi8(epilogue.bytes[2]);
+        __m128i x = _mm_loadu_si128((const __m128i *) (code + i));
+        __m128i y = _mm_loadu_si128((const __m128i *) (code + i + 1));
+        __m128i z = _mm_loadu_si128((const __m128i *) (code + i + 2));
+        __m128i m = _mm_and_si128(_mm_cmpeq_epi8(x, b0), _mm_cmpeq_epi8(y, b1));
+        m = _mm_and_si128(m, _mm_or_si128(_mm_cmpeq_epi8(z, p2), _mm_cmpeq_epi8(z, e2)));
+        return _mm_movemask_epi8(m);
+    }
+    for(size_t k = 0; k < 16 && i + k + 2 < len; k++){
+        const unsigned char *p = code + i + k;
+        if(p[0] == prologue.bytes[0] && p[1] == prologue.bytes[1]
+                && (p[2] == prologue.bytes[2] || p[2] == epilogue.bytes[2])){
+            mask |= 1U << k;
+        }
+    }
+    return mask;
+}
+
+static void patch_section(struct spa_elf_file *elf, Elf64_Shdr *sec, struct SymTable *tab,
+                          struct FileResult *res){
+    unsigned char *code = spa_elf_section_data(elf, sec);
+    size_t len = sec->sh_size, next = 0;
+    if(!code){
+        return;
+    }
+    for(size_t i = 0; i < len; i += 16){
+        unsigned mask = scan_16_bytes(code, i, len);
+        while(mask){
+            size_t off = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if(off < next){
+                continue;
+            }
+            unsigned char *p = code + off;
+            struct Pattern *pat = NULL;
+            if(off + prologue.len <= len && !memcmp(p, prologue.bytes, prologue.len)){
+                pat = &prologue;
+            }else if(off + epilogue.len <= len && !memcmp(p, epilogue.bytes, epilogue.len)){
+                pat = &epilogue;
+            }else{
+                continue;
+            }
+            if(!check_boundary(tab, pat, sec->sh_addr + off, p, code)){
+                res->suspicious++;
+                if(verbose){
+                    pthread_mutex_lock(&output_lock);
+                    fprintf(stderr, "  %s: 0x%lx is not at a function boundary, left alone\n",
+                            elf->path, sec->sh_addr + off);
+                    pthread_mutex_unlock(&output_lock);
+                }
+                continue;
+            }
+            set_size(pat, p, new_size);
+            if(pat == &prologue){
+                res->prologues++;
+            }else{
+                res->epilogues++;
+            }
+            next = off + pat->len;
+        }
+    }
+}
+
+static int find_mask_sym(Elf64_Sym *sym, const char *name, void *arg){
+    if(sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE
+            || strcmp(name, SPA_GLOBAL_STACK_SIZE_SYM)){
+        return 0;
+    }
+    *(Elf64_Sym **) arg = sym;
+    return 1;
+}
+
+/*
+    Rewrite -x in the definition of .BUDDY.CALL_STACK_SIZE_MASK, if any.
+    A stripped file still has it in .dynsym, as it is a weak global symbol.
+ */
+static void patch_mask(struct spa_elf_file *elf, Elf64_Shdr *symtab, struct FileResult *res){
+    Elf64_Sym *sym = NULL;
+    Elf64_Shdr *dynsym = spa_elf_find_section(elf, ".dynsym");
+
+    spa_elf_for_each_symbol(elf, symtab, find_mask_sym, &sym);
+    if(!sym && dynsym != symtab){
+        spa_elf_for_each_symbol(elf, dynsym, find_mask_sym, &sym);
+    }
+    if(!sym){
+        return;
+    }
+    if(sym->st_shndx >= elf->ehdr->e_shnum){
+        res->mask = -1;
+        return;
+    }
+    Elf64_Shdr *sec = &elf->shdrs[sym->st_shndx];
+    unsigned char *data = spa_elf_section_data(elf, sec);
+    long words[4];
+    if(sec->sh_type != SHT_PROGBITS || !data
+            || sym->st_value < sec->sh_addr || sym->st_value - sec->sh_addr + sizeof(words) > sec->sh_size){
+        res->mask = -1;
+        return;
+    }
+    unsigned char *p = data + (sym->st_value - sec->sh_addr);
+    memcpy(words, p, sizeof(words));
+    for(int i = 1; i < 4; i++){
+        if(words[i] != SPA_GLOBAL_STACK_SIZE_MAGIC_NUM){
+            res->mask = -1;
+            return;
+        }
+    }
+    if(words[0] != -orig_size && words[0] != -new_size){
+        res->mask = -1;
+        return;
+    }
+    words[0] = -new_size;
+    memcpy(p, words, sizeof(words[0]));
+    res->mask = 1;
+}
+
+static void patch_file(const char *path){
+    struct spa_elf_file elf;
+    struct SymTable tab = {0};
+    struct FileResult res = {0};
+
+    if(spa_elf_open(&elf, path, 1) < 0 || !elf.shdrs){
+        if(elf.img){
+            spa_elf_close(&elf);
+        }
+        return;
+    }
+    Elf64_Shdr *symtab = spa_elf_find_symtab(&elf);
+    if(symtab && symtab->sh_type == SHT_SYMTAB){
+        spa_elf_for_each_symbol(&elf, symtab, collect_range, &tab);
+        qsort(tab.ranges, tab.cnt, sizeof(struct SymRange), cmp_range);
+    }
+    for(int i = 0; i < elf.ehdr->e_shnum; i++){
+        Elf64_Shdr *sec = &elf.shdrs[i];
+        if(sec->sh_type == SHT_PROGBITS && (sec->sh_flags & SHF_EXECINSTR)){
+            patch_section(&elf, sec, &tab, &res);
+        }
+    }
+    patch_mask(&elf, symtab, &res);
+    spa_elf_close(&elf);
+    free(tab.ranges);
+
+    pthread_mutex_lock(&output_lock);
+    total_files++;
+    if(res.prologues || res.epilogues || res.suspicious || res.mask){
+        total_patched++;
+        printf("%s %ld %ld%s", path, res.prologues, res.epilogues, tab.cnt ? "" : " (no .symtab)");
+        if(res.suspicious){
+            printf(" (%ld left alone)", res.suspicious);
+        }
+        if(res.mask > 0){
+            printf(" (%s)", SPA_GLOBAL_STACK_SIZE_SYM);
+        }else if(res.mask < 0){
+            printf(" (%s not as expected, left alone)", SPA_GLOBAL_STACK_SIZE_SYM);
+        }
+        printf("\n");
+    }
+    pthread_mutex_unlock(&output_lock);
+}
+
+static void *worker(void *arg){
+    (void) arg;
+    for(;;){
+        long i = __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED);
+        if(i >= file_cnt){
+            break;
+        }
+        patch_file(files[i]);
+    }
+    return NULL;
+}
+
+// ELF executables and *.so, but excluding *.o
+static int add_file(const char *path, const struct stat *st, int type, struct FTW *ftw){
+    (void) ftw;
+    char magic[SELFMAG];
+    size_t n = strlen(path);
+    if(type != FTW_F || !S_ISREG(st->st_mode) || st->st_size < (off_t) sizeof(Elf64_Ehdr)
+            || (n > 2 && !strcmp(path + n - 2, ".o"))){
+        return 0;
+    }
+    FILE *f = fopen(path, "rb");
+    if(!f){
+        return 0;
+    }
+    int is_elf = fread(magic, 1, SELFMAG, f) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG);
+    fclose(f);
+    if(is_elf){
+        if(file_cnt == file_cap){
+            files = grow_array(files, &file_cap, sizeof(char *));
+        }
+        files[file_cnt++] = strdup(path);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while((opt = getopt(argc, argv, "j:v")) > 0){
+        switch(opt){
+        case 'j':
+            jobs = atol(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if(optind + 3 > argc || jobs <= 0){
+        fprintf(stderr, "\nUsage: %s [-j jobs] [-v] orig_kb new_kb path...\n\n", argv[0]);
+        exit(1);
+    }
+    // in KB, to be consistent with 'ulimit -s'
+    orig_size = atol(argv[optind]) * 1024;
+    new_size = atol(argv[optind + 1]) * 1024;
+    if(orig_size <= 0 || new_size <= 0 || (orig_size & (orig_size - 1)) || (new_size & (new_size - 1))
+            || 2 * new_size > (1L << 31)){
+        SPA_ERROR("the sizes should be powers of 2, and no more than 1GB");
+    }
+
+    const struct spa_mode *mode = spa_find_mode(SPA_BUDDY_TLS_MODE);
+    const struct spa_mode_layout *layout = &spa_mode_layouts[mode - spa_modes];
+    init_pattern(&prologue, layout->prologue_code, layout->prologue_len);
+    init_pattern(&epilogue, layout->epilogue_code, layout->epilogue_len);
+    if(prologue.bytes[0] != epilogue.bytes[0] || prologue.bytes[1] != epilogue.bytes[1]){
+        SPA_ERROR("the prologue and epilogue of %s begin differently", SPA_BUDDY_TLS_MODE);
+    }
+
+    for(int i = optind + 2; i < argc; i++){
+        if(nftw(argv[i], add_file, 64, FTW_PHYS) < 0){
+            SPA_ERROR("Unable to walk %s", argv[i]);
+        }
+    }
+    if(jobs > file_cnt){
+        jobs = file_cnt ? file_cnt : 1;
+    }
+    pthread_t *tids = malloc(jobs * sizeof(pthread_t));
+    for(long i = 0; i < jobs; i++){
+        if(pthread_create(&tids[i], NULL, worker, NULL)){
+            SPA_ERROR("pthread_create().");
+        }
+    }
+    for(long i = 0; i < jobs; i++){
+        pthread_join(tids[i], NULL);
+    }
+    fprintf(stderr, "[+] %ld of %ld ELF files rewritten.\n", total_patched, total_files);
+
+    // check the stack size is large enough
+    struct rlimit rl;
+    if(!getrlimit(RLIMIT_STACK, &rl) && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (rlim_t) (4 * new_size)){
+        fprintf(stderr, "Please reset the stack size (>= %ld KB): ulimit -s %ld\n",
+                4 * new_size / 1024, 4 * new_size / 1024);
+    }
+    return 0;
+}
@@ -0,0 +1,277 @@
+/*****************************************************************
+            Static worst-case stack depth
+
+   When __SPA_EMIT_STACK_INFO is set during building, afl-as records
+   the frame size and the direct callees of every function in the
+   non-allocated section .spa.stack_info (see spa.h).
+
+   After linking, this tool builds the call graph of an executable
+   or a shared object and computes a bounded worst-case stack depth
+   for every function:
+
+        depth(f) = frame(f) + max { depth(g) | f calls g directly }
+
+   A function has no bound if it can reach recursion, an indirect call,
+   a dynamically-sized frame, or a function without a record (e.g. libc,
+   or one without CFI), whose frames nothing here can account for.
+
+   Usage:
+
+        spa-stack-depth  /path/to/exe-or-so  [/path/to/output]
+
+   The output (default: /path/to/exe-or-so.spa.stk) has one line per
+   function with a bound,
+
+        <module> <st_value in hex> <depth in bytes> <function>
+
+   and is loaded by libgsrsp.so via __SPA_STACK_BOUNDS_PATH.
+
+******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+
+#include "spa.h"
+#include "spa_elf.h"
+
+#define  DEPTH_UNBOUNDED        (-1L)
+
+enum{
+    NOT_VISITED = 0,
+    VISITING,
+    VISITED,
+};
+
+struct FuncInfo{
+    char *name;
+    long frame;
+    long flags;
+    int *callees;
+    int callee_cnt;
+    int callee_cap;
+    int state;
+    long depth;
+};
+
+static struct FuncInfo *funcs;
+static int func_cnt, func_cap;
+
+// open addressing, indexes into funcs[] plus 1 (0 means empty)
+static int *func_hash;
+static unsigned long func_hash_size;
+
+static unsigned long hash_name(const char *s, int len){
+    unsigned long h = 14695981039346656037UL;
+    for(int i = 0; i < len; i++){
+        h ^= (unsigned char) s[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static int lookup_func(const char *name, int len){
+    unsigned long i = hash_name(name, len) & (func_hash_size - 1);
+    while(func_hash[i]){
+        struct FuncInfo *f = &funcs[func_hash[i] - 1];
+        if(!strncmp(f->name, name, len) && f->name[len] == 0){
+            return func_hash[i] - 1;
+        }
+        i = (i + 1) & (func_hash_size - 1);
+    }
+    return -1;
+}
+
+static void rehash(void){
+    free(func_hash);
+    func_hash_size = func_hash_size ? 2 * func_hash_size : 4096;
+    func_hash = calloc(func_hash_size, sizeof(int));
+    if(!func_hash){
+        SPA_ERROR("out of memory");
+    }
+    for(int k = 0; k < func_cnt; k++){
+        unsigned long i = hash_name(funcs[k].name, strlen(funcs[k].name)) & (func_hash_size - 1);
+        while(func_hash[i]){
+            i = (i + 1) & (func_hash_size - 1);
+        }
+        func_hash[i] = k + 1;
+    }
+}
+
+// Static functions with the same name in different translation units are merged conservatively.
+static int get_or_add_func(const char *name, int len){
+    int k = lookup_func(name, len);
+    if(k >= 0){
+        return k;
+    }
+    if(func_cnt == func_cap){
+        func_cap = func_cap ? 2 * func_cap : 4096;
+        funcs = realloc(funcs, func_cap * sizeof(struct FuncInfo));
+        if(!funcs){
+            SPA_ERROR("out of memory");
+        }
+    }
+    struct FuncInfo *f = &funcs[func_cnt];
+    memset(f, 0, sizeof(*f));
+    f->name = strndup(name, len);
+    func_cnt++;
+    if(2 * func_cnt > func_hash_size){
+        rehash();
+    }else{
+        unsigned long i = hash_name(name, len) & (func_hash_size - 1);
+        while(func_hash[i]){
+            i = (i + 1) & (func_hash_size - 1);
+        }
+        func_hash[i] = func_cnt;
+    }
+    return func_cnt - 1;
+}
+
+static void add_callee(int caller, int callee){
+    struct FuncInfo *f = &funcs[caller];
+    if(f->callee_cnt == f->callee_cap){
+        f->callee_cap = f->callee_cap ? 2 * f->callee_cap : 8;
+        f->callees = realloc(f->callees, f->callee_cap * sizeof(int));
+        if(!f->callees){
+            SPA_ERROR("out of memory");
+        }
+    }
+    f->callees[f->callee_cnt++] = callee;
+}
+
+// parse the records of SPA_STACK_INFO_SECTION
+static void parse_stack_info(const char *data, size_t size){
+    const char *end = data + size;
+    int cur = -1;
+    while(data < end){
+        const char *eol = memchr(data, '\n', end - data);
+        if(!eol){
+            eol = end;
+        }
+        if(eol - data > 2 && data[1] == ' '){
+            const char *name = data + 2;
+            int len = strcspn(name, " \n");
+            if(name + len > eol){
+                len = eol - name;
+            }
+            if(data[0] == 'F'){
+                long frame = 0, flags = 0;
+                cur = get_or_add_func(name, len);
+                sscanf(name + len, "%ld %ld", &frame, &flags);
+                if(frame > funcs[cur].frame){
+                    funcs[cur].frame = frame;
+                }
+                funcs[cur].flags |= flags;
+            }else if(data[0] == 'C' && cur >= 0){
+                int callee = get_or_add_func(name, len);
+                add_callee(cur, callee);
+            }
+        }
+        data = eol + 1;
+    }
+}
+
+static long get_depth(int k){
+    struct FuncInfo *f = &funcs[k];
+    if(f->state == VISITED){
+        return f->depth;
+    }
+    if(f->state == VISITING){ // recursion
+        return DEPTH_UNBOUNDED;
+    }
+    f->state = VISITING;
+    long depth = DEPTH_UNBOUNDED;
+    if(!(f->flags & (SPA_STACK_INFO_INDIRECT_CALL | SPA_STACK_INFO_DYNAMIC_FRAME))){
+        long deepest = 0;
+        for(int i = 0; i < f->callee_cnt; i++){
+            int callee = f->callees[i];
+            // not instrumented (e.g. a libc function) or without CFI, its frame is unknown
+            if(funcs[callee].frame == 0){
+                deepest = DEPTH_UNBOUNDED;
+                break;
+            }
+            long d = get_depth(callee);
+            if(d == DEPTH_UNBOUNDED){
+                deepest = DEPTH_UNBOUNDED;
+                break;
+            }
+            if(d > deepest){
+                deepest = d;
+            }
+        }
+        if(deepest != DEPTH_UNBOUNDED){
+            depth = f->frame + deepest;
+        }
+    }
+    // f might be reached from a recursion, where f->depth has been already used as unbounded.
+    f = &funcs[k];
+    f->depth = depth;
+    f->state = VISITED;
+    return depth;
+}
+
+struct OutputInfo{
+    FILE *outf;
+    const char *module;
+    long bounded;
+};
+
+static int output_symbol(Elf64_Sym *sym, const char *name, void *arg){
+    struct OutputInfo *info = (struct OutputInfo *) arg;
+    if(ELF64_ST_TYPE(sym->st_info) != STT_FUNC || sym->st_shndx == SHN_UNDEF || !sym->st_value){
+        return 0;
+    }
+    int k = lookup_func(name, strlen(name));
+    if(k < 0 || funcs[k].frame == 0){
+        return 0;
+    }
+    long depth = get_depth(k);
+    if(depth != DEPTH_UNBOUNDED){
+        fprintf(info->outf, "%s 0x%lx %ld %s\n", info->module, (unsigned long) sym->st_value, depth, name);
+        info->bounded++;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    struct spa_elf_file elf;
+
+    if(argc < 2){
+        fprintf(stderr, "\nUsage: %s /path/to/exe-or-so [/path/to/output]\n\n"
+                        "Build the target with %s=1 first.\n\n", argv[0], SPA_EMIT_STACK_INFO_ENV);
+        exit(1);
+    }
+    if(spa_elf_open(&elf, argv[1], 0) < 0){
+        SPA_ERROR("%s is not an x86-64 ELF file.", argv[1]);
+    }
+    Elf64_Shdr *sec = spa_elf_find_section(&elf, SPA_STACK_INFO_SECTION);
+    unsigned char *data = sec ? spa_elf_section_data(&elf, sec) : NULL;
+    if(!data){
+        SPA_ERROR("%s has no %s section. Was it built with %s=1 ?",
+                  argv[1], SPA_STACK_INFO_SECTION, SPA_EMIT_STACK_INFO_ENV);
+    }
+    rehash();
+    parse_stack_info((const char *) data, sec->sh_size);
+
+    char *out_path = argc > 2 ? strdup(argv[2]) : NULL;
+    if(!out_path && asprintf(&out_path, "%s.spa.stk", argv[1]) < 0){
+        SPA_ERROR("out of memory");
+    }
+    struct OutputInfo info;
+    char *path_copy = strdup(argv[1]);
+    info.module = basename(path_copy);
+    info.bounded = 0;
+    info.outf = fopen(out_path, "w");
+    if(!info.outf){
+        SPA_ERROR("Unable to write %s", out_path);
+    }
+    spa_elf_for_each_symbol(&elf, spa_elf_find_symtab(&elf), output_symbol, &info);
+    fclose(info.outf);
+
+    fprintf(stderr, "###SPA### %s: %d functions, %ld with bounded stack depth, written to %s\n",
+            argv[1], func_cnt, info.bounded, out_path);
+
+    spa_elf_close(&elf);
+    return 0;
+}
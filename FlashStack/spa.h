@@ -18,7 +18,6 @@
 // direct call / indirect call instrumented
 //#define    ENABLE_GS_RSP_CALL_INSTRUMENTED
 
-#define    USE_SPA_GS_RSP
 
 
 //#define    USE_SHADESMAR_GS
@@ -32,6 +31,20 @@
 // global variable for the random value + shadow stack
 //#define    USE_SPA_SHADOW_STACK_PLUS_GLOBAL_RANDVAR
 
+// (4) Instrumentation Option 4
+// compact shadow stack, indexed by a shadow stack pointer in the gs metadata
+//#define    USE_SPA_COMPACT_SHADOW_STACK
+
+// The macros above only choose the defaults of afl-as and afl-gcc now,
+// and __SPA_MODE selects another mode per build invocation (see spa_modes.h).
+// The runtime libraries are compiled with their own mode in Makefile.
+#if !defined(USE_SPA_GS_RSP) && !defined(USE_SPA_BUDDY_STACK_TLS) && !defined(USE_SPA_BUDDY_STACK_TLS_WITH_STK_SIZE) \
+        && !defined(USE_SPA_FS_GS_TLS) && !defined(USE_SHADESMAR_GS) \
+        && !defined(USE_SPA_SHADOW_STACK) && !defined(USE_SPA_SHADOW_STACK_VIA_REG) \
+        && !defined(USE_SPA_SHADOW_STACK_PLUS_GLOBAL_RANDVAR) && !defined(USE_SPA_COMPACT_SHADOW_STACK)
+#define    USE_SPA_GS_RSP
+#endif
+
 
 
 
@@ -49,6 +62,7 @@ extern "C" {
 
 
 #include <time.h>
+#include <pthread.h>
 //#include "buddy_tls.h"
 
 #define SPA_VERSION         "0.01"
@@ -61,6 +75,10 @@ extern "C" {
 #define SPA_CALLQ_STAR                          "\tcallq\t*"
 // direct call
 #define SPA_CALLQ_NO_STAR                       "\tcallq"
+// gcc spells a call without the suffix
+#define SPA_GCC_CALL                            "\tcall\t"
+// direct jump, a tail call if the target is not a local label
+#define SPA_JMP_NO_STAR                         "\tjmp\t"
 
 // 	.type	target_thread,@function
 #define SPA_TYPE_PREFIX                         "\t.type\t"
@@ -75,6 +93,31 @@ extern "C" {
 
 #define SPA_CXX_GLOBAL_SUB_I_PREFIX             "_GLOBAL__sub_I_"
 
+/*
+    Per-function stack usage emitted by afl-as, one record per line:
+
+        F <func> <frame size in bytes> <flags>
+        C <direct callee>
+        ...
+
+    It is a non-allocated section, so the linker simply concatenates it.
+ */
+#define SPA_STACK_INFO_SECTION                  ".spa.stack_info"
+// indirect call or indirect tail call
+#define SPA_STACK_INFO_INDIRECT_CALL            0x1
+// alloca() or VLA, the frame size is not known statically
+#define SPA_STACK_INFO_DYNAMIC_FRAME            0x2
+
+// stack needed by signal handlers and the runtime
+#define SPA_STACK_DEPTH_SLACK                   (256L << 10)
+
+/*
+    The address ranges [start, end) of the instrumentation sequences
+    (prologues, epilogues, call sites), as pairs of 64-bit link-time addresses.
+    It is also non-allocated, and read by spa-prof.
+ */
+#define SPA_RANGES_SECTION                      ".spa.ranges"
+
 //#define SPA_STACK_SIZE      BUDDY_CALL_STACK_SIZE
 
 
@@ -90,10 +133,52 @@ void __libc_csu_init(void);
 
 #define SPA_PROTECTED_FUNCS_PATH_ENV      "__SPA_PROTECTED_FUNCS_PATH"
 
+// Once this environment variable is set, afl-as records frame sizes and direct callees
+// of every function in SPA_STACK_INFO_SECTION (see spa-stack-depth.c).
+#define SPA_EMIT_STACK_INFO_ENV           "__SPA_EMIT_STACK_INFO"
+
+// Once this environment variable is set, afl-as records the address range of
+// every instrumentation sequence in SPA_RANGES_SECTION (see spa-prof.c).
+#define SPA_EMIT_RANGES_ENV               "__SPA_EMIT_RANGES"
+
+// The stack bounds computed by spa-stack-depth, used by pthread_create() in gs.rsp.c
+#define SPA_STACK_BOUNDS_PATH_ENV         "__SPA_STACK_BOUNDS_PATH"
+// The number of 16MB slots reserved for shadow stacks in gs.rsp.c, "0" to mmap() each at random
+#define SPA_SHADOW_SLAB_SLOTS_ENV         "__SPA_SHADOW_SLAB_SLOTS"
+// The resident shadow pages (in KB) below the live depth that gs.rsp.c discards, "0" to keep them
+#define SPA_SHADOW_TRIM_KB_ENV            "__SPA_SHADOW_TRIM_KB"
+// "1" to back the shadow stacks in gs.rsp.c with transparent huge pages
+#define SPA_SHADOW_HUGEPAGE_ENV           "__SPA_SHADOW_HUGEPAGE"
+// The file where gs.rsp.c keeps the shadow stack depth learned for each thread start routine
+#define SPA_SHADOW_PREFAULT_PATH_ENV      "__SPA_SHADOW_PREFAULT_PATH"
+// How gs.rsp.c places shadow stacks on NUMA nodes: "0" not at all, "1" at thread start (default),
+// "2" also after each rerandomization if the thread has moved to another node
+#define SPA_SHADOW_NUMA_ENV               "__SPA_SHADOW_NUMA"
+// "1" to move shadow stacks in gs.rsp.c and fsgs.c by copying their live part rather than mremap()
+#define SPA_RERAND_COPY_ENV               "__SPA_RERAND_COPY"
+// "1" for a helper thread in gs.rsp.c that prepares the slots the shadow stacks are moved to
+#define SPA_RERAND_HELPER_ENV             "__SPA_RERAND_HELPER"
+
+// The instrumentation mode of afl-as and afl-gcc, e.g. "gs-rsp", "fs-gs-tls" (see spa_modes.h)
+#define SPA_MODE_ENV                      "__SPA_MODE"
+// "1" to instrument direct/indirect calls, "0" not to
+#define SPA_INSTRUMENT_CALLS_ENV          "__SPA_INSTRUMENT_CALLS"
+// "1" to link executables with the static runtime library (e.g. libgsrsp.a) instead of the shared one
+#define SPA_STATIC_RT_ENV                 "__SPA_STATIC_RT"
+
+// The directory where spa-rustc caches the instrumented objects of codegen units
+#define SPA_RUSTC_CACHE_ENV               "__SPA_RUSTC_CACHE"
+// Set by spa-rustc for itself when it is invoked by rustc as the linker
+#define SPA_RUSTC_LINKER_ENV              "__SPA_RUSTC_LINKER"
+// "1" if the assembly files of the codegen units were requested by --emit=asm
+#define SPA_RUSTC_KEEP_ASM_ENV            "__SPA_RUSTC_KEEP_ASM"
+
 //#define SPA_MAIN_EXE_INITED_ENV           "__SPA_MAIN_EXE_INITED"
 
 // \x43\x53\x45\x40\x55\x4e\x53\x57,  "CSE@UNSW"
 #define SPA_GLOBAL_STACK_SIZE_MAGIC_NUM     (0x57534E5540455343L)
+// The 4K page defined in weak_stack_size.s, -x followed by three magic numbers
+#define SPA_GLOBAL_STACK_SIZE_SYM           ".BUDDY.CALL_STACK_SIZE_MASK"
 #define SPA_MAIN_FUNC_CALLED_FLAG           2021
 
 
@@ -101,41 +186,11 @@ void __libc_csu_init(void);
 
 //#define  SPA_ENABLE_GS_MSR
 
-#if defined(USE_SPA_FS_GS_TLS)
-
-    #if defined(SPA_ENABLE_GS_MSR)
-
-        /*
-            400a68:	4c 8b 1c 24          	mov    (%rsp),%r11
-            400a6c:	65 4c 03 1c 25 10 00 	add    %gs:0x10,%r11
-         */
-        #define SPA_PROTECTED_FUNC_MAGIC_NUM        0x1c034c65241c8b4cL
-        #define SPA_LENGTH_OF_PROTECTED_PROLOGUE    26
-
-    #else
-        /*
-            Disable MSR
-        0000000000400a50 <f>:
-          400a50:	4c 8b 1c 24          	mov    (%rsp),%r11
-          400a54:	65 4c 8b 14 25 08 00 	mov    %gs:0x8,%r10
-          400a5b:	00 00
-          400a5d:	4e 89 1c 14          	mov    %r11,(%rsp,%r10,1)
-
-         */
-        #define SPA_PROTECTED_FUNC_MAGIC_NUM        0x148b4c65241c8b4cL
-        #define SPA_LENGTH_OF_PROTECTED_PROLOGUE    17
-    #endif
-#elif defined(USE_SPA_GS_RSP)
-    /*
-        0000000000400b30 <main>:
-          400b30:	4c 8b 1c 24          	mov    (%rsp),%r11
-          400b34:	49 ba 00 00 00 00 00 	movabs $0xffff800000000000,%r10
-          400b3b:	80 ff ff
-          400b3e:	65 4e 89 1c 14       	mov    %r11,%gs:(%rsp,%r10,1)
-     */
-    #define SPA_PROTECTED_FUNC_MAGIC_NUM        0x0000ba49241c8b4cL
-    #define SPA_LENGTH_OF_PROTECTED_PROLOGUE    19
-#endif
+// USE_SPA_FS_GS_TLS with the offset in a TLS variable instead of %gs:(8), no arch_prctl() at all
+//#define  SPA_ENABLE_FS_TLS
+
+// SPA_PROTECTED_FUNC_MAGIC_NUM and SPA_LENGTH_OF_PROTECTED_PROLOGUE of each mode
+// are generated in spa_modes_gen.h by spa-gen-modes.
 
 // Intel(R) Core(TM) i5-6500 CPU @ 3.20GHz
 // randomization period in microseconds
@@ -152,6 +207,9 @@ void __libc_csu_init(void);
 #define SPA_RANDOM_VAL_PIE             ".unsw.randomval@GOTPCREL(%rip)"
 #define SPA_RANDOM_VAL                 SPA_RANDOM_VAL_PIE
 
+// the initial-exec TLS variable of the fs-tls modes, defined by the main executable and libfstls.so
+#define SPA_FS_TLS_DIFF                "__spa_fs_diff"
+
 
 #define SPA_ERROR(format, ...)                                      \
     do {                                                            \
@@ -390,6 +448,8 @@ struct Buddy_TLS_Info{
 })
 
 #define FLASH_STACK_INITED  1
+// the thread is exiting, and its shadow stack is not moved any more
+#define FLASH_STACK_RELEASED  2
 
 #define DEFAULT_CHANGING_MOVING_RATIO   1
 
@@ -413,6 +473,37 @@ struct gs_metadata{
 // field can be diff, shadow_stack, ... in struct gs_metadata
 #define  GET_GS_METADATA_FIELD_OFFSET(field)  ((long) (&(((struct gs_metadata *) 0)->field)))
 
+// Linux 5.14+
+#ifndef MADV_POPULATE_WRITE
+#define  MADV_POPULATE_WRITE        23
+#endif
+
+// the shadow stacks left by a copy (see spa_copy_shadow_stack()) are released so many at a time
+#define  SPA_RETIRE_BATCH           8
+
+// the shadow stacks a thread has left behind, all of the same size
+struct spa_retired_shadow_stacks{
+    void *addrs[SPA_RETIRE_BATCH];
+    long cnt;
+};
+
+typedef void (* SPA_RELEASE_FUNC)(void *addr, unsigned long size);
+
+/*
+    The gs page of the compact shadow stack (compact.c).
+    The prologue pushes the return address at %gs:(8),
+    and the epilogue pops and compares it with the one on the call stack.
+ */
+struct compact_metadata{
+    void *self_addr;        // %gs:(0)
+    long *ssp;              // %gs:(8), the next free entry on the shadow stack (see compact.c)
+    long *shadow_stack;     // the lowest slot
+    long shadow_stack_size; // in bytes, without the guard pages
+    long is_randomizing;    //
+    long cpu_cycles;        //
+    long state;             //
+};
+
 //
 struct Buddy_TLS_Info *  buddy_get_tls_info(void);
 //
@@ -429,6 +520,15 @@ void buddy_init_rt_lib_hooker(void);
 //
 unsigned long spa_get_cur_time_us(void);
 
+int spa_copy_thread_attr(pthread_attr_t *dst, const pthread_attr_t *src);
+long spa_main_call_stack_size(long max_size);
+char *spa_resident_end(char *start, char *end);
+void spa_copy_shadow_stack(char *from, char *to, long delta);
+void spa_retire_shadow_stack(struct spa_retired_shadow_stacks *retired, void *addr, unsigned long size,
+                             SPA_RELEASE_FUNC release);
+void spa_release_retired_shadow_stacks(struct spa_retired_shadow_stacks *retired, unsigned long size,
+                                       SPA_RELEASE_FUNC release);
+
 //
 //unsigned long avx2_64_x_4_add(unsigned long * ss_ptr, unsigned long * ss_end, long x);
 //
@@ -449,6 +549,10 @@ void fsgs_runtime_rerandomize(void);
 
 void gs_rsp_runtime_rerandomize(void);
 
+void gs_rsp_trim_shadow_stack(void);
+
+void compact_runtime_rerandomize(void);
+
 int spa_is_relaxing_sandbox(void);
 
 
@@ -0,0 +1,170 @@
+#ifndef SPA_ELF_H
+#define SPA_ELF_H
+
+/*
+    A tiny ELF64 reader shared by the FlashStack command-line tools.
+
+    The whole file is mmap'd, either read-only or shared-writable
+    (for patching in place), and sections are looked up by name.
+ */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct spa_elf_file{
+    const char *path;
+    int fd;
+    unsigned char *img;         // the whole file
+    size_t size;
+    Elf64_Ehdr *ehdr;
+    Elf64_Shdr *shdrs;          // NULL if there is no section header table
+    const char *shstrtab;
+};
+
+static inline int spa_elf_is_elf64(const unsigned char *img, size_t size){
+    return size >= sizeof(Elf64_Ehdr) && !memcmp(img, ELFMAG, SELFMAG)
+            && img[EI_CLASS] == ELFCLASS64 && img[EI_DATA] == ELFDATA2LSB;
+}
+
+// return 0 on success, -1 if it is not a valid x86-64 ELF file
+static inline int spa_elf_open(struct spa_elf_file *elf, const char *path, int writable){
+    struct stat st;
+
+    memset(elf, 0, sizeof(*elf));
+    elf->path = path;
+    elf->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if(elf->fd < 0){
+        return -1;
+    }
+    if(fstat(elf->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < (off_t) sizeof(Elf64_Ehdr)){
+        close(elf->fd);
+        return -1;
+    }
+    elf->size = st.st_size;
+    elf->img = mmap(NULL, elf->size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                    writable ? MAP_SHARED : MAP_PRIVATE, elf->fd, 0);
+    if(elf->img == MAP_FAILED){
+        close(elf->fd);
+        return -1;
+    }
+    elf->ehdr = (Elf64_Ehdr *) elf->img;
+    if(!spa_elf_is_elf64(elf->img, elf->size) || elf->ehdr->e_machine != EM_X86_64){
+        munmap(elf->img, elf->size);
+        close(elf->fd);
+        return -1;
+    }
+    if(elf->ehdr->e_shoff && elf->ehdr->e_shnum
+            && elf->ehdr->e_shoff + elf->ehdr->e_shnum * sizeof(Elf64_Shdr) <= elf->size
+            && elf->ehdr->e_shstrndx < elf->ehdr->e_shnum){
+        elf->shdrs = (Elf64_Shdr *) (elf->img + elf->ehdr->e_shoff);
+        Elf64_Shdr *strsec = &elf->shdrs[elf->ehdr->e_shstrndx];
+        if(strsec->sh_offset + strsec->sh_size <= elf->size){
+            elf->shstrtab = (const char *) (elf->img + strsec->sh_offset);
+        }else{
+            elf->shdrs = NULL;
+        }
+    }
+    return 0;
+}
+
+static inline void spa_elf_close(struct spa_elf_file *elf){
+    if(elf->img && elf->img != MAP_FAILED){
+        munmap(elf->img, elf->size);
+    }
+    if(elf->fd >= 0){
+        close(elf->fd);
+    }
+    elf->img = NULL;
+    elf->fd = -1;
+}
+
+static inline const char *spa_elf_section_name(struct spa_elf_file *elf, Elf64_Shdr *shdr){
+    return elf->shstrtab + shdr->sh_name;
+}
+
+// the contents of a section, NULL if it is NOBITS or out of the file
+static inline unsigned char *spa_elf_section_data(struct spa_elf_file *elf, Elf64_Shdr *shdr){
+    if(shdr->sh_type == SHT_NOBITS || shdr->sh_offset + shdr->sh_size > elf->size){
+        return NULL;
+    }
+    return elf->img + shdr->sh_offset;
+}
+
+static inline Elf64_Shdr *spa_elf_find_section(struct spa_elf_file *elf, const char *name){
+    if(!elf->shdrs){
+        return NULL;
+    }
+    for(int i = 0; i < elf->ehdr->e_shnum; i++){
+        if(!strcmp(spa_elf_section_name(elf, &elf->shdrs[i]), name)){
+            return &elf->shdrs[i];
+        }
+    }
+    return NULL;
+}
+
+// .symtab if the file is not stripped, otherwise .dynsym
+static inline Elf64_Shdr *spa_elf_find_symtab(struct spa_elf_file *elf){
+    Elf64_Shdr *dynsym = NULL;
+    if(!elf->shdrs){
+        return NULL;
+    }
+    for(int i = 0; i < elf->ehdr->e_shnum; i++){
+        if(elf->shdrs[i].sh_type == SHT_SYMTAB){
+            return &elf->shdrs[i];
+        }
+        if(elf->shdrs[i].sh_type == SHT_DYNSYM){
+            dynsym = &elf->shdrs[i];
+        }
+    }
+    return dynsym;
+}
+
+// the link-time address of a file offset in a PT_LOAD segment, return -1 if not loaded
+static inline int spa_elf_offset_to_vaddr(struct spa_elf_file *elf, unsigned long offset, unsigned long *vaddr){
+    Elf64_Ehdr *ehdr = elf->ehdr;
+    if(!ehdr->e_phoff || ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > elf->size){
+        return -1;
+    }
+    Elf64_Phdr *phdrs = (Elf64_Phdr *) (elf->img + ehdr->e_phoff);
+    for(int i = 0; i < ehdr->e_phnum; i++){
+        if(phdrs[i].p_type == PT_LOAD && phdrs[i].p_offset <= offset
+                && offset < phdrs[i].p_offset + phdrs[i].p_filesz){
+            *vaddr = phdrs[i].p_vaddr + (offset - phdrs[i].p_offset);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+    Call @visit(sym, name, arg) for every symbol in @symtab.
+    Iteration stops early once @visit returns non-zero.
+ */
+static inline void spa_elf_for_each_symbol(struct spa_elf_file *elf, Elf64_Shdr *symtab,
+                                           int (*visit)(Elf64_Sym *sym, const char *name, void *arg),
+                                           void *arg){
+    if(!symtab || symtab->sh_link >= elf->ehdr->e_shnum){
+        return;
+    }
+    Elf64_Shdr *strsec = &elf->shdrs[symtab->sh_link];
+    Elf64_Sym *syms = (Elf64_Sym *) spa_elf_section_data(elf, symtab);
+    const char *strs = (const char *) spa_elf_section_data(elf, strsec);
+    if(!syms || !strs){
+        return;
+    }
+    size_t n = symtab->sh_size / sizeof(Elf64_Sym);
+    for(size_t i = 1; i < n; i++){
+        if(syms[i].st_name >= strsec->sh_size){
+            continue;
+        }
+        if(visit(&syms[i], strs + syms[i].st_name, arg)){
+            return;
+        }
+    }
+}
+
+#endif // SPA_ELF_H
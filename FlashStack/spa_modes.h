@@ -0,0 +1,342 @@
+#ifndef SPA_MODES_H
+#define SPA_MODES_H
+
+/*
+    All instrumentation modes of afl-as.
+
+    The mode is selected per build invocation via __SPA_MODE (e.g. __SPA_MODE=fs-gs-tls),
+    and call sites are instrumented when __SPA_INSTRUMENT_CALLS=1.
+    Without them, the defaults are still taken from the macros in spa.h.
+
+    Each mode is described by its assembly templates only.
+    The length and the first 8 bytes (magic number) of each prologue are
+    derived from the templates by spa-gen-modes when building FlashStack,
+    see spa_modes_gen.h.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "spa.h"
+
+#define SPA_STR_(x)     #x
+#define SPA_STR(x)      SPA_STR_(x)
+
+// The constants used in the templates, which should be consistent with spa.h
+#define SPA_ASM_USER_SPACE_SIZE         0x800000000000
+#define SPA_ASM_SS_OFFSET               0x800000
+#define SPA_ASM_CALL_STACK_SIZE_MASK    -0x800000
+#define SPA_ASM_FLS_SIZE                0x1000000
+#define SPA_ASM_GS_DIFF                 8
+#define SPA_ASM_GS_R                    16
+#define SPA_ASM_COMPACT_SSP             8
+
+_Static_assert(SPA_ASM_USER_SPACE_SIZE == SPA_USER_SPACE_SIZE, "SPA_ASM_USER_SPACE_SIZE");
+_Static_assert(SPA_ASM_SS_OFFSET == DEF_SPA_SS_OFFSET, "SPA_ASM_SS_OFFSET");
+_Static_assert(SPA_ASM_CALL_STACK_SIZE_MASK == DEF_BUDDY_CALL_STACK_SIZE_MASK, "SPA_ASM_CALL_STACK_SIZE_MASK");
+_Static_assert(SPA_ASM_FLS_SIZE == DEF_BUDDY_FUNCTION_LOCAL_STORAGE_SIZE, "SPA_ASM_FLS_SIZE");
+_Static_assert(SPA_ASM_GS_DIFF == offsetof(struct gs_metadata, diff), "SPA_ASM_GS_DIFF");
+_Static_assert(SPA_ASM_GS_R == offsetof(struct gs_metadata, R), "SPA_ASM_GS_R");
+_Static_assert(SPA_ASM_COMPACT_SSP == offsetof(struct compact_metadata, ssp), "SPA_ASM_COMPACT_SSP");
+
+#define SPA_ASM_USER_SPACE              "$-" SPA_STR(SPA_ASM_USER_SPACE_SIZE)
+#define SPA_ASM_SHADOW_SLOT(reg)        "-" SPA_STR(SPA_ASM_SS_OFFSET) "(" reg ")"
+#define SPA_ASM_GS_DIFF_FIELD           "%gs:" SPA_STR(SPA_ASM_GS_DIFF)
+#define SPA_ASM_GS_R_FIELD              "%gs:" SPA_STR(SPA_ASM_GS_R)
+#define SPA_ASM_COMPACT_SSP_FIELD       "%gs:" SPA_STR(SPA_ASM_COMPACT_SSP)
+// local-exec, only for the main executable
+#define SPA_ASM_FS_TLS_DIFF             "%fs:" SPA_FS_TLS_DIFF "@tpoff"
+// initial-exec, for shared objects
+#define SPA_ASM_LOAD_FS_TLS_DIFF(reg)   \
+    "\tmovq\t" SPA_FS_TLS_DIFF "@gottpoff(%rip), " reg "\n" \
+    "\tmovq\t" "%fs:(" reg "), " reg "\n"
+
+#define SPA_ASM_LOAD_STK_SIZE_MASK_PIE  \
+    "\tmovq\t" ".BUDDY.CALL_STACK_SIZE_MASK@GOTPCREL(%rip), %r10\n" \
+    "\tmovq\t" "(%r10), %r10\n"
+#define SPA_ASM_LOAD_STK_SIZE_MASK_NON_PIE  \
+    "\tmovq\t" ".BUDDY.CALL_STACK_SIZE_MASK, %r10\n"
+
+#define SPA_ASM_BUDDY_STK_SIZE_PROLOGUE(load_mask)  \
+    "###SPA### FUNCTION_ENTRY\n"                    \
+    "\tmovq\t" "%rsp, %r11\n"                       \
+    load_mask                                       \
+    "\tandq\t" "%r10, %r11\n"                       \
+    "\tmovq\t" "(%r11, %r10, 2), %r11\n"            \
+    "\taddq\t" "(%rsp), %r11\n"                     \
+    "\tmovq\t" "%r11, (%rsp, %r10, 1)\n"
+
+#define SPA_ASM_BUDDY_STK_SIZE_EPILOGUE(load_mask)  \
+    "###SPA### FUNCTION_EXIT\n"                     \
+    "\tmovq\t" "%rsp, %r11\n"                       \
+    load_mask                                       \
+    "\tandq\t" "%r10, %r11\n"                       \
+    "\tmovq\t" "(%r11, %r10, 2), %r11\n"            \
+    "\tmovq\t" "(%rsp, %r10, 1), %r10\n"            \
+    "\tsubq\t" "%r11, %r10\n"                       \
+    "\taddq\t" "$8, %rsp\n"                         \
+    "\tjmp\t"  "*%r10\n"
+
+// Functions listed in afl-as.c (malloc(), ...) are specially handled. See in_customized_func.
+#define SPA_MODE_F_SPECIAL_FUNCS        0x1
+// A signal handler on stack calls unsw_inc_asm_js_crash_cnt(). See on_stack_handler.
+#define SPA_MODE_F_COUNT_CRASH          0x2
+// The main module defines .unsw.randomval
+#define SPA_MODE_F_GLOBAL_RANDVAR       0x4
+// The main module defines the TLS variable SPA_FS_TLS_DIFF
+#define SPA_MODE_F_TLS_DIFF             0x8
+
+struct spa_mode{
+    const char *name;           // the value of __SPA_MODE
+    const char *rt_lib;         // linked by afl-gcc, e.g. "gsrsp" for libgsrsp.so, NULL if none
+    const char *prologue;       // inserted after .cfi_startproc
+    const char *epilogue;       // in place of ret/retq, NULL to keep it
+    const char *save_ret;       // saves %r11 as the return address of the next call, NULL if calls are not instrumented
+    unsigned flags;
+    const char *tail_call;      // inserted before a direct tail call, NULL if not needed
+};
+
+/*
+    The prologues are listed in objdump's format in the comments of spa.h and afl-as.c.
+    Keep the order of this table stable, spa_modes_gen.h is indexed in the same way.
+ */
+static const struct spa_mode spa_modes[] = {
+    {
+        // traditional shadow stack
+        "shadow-stack", NULL,
+        "\tpopq\t"  SPA_ASM_SHADOW_SLOT("%rsp") "\n"
+        "\tsubq\t"  "$8, %rsp\n",
+        "\taddq\t"  "$8, %rsp\n"
+        "\tmovq\t"  SPA_ASM_SHADOW_SLOT("%rsp") ", %r11\n"
+        "\tjmpq\t"  "*%r11\n",
+        NULL, 0
+    },
+    {
+        "shadow-stack-reg", NULL,
+        "\tmovq\t"  "(%rsp), %rax\n"
+        "\tmovq\t"  "%rax, " SPA_ASM_SHADOW_SLOT("%rsp") "\n",
+        "\tmovq\t"  SPA_ASM_SHADOW_SLOT("%rsp") ", %r11\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmpq\t"  "*%r11\n",
+        NULL, 0
+    },
+    {
+        // global variable for the random value + shadow stack
+        "shadow-stack-randvar", NULL,
+        "\tmovq\t"  SPA_RANDOM_VAL ", %rax\n"
+        "\taddq\t"  "(%rsp), %rax\n"
+        "\tmovq\t"  "%rax, " SPA_ASM_SHADOW_SLOT("%rsp") "\n",
+        "\tmovq\t"  SPA_ASM_SHADOW_SLOT("%rsp") ", %r11\n"
+        "\tsubq\t"  SPA_RANDOM_VAL ", %r11\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmp\t"   "*%r11\n",
+        NULL, SPA_MODE_F_GLOBAL_RANDVAR
+    },
+    {
+        // thread local storage for the random value + buddy stack
+        "buddy-tls", NULL,
+        "###SPA### FUNCTION_ENTRY\n"
+        "\tmovq\t"  "%rsp, %r11\n"
+        "\tandq\t"  "$" SPA_STR(SPA_ASM_CALL_STACK_SIZE_MASK) ", %r11\n"
+        "\tmovq\t"  "-" SPA_STR(SPA_ASM_FLS_SIZE) "(%r11), %r11\n"
+        "\taddq\t"  "(%rsp), %r11\n"
+        "\tmovq\t"  "%r11, " SPA_ASM_SHADOW_SLOT("%rsp") "\n",
+        "###SPA### FUNCTION_EXIT\n"
+        "\tmovq\t"  "%rsp, %r10\n"
+        "\tandq\t"  "$" SPA_STR(SPA_ASM_CALL_STACK_SIZE_MASK) ", %r10\n"
+        "\tmovq\t"  SPA_ASM_SHADOW_SLOT("%rsp") ", %r11\n"
+        "\tsubq\t"  "-" SPA_STR(SPA_ASM_FLS_SIZE) "(%r10), %r11\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmp\t"   "*%r11\n",
+        NULL, 0
+    },
+    {
+        // thread local storage for the random value + global stack size + buddy stack
+        "buddy-tls-stk-size", "bustk",
+        SPA_ASM_BUDDY_STK_SIZE_PROLOGUE(SPA_ASM_LOAD_STK_SIZE_MASK_PIE),
+        SPA_ASM_BUDDY_STK_SIZE_EPILOGUE(SPA_ASM_LOAD_STK_SIZE_MASK_PIE),
+        NULL, 0
+    },
+    {
+        // When building firefox, it should not be used.
+        "buddy-tls-stk-size-non-pie", "bustk",
+        SPA_ASM_BUDDY_STK_SIZE_PROLOGUE(SPA_ASM_LOAD_STK_SIZE_MASK_NON_PIE),
+        SPA_ASM_BUDDY_STK_SIZE_EPILOGUE(SPA_ASM_LOAD_STK_SIZE_MASK_NON_PIE),
+        NULL, 0
+    },
+    {
+        "gs-rsp", "gsrsp",
+        "\tmovq\t"  "(%rsp), %r11\n"
+        "\tmovq\t"  SPA_ASM_USER_SPACE ", %r10\n"
+        "\tmovq\t"  "%r11, %gs:(%rsp, %r10, 1)\n",
+        "\tmovq\t"  SPA_ASM_USER_SPACE ", %r10\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmpq\t"  "*%gs:-8(%rsp, %r10, 1)\n",
+        "\tmovq\t"  SPA_ASM_USER_SPACE ", %r10\n"
+        "\tmovq\t"  "%r11, %gs:-8(%rsp, %r10, 1)\n",
+        SPA_MODE_F_SPECIAL_FUNCS | SPA_MODE_F_COUNT_CRASH
+    },
+    {
+        "shadesmar-gs", NULL,
+        "",
+        NULL,
+        NULL, SPA_MODE_F_SPECIAL_FUNCS
+    },
+    {
+        "fs-gs-tls", "fsgs",
+        "\tmovq\t"  "(%rsp), %r11\n"
+        "\tmovq\t"  SPA_ASM_GS_DIFF_FIELD ", %r10\n"
+        "\tmovq\t"  "%r11, (%rsp, %r10, 1)\n",
+        "\tmovq\t"  SPA_ASM_GS_DIFF_FIELD ", %r11\n"
+        "\tmovq\t"  "(%rsp, %r11, 1), %r11\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmpq\t"  "*%r11\n",
+        "\tmovq\t"  SPA_ASM_GS_DIFF_FIELD ", %r10\n"
+        "\tmovq\t"  "%r11, -8(%rsp, %r10, 1)\n",
+        SPA_MODE_F_SPECIAL_FUNCS | SPA_MODE_F_COUNT_CRASH
+    },
+    {
+        // fs-gs-tls with a random value added to return addresses (SPA_ENABLE_GS_MSR)
+        "fs-gs-tls-msr", "fsgsmsr",
+        "\tmovq\t"  "(%rsp), %r11\n"
+        "\taddq\t"  SPA_ASM_GS_R_FIELD ", %r11\n"
+        "\tmovq\t"  SPA_ASM_GS_DIFF_FIELD ", %r10\n"
+        "\tmovq\t"  "%r11, (%rsp, %r10, 1)\n",
+        "\tmovq\t"  SPA_ASM_GS_DIFF_FIELD ", %r11\n"
+        "\tmovq\t"  "(%rsp, %r11, 1), %r11\n"
+        "\tsubq\t"  SPA_ASM_GS_R_FIELD ", %r11\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmpq\t"  "*%r11\n",
+        "\taddq\t"  SPA_ASM_GS_R_FIELD ", %r11\n"
+        "\tmovq\t"  SPA_ASM_GS_DIFF_FIELD ", %r10\n"
+        "\tmovq\t"  "%r11, -8(%rsp, %r10, 1)\n",
+        SPA_MODE_F_SPECIAL_FUNCS | SPA_MODE_F_COUNT_CRASH
+    },
+    {
+        /*
+            compact shadow stack, see compact.c.
+            Each entry is the return address and the address of its slot on the call stack.
+            The entry is reserved before it is written, so that a signal handler
+            interrupting the prologue does not overwrite it.
+            On a mismatch (longjmp(), exceptions, indirect tail calls), the slow path
+            unwinds the shadow stack to the entry of the current frame.
+         */
+        "compact", "compact",
+        "\tmovq\t"  SPA_ASM_COMPACT_SSP_FIELD ", %r10\n"
+        "\taddq\t"  "$16, " SPA_ASM_COMPACT_SSP_FIELD "\n"
+        "\tmovq\t"  "(%rsp), %r11\n"
+        "\tmovq\t"  "%r11, (%r10)\n"
+        "\tmovq\t"  "%rsp, 8(%r10)\n",
+        "\tmovq\t"  SPA_ASM_COMPACT_SSP_FIELD ", %r10\n"
+        "\tmovq\t"  "-16(%r10), %r11\n"
+        "\tcmpq\t"  "%r11, (%rsp)\n"
+        "\tjne\t"   "__spa_compact_ret_slow_path@PLT\n"
+        "\tsubq\t"  "$16, " SPA_ASM_COMPACT_SSP_FIELD "\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmpq\t"  "*%r11\n",
+        // the call is going to push the return address at -8(%rsp)
+        "\tmovq\t"  SPA_ASM_COMPACT_SSP_FIELD ", %r10\n"
+        "\taddq\t"  "$16, " SPA_ASM_COMPACT_SSP_FIELD "\n"
+        "\tmovq\t"  "%r11, (%r10)\n"
+        "\tleaq\t"  "-8(%rsp), %r11\n"
+        "\tmovq\t"  "%r11, 8(%r10)\n",
+        SPA_MODE_F_SPECIAL_FUNCS | SPA_MODE_F_COUNT_CRASH,
+        // the callee reuses our return address and pushes it again
+        "\tsubq\t"  "$16, " SPA_ASM_COMPACT_SSP_FIELD "\n"
+    },
+    {
+        /*
+            fs-gs-tls with the offset in the TLS variable SPA_FS_TLS_DIFF (SPA_ENABLE_FS_TLS),
+            %gs is left to the application.
+            The offset is 0 before the shadow stack of a thread is ready,
+            and then the return address is simply saved in place.
+         */
+        "fs-tls", "fstls",
+        "\tmovq\t"  "(%rsp), %r11\n"
+        "\tmovq\t"  SPA_ASM_FS_TLS_DIFF ", %r10\n"
+        "\tmovq\t"  "%r11, (%rsp, %r10, 1)\n",
+        "\tmovq\t"  SPA_ASM_FS_TLS_DIFF ", %r11\n"
+        "\tmovq\t"  "(%rsp, %r11, 1), %r11\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmpq\t"  "*%r11\n",
+        "\tmovq\t"  SPA_ASM_FS_TLS_DIFF ", %r10\n"
+        "\tmovq\t"  "%r11, -8(%rsp, %r10, 1)\n",
+        SPA_MODE_F_SPECIAL_FUNCS | SPA_MODE_F_COUNT_CRASH | SPA_MODE_F_TLS_DIFF
+    },
+    {
+        // fs-tls for shared objects, calls are not instrumented as the prologue is relocated.
+        "fs-tls-pic", "fstls",
+        "\tmovq\t"  "(%rsp), %r11\n"
+        SPA_ASM_LOAD_FS_TLS_DIFF("%r10")
+        "\tmovq\t"  "%r11, (%rsp, %r10, 1)\n",
+        SPA_ASM_LOAD_FS_TLS_DIFF("%r11")
+        "\tmovq\t"  "(%rsp, %r11, 1), %r11\n"
+        "\taddq\t"  "$8, %rsp\n"
+        "\tjmpq\t"  "*%r11\n",
+        NULL, SPA_MODE_F_SPECIAL_FUNCS | SPA_MODE_F_COUNT_CRASH
+    },
+};
+
+#define SPA_MODE_CNT    ((int) (sizeof(spa_modes) / sizeof(spa_modes[0])))
+
+// the longest prologue/epilogue in bytes
+#define SPA_MAX_MODE_CODE_LEN   64
+
+// filled by spa-gen-modes
+struct spa_mode_layout{
+    const char *name;
+    int prologue_len;
+    // the first 8 bytes of the prologue, 0 if it is too short or needs relocation
+    unsigned long magic;
+    // the machine code, NULL if it needs relocation
+    const char *prologue_code;
+    int epilogue_len;
+    const char *epilogue_code;
+};
+
+// the default mode, when __SPA_MODE is not set
+#if defined(USE_SPA_SHADOW_STACK)
+    #define SPA_DEFAULT_MODE        "shadow-stack"
+#elif defined(USE_SPA_SHADOW_STACK_VIA_REG)
+    #define SPA_DEFAULT_MODE        "shadow-stack-reg"
+#elif defined(USE_SPA_BUDDY_STACK_TLS)
+    #define SPA_DEFAULT_MODE        "buddy-tls"
+#elif defined(USE_SPA_GS_RSP)
+    #define SPA_DEFAULT_MODE        "gs-rsp"
+#elif defined(USE_SHADESMAR_GS)
+    #define SPA_DEFAULT_MODE        "shadesmar-gs"
+#elif defined(USE_SPA_FS_GS_TLS) && defined(SPA_ENABLE_FS_TLS)
+    #define SPA_DEFAULT_MODE        "fs-tls"
+#elif defined(USE_SPA_FS_GS_TLS) && defined(SPA_ENABLE_GS_MSR)
+    #define SPA_DEFAULT_MODE        "fs-gs-tls-msr"
+#elif defined(USE_SPA_FS_GS_TLS)
+    #define SPA_DEFAULT_MODE        "fs-gs-tls"
+#elif defined(USE_SPA_BUDDY_STACK_TLS_WITH_STK_SIZE) && defined(NON_PIE_GLOBAL_VAR_FOR_STK_SIZE)
+    #define SPA_DEFAULT_MODE        "buddy-tls-stk-size-non-pie"
+#elif defined(USE_SPA_BUDDY_STACK_TLS_WITH_STK_SIZE)
+    #define SPA_DEFAULT_MODE        "buddy-tls-stk-size"
+#elif defined(USE_SPA_COMPACT_SHADOW_STACK)
+    #define SPA_DEFAULT_MODE        "compact"
+#else
+    #define SPA_DEFAULT_MODE        "shadow-stack-randvar"
+#endif
+
+#if defined(ENABLE_GS_RSP_CALL_INSTRUMENTED)
+    #define SPA_DEFAULT_INSTRUMENT_CALLS    1
+#else
+    #define SPA_DEFAULT_INSTRUMENT_CALLS    0
+#endif
+
+// the mode named @name (SPA_DEFAULT_MODE if NULL), NULL if there is no such mode.
+static inline const struct spa_mode *spa_find_mode(const char *name){
+    if(!name || !*name){
+        name = SPA_DEFAULT_MODE;
+    }
+    for(int i = 0; i < SPA_MODE_CNT; i++){
+        if(!strcmp(spa_modes[i].name, name)){
+            return &spa_modes[i];
+        }
+    }
+    return NULL;
+}
+
+#endif // SPA_MODES_H
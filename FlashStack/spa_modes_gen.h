@@ -0,0 +1,53 @@
+// Generated by spa-gen-modes from spa_modes.h, do not edit.
+
+#ifndef SPA_MODES_GEN_H
+#define SPA_MODES_GEN_H
+
+#include "spa_modes.h"
+
+static const struct spa_mode_layout spa_mode_layouts[] = {
+    {"shadow-stack", 11, 0x48ff80000024848fL,
+        "\x8f\x84\x24\x00\x00\x80\xff\x48\x83\xec\x08",
+        15, "\x48\x83\xc4\x08\x4c\x8b\x9c\x24\x00\x00\x80\xff\x41\xff\xe3"},
+    {"shadow-stack-reg", 12, 0x2484894824048b48L,
+        "\x48\x8b\x04\x24\x48\x89\x84\x24\x00\x00\x80\xff",
+        15, "\x4c\x8b\x9c\x24\x00\x00\x80\xff\x48\x83\xc4\x08\x41\xff\xe3"},
+    {"shadow-stack-randvar", 19, 0x0000000000000000L,
+        NULL,
+        22, NULL},
+    {"buddy-tls", 29, 0x0000e38149e38949L,
+        "\x49\x89\xe3\x49\x81\xe3\x00\x00\x80\xff\x4d\x8b\x9b\x00\x00\x00\xff\x4c\x03\x1c\x24\x4c\x89\x9c\x24\x00\x00\x80\xff",
+        32, "\x49\x89\xe2\x49\x81\xe2\x00\x00\x80\xff\x4c\x8b\x9c\x24\x00\x00\x80\xff\x4d\x2b\x9a\x00\x00\x00\xff\x48\x83\xc4\x08\x41\xff\xe3"},
+    {"buddy-tls-stk-size", 28, 0x0000000000000000L,
+        NULL,
+        34, NULL},
+    {"buddy-tls-stk-size-non-pie", 26, 0x0000000000000000L,
+        NULL,
+        32, NULL},
+    {"gs-rsp", 19, 0x0000ba49241c8b4cL,
+        "\x4c\x8b\x1c\x24\x49\xba\x00\x00\x00\x00\x00\x80\xff\xff\x65\x4e\x89\x1c\x14",
+        20, "\x49\xba\x00\x00\x00\x00\x00\x80\xff\xff\x48\x83\xc4\x08\x65\x42\xff\x64\x14\xf8"},
+    {"shadesmar-gs", 0, 0x0000000000000000L,
+        NULL,
+        0, NULL},
+    {"fs-gs-tls", 17, 0x148b4c65241c8b4cL,
+        "\x4c\x8b\x1c\x24\x65\x4c\x8b\x14\x25\x08\x00\x00\x00\x4e\x89\x1c\x14",
+        20, "\x65\x4c\x8b\x1c\x25\x08\x00\x00\x00\x4e\x8b\x1c\x1c\x48\x83\xc4\x08\x41\xff\xe3"},
+    {"fs-gs-tls-msr", 26, 0x1c034c65241c8b4cL,
+        "\x4c\x8b\x1c\x24\x65\x4c\x03\x1c\x25\x10\x00\x00\x00\x65\x4c\x8b\x14\x25\x08\x00\x00\x00\x4e\x89\x1c\x14",
+        29, "\x65\x4c\x8b\x1c\x25\x08\x00\x00\x00\x4e\x8b\x1c\x1c\x65\x4c\x2b\x1c\x25\x10\x00\x00\x00\x48\x83\xc4\x08\x41\xff\xe3"},
+    {"compact", 30, 0x00000825148b4c65L,
+        "\x65\x4c\x8b\x14\x25\x08\x00\x00\x00\x65\x48\x83\x04\x25\x08\x00\x00\x00\x10\x4c\x8b\x1c\x24\x4d\x89\x1a\x49\x89\x62\x08",
+        40, NULL},
+    {"fs-tls", 17, 0x148b4c64241c8b4cL,
+        NULL,
+        20, NULL},
+    {"fs-tls-pic", 19, 0x0000000000000000L,
+        NULL,
+        22, NULL},
+};
+
+_Static_assert(sizeof(spa_mode_layouts) / sizeof(spa_mode_layouts[0]) == SPA_MODE_CNT,
+               "spa_modes_gen.h is out of date");
+
+#endif // SPA_MODES_GEN_H
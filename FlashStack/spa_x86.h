@@ -0,0 +1,315 @@
+#ifndef SPA_X86_H
+#define SPA_X86_H
+
+/*
+    A length decoder for the x86-64 instructions emitted by compilers,
+    used by spa-rewrite to walk the code of uninstrumented binaries.
+
+    Only the length, the position of ModRM and the direct branch targets are decoded.
+    Instructions it does not know (3DNow!, XOP, ...) are reported as invalid,
+    so that the caller can leave the function alone.
+ */
+
+#include <string.h>
+
+enum spa_x86_kind{
+    SPA_X86_OTHER = 0,
+    SPA_X86_JMP,            // jmp rel8/rel32
+    SPA_X86_JCC,            // jcc, loop, jrcxz
+    SPA_X86_CALL,           // call rel32
+    SPA_X86_RET,            // ret, rep ret
+    SPA_X86_JMP_IND,        // jmp *r/m
+    SPA_X86_CALL_IND,       // call *r/m
+    SPA_X86_OTHER_BRANCH,   // ret imm16, far jumps/calls, int, syscall, ...
+};
+
+struct spa_x86_insn{
+    int len;
+    int modrm_off;          // -1 if there is no ModRM
+    int rip_rel;            // the 32-bit displacement at modrm_off + 1 is relative to the next instruction
+    int kind;
+    long target;            // of a direct branch, relative to the start of the instruction
+};
+
+// the immediate operand of an opcode
+#define SPA_X86_I0          0       // none
+#define SPA_X86_IB          1       // 8-bit
+#define SPA_X86_IW          2       // 16-bit
+#define SPA_X86_IZ          3       // 16/32-bit
+#define SPA_X86_IV          4       // 16/32/64-bit (mov r64, imm64)
+#define SPA_X86_IWB         5       // enter
+#define SPA_X86_IMO         6       // moffs
+#define SPA_X86_REL8        7
+#define SPA_X86_REL32       8
+#define SPA_X86_M           0x10    // has ModRM
+#define SPA_X86_BAD         0x20
+#define SPA_X86_PFX         0x40
+
+#define M_  SPA_X86_M
+#define MB_ (SPA_X86_M | SPA_X86_IB)
+#define MZ_ (SPA_X86_M | SPA_X86_IZ)
+#define B_  SPA_X86_IB
+#define Z_  SPA_X86_IZ
+#define N_  SPA_X86_I0
+#define X_  SPA_X86_BAD
+#define P_  SPA_X86_PFX
+
+static const unsigned char spa_x86_map1[256] = {
+    /* 00 */ M_, M_, M_, M_, B_, Z_, X_, X_, M_, M_, M_, M_, B_, Z_, X_, X_,
+    /* 10 */ M_, M_, M_, M_, B_, Z_, X_, X_, M_, M_, M_, M_, B_, Z_, X_, X_,
+    /* 20 */ M_, M_, M_, M_, B_, Z_, P_, X_, M_, M_, M_, M_, B_, Z_, P_, X_,
+    /* 30 */ M_, M_, M_, M_, B_, Z_, P_, X_, M_, M_, M_, M_, B_, Z_, P_, X_,
+    /* 40 */ P_, P_, P_, P_, P_, P_, P_, P_, P_, P_, P_, P_, P_, P_, P_, P_,
+    /* 50 */ N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, N_,
+    /* 60 */ X_, X_, X_, M_, P_, P_, P_, P_, Z_, MZ_, B_, MB_, N_, N_, N_, N_,
+    /* 70 */ SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8,
+             SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8,
+             SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8,
+             SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8,
+    /* 80 */ MB_, MZ_, X_, MB_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* 90 */ N_, N_, N_, N_, N_, N_, N_, N_, N_, N_, X_, N_, N_, N_, N_, N_,
+    /* a0 */ SPA_X86_IMO, SPA_X86_IMO, SPA_X86_IMO, SPA_X86_IMO, N_, N_, N_, N_,
+             B_, Z_, N_, N_, N_, N_, N_, N_,
+    /* b0 */ B_, B_, B_, B_, B_, B_, B_, B_,
+             SPA_X86_IV, SPA_X86_IV, SPA_X86_IV, SPA_X86_IV, SPA_X86_IV, SPA_X86_IV, SPA_X86_IV, SPA_X86_IV,
+    /* c0 */ MB_, MB_, SPA_X86_IW, N_, X_, X_, MB_, MZ_, SPA_X86_IWB, N_, SPA_X86_IW, N_, N_, B_, X_, N_,
+    /* d0 */ M_, M_, M_, M_, X_, X_, X_, N_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* e0 */ SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8, SPA_X86_REL8, B_, B_, B_, B_,
+             SPA_X86_REL32, SPA_X86_REL32, X_, SPA_X86_REL8, N_, N_, N_, N_,
+    /* f0 */ P_, N_, P_, P_, N_, N_, M_, M_, N_, N_, N_, N_, N_, N_, M_, M_,
+};
+
+// 0f xx
+static const unsigned char spa_x86_map2[256] = {
+    /* 00 */ M_, M_, M_, M_, X_, N_, N_, N_, N_, N_, X_, N_, X_, M_, N_, X_,
+    /* 10 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* 20 */ M_, M_, M_, M_, X_, X_, X_, X_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* 30 */ N_, N_, N_, N_, N_, N_, X_, N_, X_, X_, X_, X_, X_, X_, X_, X_,
+    /* 40 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* 50 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* 60 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* 70 */ MB_, MB_, MB_, MB_, M_, M_, M_, N_, M_, M_, X_, X_, M_, M_, M_, M_,
+    /* 80 */ SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32,
+             SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32,
+             SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32,
+             SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32, SPA_X86_REL32,
+    /* 90 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* a0 */ N_, N_, N_, M_, MB_, M_, X_, X_, N_, N_, N_, M_, MB_, M_, M_, M_,
+    /* b0 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, MB_, M_, M_, M_, M_, M_,
+    /* c0 */ M_, M_, MB_, M_, MB_, MB_, MB_, M_, N_, N_, N_, N_, N_, N_, N_, N_,
+    /* d0 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* e0 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+    /* f0 */ M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_, M_,
+};
+
+#undef M_
+#undef MB_
+#undef MZ_
+#undef B_
+#undef Z_
+#undef N_
+#undef X_
+#undef P_
+
+// the length of ModRM, SIB and displacement, -1 if @p runs past @end
+static inline int spa_x86_modrm_len(const unsigned char *p, const unsigned char *end, int *rip_rel){
+    if(p >= end){
+        return -1;
+    }
+    int mod = *p >> 6, rm = *p & 7, len = 1;
+    *rip_rel = 0;
+    if(mod == 3){
+        return len;
+    }
+    if(rm == 4){
+        if(p + 1 >= end){
+            return -1;
+        }
+        len++;
+        if(mod == 0 && (p[1] & 7) == 5){
+            len += 4;
+        }
+    }else if(mod == 0 && rm == 5){
+        *rip_rel = 1;
+        len += 4;
+    }
+    if(mod == 1){
+        len += 1;
+    }else if(mod == 2){
+        len += 4;
+    }
+    return p + len <= end ? len : -1;
+}
+
+// decode the instruction at @code, return its length or -1 if it is invalid or truncated
+static inline int spa_x86_decode(const unsigned char *code, const unsigned char *end, struct spa_x86_insn *insn){
+    const unsigned char *p = code;
+    int opsize16 = 0, addr32 = 0, rex_w = 0;
+    int imm = 0, has_modrm = 0, opcode;
+    const unsigned char *map = spa_x86_map1;
+
+    memset(insn, 0, sizeof(*insn));
+    insn->modrm_off = -1;
+
+    // legacy prefixes, then at most one REX
+    for(; p < end && p - code < 14; p++){
+        if(*p == 0x66){
+            opsize16 = 1;
+        }else if(*p == 0x67){
+            addr32 = 1;
+        }else if(*p == 0xf3 || *p == 0xf2 || *p == 0xf0 || *p == 0x2e || *p == 0x3e || *p == 0x26
+                    || *p == 0x36 || *p == 0x64 || *p == 0x65){
+            ;
+        }else{
+            break;
+        }
+    }
+    if(p < end && (*p & 0xf0) == 0x40){
+        rex_w = (*p & 8) != 0;
+        p++;
+    }
+    if(p >= end){
+        return -1;
+    }
+    opcode = *p++;
+
+    if(opcode == 0xc4 || opcode == 0xc5 || opcode == 0x62){
+        // VEX or EVEX, always followed by the opcode and ModRM in 64-bit mode
+        int vex_map = 1, pfx = opcode == 0xc5 ? 1 : (opcode == 0xc4 ? 2 : 3);
+        if(p + pfx >= end){
+            return -1;
+        }
+        if(opcode != 0xc5){
+            vex_map = p[0] & (opcode == 0xc4 ? 0x1f : 0x7);
+        }
+        p += pfx;
+        opcode = *p++;
+        if(vex_map == 1 && opcode == 0x77){
+            // vzeroupper, vzeroall
+            insn->len = p - code;
+            return insn->len;
+        }
+        if(vex_map < 1 || vex_map > 3){
+            return -1;
+        }
+        has_modrm = 1;
+        if(vex_map == 3 || (vex_map == 1 && (spa_x86_map2[opcode] & 0xf) == SPA_X86_IB)){
+            imm = SPA_X86_IB;
+        }
+    }else{
+        if(opcode == 0x0f){
+            if(p >= end){
+                return -1;
+            }
+            opcode = *p++;
+            if(opcode == 0x38 || opcode == 0x3a){
+                if(p >= end){
+                    return -1;
+                }
+                imm = opcode == 0x3a ? SPA_X86_IB : SPA_X86_I0;
+                opcode = *p++;
+                has_modrm = 1;
+                map = NULL;
+            }else{
+                map = spa_x86_map2;
+            }
+        }
+        if(map){
+            int attr = map[opcode];
+            if(attr & (SPA_X86_BAD | SPA_X86_PFX)){
+                return -1;
+            }
+            has_modrm = (attr & SPA_X86_M) != 0;
+            imm = attr & 0xf;
+        }
+        if(map == spa_x86_map1){
+            // XOP is not supported, 8f /0 is pop r/m
+            if(opcode == 0x8f && p < end && (*p & 0x38)){
+                return -1;
+            }
+            // test r/m, imm
+            if((opcode == 0xf6 || opcode == 0xf7) && p < end && ((*p >> 3) & 7) < 2){
+                imm = opcode == 0xf6 ? SPA_X86_IB : SPA_X86_IZ;
+            }
+            if(opcode == 0xc3){
+                insn->kind = SPA_X86_RET;
+            }else if(opcode == 0xc2 || opcode == 0xca || opcode == 0xcb || opcode == 0xcf
+                        || opcode == 0xcc || opcode == 0xcd || opcode == 0xf1 || opcode == 0xf4){
+                insn->kind = SPA_X86_OTHER_BRANCH;
+            }else if(opcode == 0xe8){
+                insn->kind = SPA_X86_CALL;
+            }else if(opcode == 0xe9 || opcode == 0xeb){
+                insn->kind = SPA_X86_JMP;
+            }else if((opcode >= 0x70 && opcode <= 0x7f) || (opcode >= 0xe0 && opcode <= 0xe3)){
+                insn->kind = SPA_X86_JCC;
+            }else if(opcode == 0xff && p < end){
+                int reg = (*p >> 3) & 7;
+                if(reg == 2){
+                    insn->kind = SPA_X86_CALL_IND;
+                }else if(reg == 4){
+                    insn->kind = SPA_X86_JMP_IND;
+                }else if(reg == 3 || reg == 5 || reg == 7){
+                    insn->kind = reg == 7 ? SPA_X86_OTHER : SPA_X86_OTHER_BRANCH;
+                }
+            }
+        }else if(map == spa_x86_map2){
+            if(opcode >= 0x80 && opcode <= 0x8f){
+                insn->kind = SPA_X86_JCC;
+            }else if(opcode == 0x05 || opcode == 0x07 || opcode == 0x0b || opcode == 0x34 || opcode == 0x35){
+                insn->kind = SPA_X86_OTHER_BRANCH;
+            }
+        }
+    }
+
+    if(has_modrm){
+        int rip_rel, n = spa_x86_modrm_len(p, end, &rip_rel);
+        if(n < 0){
+            return -1;
+        }
+        insn->modrm_off = p - code;
+        insn->rip_rel = rip_rel;
+        p += n;
+    }
+    switch(imm){
+    case SPA_X86_IB:
+        p += 1;
+        break;
+    case SPA_X86_IW:
+        p += 2;
+        break;
+    case SPA_X86_IZ:
+        p += (opsize16 && !rex_w) ? 2 : 4;
+        break;
+    case SPA_X86_IV:
+        p += rex_w ? 8 : (opsize16 ? 2 : 4);
+        break;
+    case SPA_X86_IWB:
+        p += 3;
+        break;
+    case SPA_X86_IMO:
+        p += addr32 ? 4 : 8;
+        break;
+    case SPA_X86_REL8:
+        if(p + 1 > end){
+            return -1;
+        }
+        insn->target = (p + 1 - code) + (signed char) *p;
+        p += 1;
+        break;
+    case SPA_X86_REL32:
+        // the operand size of near branches is not changed by 0x66 on Intel CPUs
+        if(opsize16 || p + 4 > end){
+            return -1;
+        }
+        insn->target = (p + 4 - code) + (long) (int) (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned) p[3] << 24));
+        p += 4;
+        break;
+    }
+    if(p > end){
+        return -1;
+    }
+    insn->len = p - code;
+    return insn->len;
+}
+
+#endif // SPA_X86_H
@@ -2,6 +2,17 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/user.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "spa.h"
 
 unsigned long spa_get_cur_time_us(void) {
     struct timeval tv;
@@ -20,3 +31,113 @@ unsigned long spa_get_cur_time_us(void) {
 
 //    return (t_spec.tv_sec * 1000000UL) + (t_spec.tv_nsec / 1000);
 //}
+
+
+/*
+    Copy the attributes in @src to @dst (initialized by pthread_attr_init()),
+    so that the stack size of a thread can be changed without touching the caller's object.
+    Return -1 if @src comes with its own stack (pthread_attr_setstack()), which cannot be resized.
+ */
+int spa_copy_thread_attr(pthread_attr_t *dst, const pthread_attr_t *src){
+    void *stackaddr;
+    size_t size;
+    int v;
+    struct sched_param param;
+    cpu_set_t cpus;
+
+    // without its own stack, glibc reports the address as NULL - stacksize, which adds up to 0
+    if(pthread_attr_getstack(src, &stackaddr, &size) == 0 && (uintptr_t) stackaddr + size != 0){
+        return -1;
+    }
+    if(pthread_attr_getdetachstate(src, &v) == 0){
+        pthread_attr_setdetachstate(dst, v);
+    }
+    if(pthread_attr_getguardsize(src, &size) == 0){
+        pthread_attr_setguardsize(dst, size);
+    }
+    if(pthread_attr_getstacksize(src, &size) == 0){
+        pthread_attr_setstacksize(dst, size);
+    }
+    if(pthread_attr_getscope(src, &v) == 0){
+        pthread_attr_setscope(dst, v);
+    }
+    if(pthread_attr_getschedpolicy(src, &v) == 0){
+        pthread_attr_setschedpolicy(dst, v);
+    }
+    if(pthread_attr_getschedparam(src, &param) == 0){
+        pthread_attr_setschedparam(dst, &param);
+    }
+    if(pthread_attr_getinheritsched(src, &v) == 0){
+        pthread_attr_setinheritsched(dst, v);
+    }
+    // all CPUs are reported if no affinity is set, then the thread should inherit the creator's
+    if(pthread_attr_getaffinity_np(src, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) < CPU_SETSIZE){
+        pthread_attr_setaffinity_np(dst, sizeof(cpus), &cpus);
+    }
+#if defined(PTHREAD_ATTR_NO_SIGMASK_NP)
+    sigset_t mask;
+    if(pthread_attr_getsigmask_np(src, &mask) == 0){
+        pthread_attr_setsigmask_np(dst, &mask);
+    }
+#endif
+    return 0;
+}
+
+// the call stack size of the main thread, RLIMIT_STACK but no more than @max_size
+long spa_main_call_stack_size(long max_size){
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_STACK, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= (rlim_t) max_size){
+        return max_size;
+    }
+    long size = (rl.rlim_cur + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    return size < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : size;
+}
+
+// the end of the highest resident page in [start, end), or @start if none
+char *spa_resident_end(char *start, char *end){
+    unsigned char vec[512];
+    char *last = start;
+    for(char *p = start; p < end; p += sizeof(vec) * PAGE_SIZE){
+        long len = end - p < (long) (sizeof(vec) * PAGE_SIZE) ? end - p : (long) (sizeof(vec) * PAGE_SIZE);
+        if(mincore(p, len, vec) != 0){
+            return end;
+        }
+        for(long i = (len + PAGE_SIZE - 1) / PAGE_SIZE - 1; i >= 0; i--){
+            if(vec[i] & 1){
+                last = p + (i + 1) * PAGE_SIZE;
+                break;
+            }
+        }
+    }
+    return last;
+}
+
+/*
+    Copy [@from, @to) of a shadow stack to the one @delta bytes away.
+    Rerandomization copies only the live part of the shadow stack, rather than mremap() the whole of it,
+    which rewrites the page tables of the old one and so flushes the TLBs of every CPU running the process.
+ */
+void spa_copy_shadow_stack(char *from, char *to, long delta){
+    if(to > from){
+        // one call rather than a page fault per page
+        madvise(from + delta, to - from, MADV_POPULATE_WRITE);
+        memcpy(from + delta, from, to - from);
+    }
+}
+
+// released by @release later, once SPA_RETIRE_BATCH of them are left
+void spa_retire_shadow_stack(struct spa_retired_shadow_stacks *retired, void *addr, unsigned long size,
+                             SPA_RELEASE_FUNC release){
+    if(retired->cnt == SPA_RETIRE_BATCH){
+        spa_release_retired_shadow_stacks(retired, size, release);
+    }
+    retired->addrs[retired->cnt++] = addr;
+}
+
+void spa_release_retired_shadow_stacks(struct spa_retired_shadow_stacks *retired, unsigned long size,
+                                       SPA_RELEASE_FUNC release){
+    for(long i = 0; i < retired->cnt; i++){
+        release(retired->addrs[i], size);
+    }
+    retired->cnt = 0;
+}
@@ -0,0 +1,11 @@
+/*
+    Built without FlashStack, so it has no record in .spa.stack_info,
+    like a function in libc.
+ */
+#include <string.h>
+
+long big_frame(long n){
+    volatile char buf[1 << 20];
+    memset((char *) buf, (int) n, sizeof(buf));
+    return buf[n % sizeof(buf)];
+}
@@ -0,0 +1,78 @@
+/*
+    dTLB misses of a deep-call workload, e.g.
+
+        make deep_calls CC=spa-clang
+        ./deep_calls
+        __SPA_SHADOW_HUGEPAGE=1 ./deep_calls
+
+    With the gs-rsp mode, each call also writes its return address to the shadow stack,
+    so the shadow pages double the TLB footprint of the call stack.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define  FRAME_SIZE     1024
+
+static int open_dtlb_counter(void){
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+__attribute__((noinline)) long deep_call(long depth){
+    volatile char frame[FRAME_SIZE];
+    frame[0] = (char) depth;
+    if(depth == 0){
+        return frame[0];
+    }
+    return deep_call(depth - 1) + frame[0];
+}
+
+int main(int argc, char *argv[]){
+    long depth = argc > 1 ? atol(argv[1]) : 4000;
+    long rounds = argc > 2 ? atol(argv[2]) : 2000;
+    long sum = 0;
+    long long misses = 0;
+    struct timespec from, to;
+
+    // the pages are faulted in before counting
+    sum += deep_call(depth);
+
+    int fd = open_dtlb_counter();
+    if(fd < 0){
+        perror("perf_event_open(), only the time is measured");
+    }else{
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &from);
+    for(long i = 0; i < rounds; i++){
+        sum += deep_call(depth);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    if(fd >= 0){
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fd, &misses, sizeof(misses)) != sizeof(misses)){
+            misses = -1;
+        }
+        close(fd);
+    }
+    double ms = (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+    printf("depth = %ld, rounds = %ld, dTLB load misses = %lld, %.2f per call, %.2f ms (%ld)\n",
+           depth, rounds, misses, (double) misses / (depth * rounds), ms, sum);
+    return 0;
+}
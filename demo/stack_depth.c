@@ -0,0 +1,25 @@
+/*
+    A thread whose start routine has a small frame but calls big_frame() (see big_frame.c),
+    which needs 1MB of stack that spa-stack-depth cannot see.
+    The start routine must not get a bound, or its thread would overflow a stack sized by it.
+
+    make stack_depth CC=spa-clang
+ */
+#include <stdio.h>
+#include <pthread.h>
+
+long big_frame(long n);
+
+static void *worker(void *arg){
+    return (void *) big_frame((long) arg);
+}
+
+int main(void){
+    pthread_t tid;
+    void *ret;
+
+    pthread_create(&tid, NULL, worker, (void *) 3);
+    pthread_join(tid, &ret);
+    printf("big_frame() returned %ld\n", (long) ret);
+    return 0;
+}
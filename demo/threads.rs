@@ -0,0 +1,14 @@
+// Threads created by std, whose pthread_create() must be the one of the runtime library.
+//
+//     make rust_threads
+use std::thread;
+
+fn fib(n: u64) -> u64 {
+    if n < 2 { n } else { fib(n - 1) + fib(n - 2) }
+}
+
+fn main() {
+    let handles: Vec<_> = (0..4).map(|i| thread::spawn(move || fib(20 + i))).collect();
+    let sum: u64 = handles.into_iter().map(|h| h.join().unwrap()).sum();
+    println!("fib(20) + ... + fib(23) = {}", sum);
+}